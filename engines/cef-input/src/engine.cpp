@@ -3,7 +3,7 @@
 #include <chrono>
 #include "engine.h"
 #include "notifier.h"
-#include "sync_clock.h"
+#include "frame_pacer.h"
 #include "SDLRenderer.h"
 #include "FFMPEG_sm_producer.h"
 #include "FFMPEG_utils.h"
@@ -209,6 +209,7 @@ void *sandbox_info = nullptr;
         frameExt->AVFrame = frameDeepClone(videoFrame);
         frameExt->timeBase = { 1, 25 };
         frameExt->fieldOrder = AV_FIELD_PROGRESSIVE;      
+        frameExt->times.capture = shm_timestamp();
         push(frameExt);
   }));
 
@@ -253,17 +254,13 @@ void *sandbox_info = nullptr;
 void CefInputEngine::workerThreadFunc()
 {
   int64_t frameCount = 0;
-  SyncClock clock;
+  FramePacer pacer;
 
   // renderer
   SDLRenderer renderer;
   std::string title = UID_;
   renderer.init(title.c_str());
 
-  // sm protocol
-  FFMPEGSharedMemoryProducer sm;
-  sm.init(UID_.c_str());
-
   // video
   int width = 800;
   int height = 600;
@@ -287,6 +284,11 @@ void CefInputEngine::workerThreadFunc()
   uint8_t* videoBuffer = (uint8_t*)av_malloc(videoBufferSize);
   av_image_fill_arrays(videoFrame->data, videoFrame->linesize, videoBuffer, pixFmt, width, height, 1);
 
+  // sm protocol. Slots sized for the browser frame
+  FFMPEGSharedMemoryProducer sm;
+  sm.setFrameRate(25, 1);
+  sm.init(UID_.c_str(), FFMPEGSharedMemoryProducer::slotSize(width, height, pixFmt));
+
   while(!abort_)
   {
     // draw video
@@ -301,17 +303,20 @@ void CefInputEngine::workerThreadFunc()
 
     frameCount++;
 
-    AVFrameExt frameExt = { videoTimeBase, fieldOrder, AVMEDIA_TYPE_VIDEO, 0, videoFrame };
+    AVFrameExt frameExt;
+    frameExt.timeBase = videoTimeBase;
+    frameExt.fieldOrder = fieldOrder;
+    frameExt.mediaType = AVMEDIA_TYPE_VIDEO;
+    frameExt.streamIndex = 0;
+    frameExt.AVFrame = videoFrame;
 
     /* buffer consumer */
-    long long frd = frameDuration(&frameExt);
     {
       std::lock_guard<std::mutex> lock(frameBufferMutex_);
       AVFrameExt* frameExtInput = begin();
       if(frameExtInput)
       {
         frameExt.copy(frameExtInput);
-        frd = frameDuration(&frameExt);
       }
 
       /* sm producer */
@@ -320,8 +325,11 @@ void CefInputEngine::workerThreadFunc()
       renderer.render(frameExt.AVFrame);
     }
 
-    // sync
-    clock.sync(frd);
+    // pace, absolute deadlines
+    AVRational period = framePeriod(&frameExt);
+    pacer.wait(period.num, period.den);
+    std::string report = pacer.report();
+    if(!report.empty()) notifyInfo("Pacer %s", report.c_str());
   }
   
   // clean up
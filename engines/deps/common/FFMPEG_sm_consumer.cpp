@@ -1,8 +1,9 @@
+#include <algorithm>
 #include "FFMPEG_sm_consumer.h"
 #include "FFMPEG_sm_element.h"
-#include "clock.h"
 #include "notifier.h"
 #include "FFMPEG_utils.h"
+#include "crc32c.h"
 
 using namespace std::chrono_literals;
 
@@ -17,22 +18,133 @@ FFMPEGSharedMemoryConsumer::~FFMPEGSharedMemoryConsumer()
 
 }
 
-bool FFMPEGSharedMemoryConsumer::init(const char *_id, int _msTimeout)
+// process wide registry handle, null segment when it could not be opened
+static ShMRegistryHandle * registry()
 {
-  bool ret = SharedMemoryConsumer::init(_id, _msTimeout);
+  static ShMRegistryHandle handle = shm_registry_open();
+  return handle.reg? &handle : nullptr;
+}
+
+// lookup: source published by a live producer
+bool FFMPEGSharedMemoryConsumer::lookup(const char *_id, ShMSource *_source)
+{
+  ShMRegistryHandle *reg = registry();
+  return reg && shm_registry_find(reg, _id, _source);
+}
+
+// waitSource: block until _id is published or _msTimeout expires. Without a registry the caller probes
+bool FFMPEGSharedMemoryConsumer::waitSource(const char *_id, int _msTimeout)
+{
+  ShMRegistryHandle *reg = registry();
+  if(!reg) return true;
+
+  long long deadline = shm_timestamp() + (_msTimeout * 1000000LL);
+  while(true)
+  {
+    long long generation = reg->reg->generation;
+    if(shm_registry_find(reg, _id, nullptr)) return true;
+
+    long long ms = (deadline - shm_timestamp()) / 1000000;
+    if(ms <= 0) return false;
+    shm_registry_wait(reg, generation, (int) ms);
+  }
+}
+
+bool FFMPEGSharedMemoryConsumer::init(const char *_id, int _msTimeout, AVMediaType _mediaType)
+{
+  mediaType_ = _mediaType;
+
+  // the registry knows whether the producer (and its ring for this media type) is up, no need to probe
+  ShMSource source;
+  if(registry() && !(lookup(_id, &source) && (source.media & (1 << mediaRing(_mediaType)))))
+  {
+    return false;
+  }
+
+  // rendition: the producer opens its ring with the next frame. Every entry taken: read the source and scale here
+  std::string name = subRingName(_id, _mediaType);
+  rendition_ = (renditionWidth_ > 0) && (_mediaType == AVMEDIA_TYPE_VIDEO) && requestRendition(_id);
+  if(rendition_)
+  {
+    name = renditionName(_id, renditionWidth_, renditionHeight_, renditionFormat_);
+    if(registry() && !lookup(name.c_str())) return false;
+  }
+
+  bool ret = SharedMemoryConsumer::init(name.c_str(), _msTimeout);
   if(ret)
   {
     notifyInfo("SM client %s connected", ID_.c_str());
   }
+  lastFrame_ = shm_timestamp();
+  onBackup_ = false;
   return ret;
 }
 
+// setRendition: read a _width x _height _format (-1: source format) copy of the video, scaled once by the
+// producer for every consumer asking for it. Takes effect on init
+void FFMPEGSharedMemoryConsumer::setRendition(int _width, int _height, int _format)
+{
+  renditionWidth_ = _width;
+  renditionHeight_ = _height;
+  renditionFormat_ = _format;
+}
+
+// requestRendition: rendition request (or lease renewal) in the source control segment
+bool FFMPEGSharedMemoryConsumer::requestRendition(const char *_id)
+{
+  if(!sourceCtl_.ctl)
+  {
+    sourceCtl_ = shm_control_connect(_id);
+    if(!sourceCtl_.ctl) return false;
+  }
+
+  lastRenew_ = shm_timestamp();
+  return shm_rendition_request(&sourceCtl_, renditionWidth_, renditionHeight_, renditionFormat_);
+}
+
+// renewRendition: the producer drops renditions nobody renewed for SHM_RENDITION_LEASE
+void FFMPEGSharedMemoryConsumer::renewRendition()
+{
+  if(!rendition_ || !sourceCtl_.ctl) return;
+
+  long long now = shm_timestamp();
+  if(now - lastRenew_ < RENDITION_RENEW) return;
+  lastRenew_ = now;
+  shm_rendition_request(&sourceCtl_, renditionWidth_, renditionHeight_, renditionFormat_);
+}
+
+// setBackup: source read from while this one stalls (no frame for _msStall, 0: two frame durations) or its
+// producer is gone. Kept connected but not registered as a reader until needed, so switching takes one frame
+void FFMPEGSharedMemoryConsumer::setBackup(const char *_id, int _msStall)
+{
+  backupID_ = _id? _id : "";
+  msStall_ = _msStall;
+}
+
 bool FFMPEGSharedMemoryConsumer::deinit()
 {
+  if(backup_)
+  {
+    backup_->deinit();
+    delete backup_;
+    backup_ = nullptr;
+  }
+  onBackup_ = false;
+
+  shm_control_close(&sourceCtl_);
+  rendition_ = false;
+
+  for(auto &codecPar : codecPars_)
+  {
+    avcodec_parameters_free(&codecPar.second);
+  }
+  codecPars_.clear();
+
   bool ret = SharedMemoryConsumer::deinit();
   if(ret)
   {
-    notifyInfo("SM client %s disconnected", ID_.c_str());
+    reportLatency();
+    notifyInfo("SM client %s disconnected (dropped %llu, torn %llu, crc errors %llu)", ID_.c_str(), dropped_, torn_, crcErrors_);
   }
   return ret;
 }
@@ -41,70 +153,571 @@ extern "C" {
 #include <libavutil/imgutils.h>
 }
 
+// read: next frame, blocking up to the configured timeout. With a backup source, frames come from the backup
+// while this source stalls and from this one again as soon as it delivers
 AVFrameExt * FFMPEGSharedMemoryConsumer::read()
 {
+  if(backupID_.empty())
+  {
+    return readFrame(msTimeout_);
+  }
+
+  long long deadline = shm_timestamp() + (msTimeout_ * 1000000LL);
+  while(true)
+  {
+    long long now = shm_timestamp();
+    if(now >= deadline) return nullptr;
+
+    // standby backup keeps its rendition
+    if(backup_) backup_->renewRendition();
+
+    bool stall = stalled(now);
+    if(stall && !onBackup_ && connectBackup())
+    {
+      backup_->resume();
+      onBackup_ = true;
+      notifyWarning("SM client %s stalled, switching to backup %s", ID_.c_str(), backupID_.c_str());
+    }
+
+    // this source: block until it stalls, only poll it while the backup delivers
+    long long ns = std::min(deadline - now, onBackup_? 0 : (stall? BACKUP_POLL * 1000000LL : lastFrame_ + stallTime() - now));
+    AVFrameExt *ret = readFrame((int) ((ns + 999999) / 1000000));
+    if(ret)
+    {
+      lastFrame_ = shm_timestamp();
+      long long duration = frameDuration(ret);
+      if(duration > 0) frameDuration_ = duration * 100;
+      if(onBackup_)
+      {
+        backup_->suspend();
+        onBackup_ = false;
+        notifyInfo("SM client %s back from backup %s", ID_.c_str(), backupID_.c_str());
+      }
+      return ret;
+    }
+
+    if(onBackup_)
+    {
+      ret = backup_->readFrame(BACKUP_POLL);
+      if(ret) return ret;
+    }
+  }
+}
+
+// stalled: no frame for the stall time, or the producer is gone
+bool FFMPEGSharedMemoryConsumer::stalled(long long _now)
+{
+  return !opened_ || (_now - lastFrame_ > stallTime());
+}
+
+long long FFMPEGSharedMemoryConsumer::stallTime()
+{
+  if(msStall_ > 0) return msStall_ * 1000000LL;
+  return (frameDuration_ > 0)? 2 * frameDuration_ : BACKUP_STALL * 1000000LL;
+}
+
+// connectBackup: backup consumer, connected on first need and retried while its producer is not there
+bool FFMPEGSharedMemoryConsumer::connectBackup()
+{
+  if(backup_ && backup_->attached()) return true;
+
+  long long now = shm_timestamp();
+  if(now - lastBackupTry_ < BACKUP_RETRY * 1000000LL) return false;
+  lastBackupTry_ = now;
+
+  if(!backup_) backup_ = new FFMPEGSharedMemoryConsumer();
+  backup_->setRendition(renditionWidth_, renditionHeight_, renditionFormat_);
+  if(!backup_->init(backupID_.c_str(), msTimeout_, mediaType_)) return false;
+  backup_->setZeroCopy(zeroCopy_);
+  backup_->setPinned(pinned_);
+  backup_->suspend();
+  return true;
+}
+
+// retire: rings zero copy frames still point into stay mapped until the last of them is freed
+void FFMPEGSharedMemoryConsumer::retire(ShMHandle *_handle)
+{
+  for(auto it = mappings_.begin(); it != mappings_.end(); it++)
+  {
+    FFMPEGSMMapping *mapping = *it;
+    if(mapping->rb != _handle->rb) continue;
+    mapping->handle = *_handle;
+    *_handle = ShMHandle();
+    mappings_.erase(it);
+    releaseMapping(mapping);
+    return;
+  }
+
+  SharedMemoryConsumer::retire(_handle);
+}
+
+// hold: zero copy frames reference the ring mapping they point into, a remap does not unmap it under them.
+// Pinned (_slot >= 0) the frame buffer also holds the slot: freeing its last reference (av_frame_free,
+// encoders done with it) unpins it. Unpinned frames keep the mapping through opaque_ref
+bool FFMPEGSharedMemoryConsumer::hold(AVFrameExt *_frame, const unsigned char *_data, int _size, int _slot, long long _stamp)
+{
+  FFMPEGSMMapping *mapping = nullptr;
+  for(auto m : mappings_)
+  {
+    if(m->rb == smHandle_.rb) mapping = m;
+  }
+  if(!mapping)
+  {
+    mapping = new FFMPEGSMMapping();
+    mapping->rb = smHandle_.rb;
+    mapping->refs = 1;
+    mappings_.push_back(mapping);
+  }
+
+  mapping->refs++;
+  AVBufferRef *buf = av_buffer_create((uint8_t *) _data, _size, (_slot >= 0)? unpinBuffer : unmapBuffer, mapping, AV_BUFFER_FLAG_READONLY);
+  if(!buf)
+  {
+    mapping->refs--;
+    return false;
+  }
+
+  if(_slot < 0)
+  {
+    if(_frame->AVFrame) _frame->AVFrame->opaque_ref = buf;
+    else if(_frame->AVPacket) _frame->AVPacket->opaque_ref = buf;
+    return true;
+  }
+
+  if(_frame->AVFrame) _frame->AVFrame->buf[0] = buf;
+  else if(_frame->AVPacket) _frame->AVPacket->buf = buf;
+  _frame->smSlot = _slot;
+  _frame->smStamp = _stamp;
+  return true;
+}
+
+void FFMPEGSharedMemoryConsumer::unpinBuffer(void *_opaque, unsigned char *_data)
+{
+  FFMPEGSMMapping *mapping = (FFMPEGSMMapping *) _opaque;
+  shm_unpin(mapping->rb, shm_slotindex(mapping->rb, (unsigned long long) (_data - (unsigned char *) mapping->rb)));
+  releaseMapping(mapping);
+}
+
+void FFMPEGSharedMemoryConsumer::unmapBuffer(void *_opaque, unsigned char *_data)
+{
+  releaseMapping((FFMPEGSMMapping *) _opaque);
+}
+
+void FFMPEGSharedMemoryConsumer::releaseMapping(FFMPEGSMMapping *_mapping)
+{
+  if(--_mapping->refs == 0)
+  {
+    shm_close(&_mapping->handle);
+    delete _mapping;
+  }
+}
+
+// readFrame: next frame of this source, blocking up to _msTimeout (0: just look)
+AVFrameExt * FFMPEGSharedMemoryConsumer::readFrame(int _msTimeout)
+{
+  if(stream()) return readStream(_msTimeout);
+
   AVFrameExt *ret = nullptr;
   bool timeout = false;
 
-  long long startTime = Clock::instance().elapsed();
-  long long timeoutTime = startTime + (msTimeout_ * 1000000LL);
+  // wall time, even offline: timeouts are about producers that went away
+  long long startTime = shm_timestamp();
+  long long timeoutTime = startTime + (_msTimeout * 1000000LL);
   
-  while(!timeout)
+  // producer gone: wait() looks for its restart
+  while(!timeout && attached())
   {
-    if(SharedMemoryConsumer::read())
+    renewRendition();
+    if(zeroCopy_)
     {
-      if( (lastMsgID_ == 0) || (msgID_ != lastMsgID_) )
+      long long seq = -1;
+      int size = 0;
+      const unsigned char *data = view(&seq, &size);
+      if(data)
       {
-        lastMsgID_ = msgID_;
-
-        FFMPEGSMElement *fe = (FFMPEGSMElement *) data_;
-
-        ret = new AVFrameExt();
-        ret->timeBase = fe->timebase;
-        ret->fieldOrder = fe->fieldOrder;
-        ret->mediaType = fe->mediaType;
-        ret->streamIndex = fe->streamIndex;
+        // pinned: the producer keeps off the slot while we hold the frame, wherever it is. It has pinned slots
+        // once we asked for them
+        if(pinned_) shm_pins_request(&ctlHandle_, PIN_REQUEST);
+        int slot = -1;
+        long long stamp = pinned_? shm_pin(smHandle_.rb, seq, &slot) : -1;
 
-        if( (fe->mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO) || (fe->mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO) )
+        // producer about to lap us. Fall back to copy
+        bool fallback = (stamp < 0) && ((smHandle_.rb->wseq - seq) >= (smHandle_.rb->count - 1));
+        if(fallback)
         {
-          AVFrame *avFrame = av_frame_alloc();
-          if(avFrame)
+          if(copy(seq) && verify(data_, msgSize_, seq))
           {
-            avFrame->width = fe->width;
-            avFrame->height = fe->height;
-            avFrame->format = fe->format;
-            avFrame->duration = fe->duration;
-            unsigned char *avBuffer = (unsigned char *) (fe + 1);
-            int dataOffset = 0;
-            if(fe->mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO)
-            {
-              av_image_fill_arrays(avFrame->data, avFrame->linesize, avBuffer, (AVPixelFormat) avFrame->format, avFrame->width, avFrame->height, 1);
-            }
-            else if(fe->mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO)
-            {
-              avFrame->data[0] = avBuffer;
-              avFrame->linesize[0] = fe->linesize[0];
-            }
-            ret->AVFrame = avFrame;
+            ret = own(unpack(data_));
+            break;
           }
+          continue;
         }
-        else if(fe->mediaType == AVMEDIA_TYPE_DATA)
+
+        if(verify(data, size, seq))
         {
-          AVPacket *packet = av_packet_alloc();
-          if(packet)
+          ret = unpack(data);
+          if(ret)
           {
-            packet->size = fe->packetSize;
-            unsigned char *dataBuffer = (unsigned char*) (fe + 1);
-            packet->data = dataBuffer;
-            ret->AVPacket = packet;
+            ret->smRing = smHandle_.rb;
+            ret->smSeq = seq;
+            if(hold(ret, data, size, (stamp >= 0)? slot : -1, stamp)) stamp = -1;
+            else ret = own(ret);
           }
         }
+        if(stamp >= 0) shm_unpin(smHandle_.rb, slot);
+        if(ret) break;
+        continue;
+      }
+    }
+    else if(SharedMemoryConsumer::read())
+    {
+      if(verify(data_, msgSize_, msgSeq_))
+      {
+        ret = unpack(data_);
         break;
       }
+      continue;
+    }
+
+    // block until the producer publishes (woken by it), no polling
+    long long remaining = timeoutTime - shm_timestamp();
+    if(remaining > 0)
+    {
+      wait((int) ((remaining + 999999) / 1000000));
+    }
+    timeout = shm_timestamp() >= timeoutTime;
+  }
+
+  if(ret)
+  {
+    measure(ret);
+  }
+
+  return ret;
+}
+
+// codecParameters: last codec parameters of a packet stream, null until a keyframe brought them
+const AVCodecParameters * FFMPEGSharedMemoryConsumer::codecParameters(int _streamIndex)
+{
+  auto it = codecPars_.find(_streamIndex);
+  return (it != codecPars_.end())? it->second : nullptr;
+}
+
+// readStream: stream ring. Records are drained all at once, then handed out joined as long as the format holds.
+// Frames keep the producer sample format and planes (no resampling)
+AVFrameExt * FFMPEGSharedMemoryConsumer::readStream(int _msTimeout)
+{
+  AVFrameExt *ret = nullptr;
+  long long timeoutTime = shm_timestamp() + (_msTimeout * 1000000LL);
+
+  while(attached())
+  {
+    if(streamPos_ >= streamEnd_)
+    {
+      streamPos_ = 0;
+      streamEnd_ = std::max(drain(), 0);
+    }
+    if(streamPos_ < streamEnd_)
+    {
+      ret = joinRecords();
+      if(ret) break;
+      continue;
+    }
+
+    long long remaining = timeoutTime - shm_timestamp();
+    if(remaining <= 0) break;
+    wait((int) ((remaining + 999999) / 1000000));
+  }
+
+  if(ret)
+  {
+    measure(ret);
+  }
+
+  return ret;
+}
+
+// joinRecords: pending records with the format of the first one as one frame. Timestamps and latency trail
+// of the first one, the rest is left for the next read
+AVFrameExt * FFMPEGSharedMemoryConsumer::joinRecords()
+{
+  const ShMRecord *first = (const ShMRecord *) (data_ + streamPos_);
+  const FFMPEGSMElement *fe = (const FFMPEGSMElement *) (first + 1);
+
+  int end = streamPos_;
+  int nbSamples = 0;
+  long long duration = 0;
+  while(end < streamEnd_)
+  {
+    const ShMRecord *record = (const ShMRecord *) (data_ + end);
+    const FFMPEGSMElement *e = (const FFMPEGSMElement *) (record + 1);
+    if( (e->mediaType != AVMEDIA_TYPE_AUDIO) || (e->format != fe->format) || (e->sampleRate != fe->sampleRate) ||
+        (e->channels != fe->channels) || (e->channelMask != fe->channelMask) ) break;
+    if(!verify((const unsigned char *) e, record->size, record->pos)) break;
+    nbSamples += e->nbSamples;
+    duration += e->duration;
+    end += shm_recordsize(record->size);
+  }
+  if(nbSamples == 0)
+  {
+    // nothing to play at the front (corrupt record, not audio). Skip it
+    streamPos_ = (end > streamPos_)? end : streamPos_ + (int) shm_recordsize(first->size);
+    return nullptr;
+  }
+
+  // always an owned buffer, even for a single record: data_ is drained over (and freed on remap) while callers
+  // still hold the frame
+  AVFrame *avFrame = av_frame_alloc();
+  if(!avFrame) return nullptr;
+  avFrame->format = fe->format;
+  avFrame->nb_samples = nbSamples;
+  avFrame->duration = duration;
+  avFrame->pts = fe->pts;
+  avFrame->pkt_dts = fe->dts;
+  avFrame->best_effort_timestamp = fe->bestEffortTimestamp;
+  avFrame->sample_rate = fe->sampleRate;
+  avFrame->ch_layout.order = (AVChannelOrder) fe->channelOrder;
+  avFrame->ch_layout.nb_channels = fe->channels;
+  avFrame->ch_layout.u.mask = fe->channelMask;
+  if(av_frame_get_buffer(avFrame, 0) < 0)
+  {
+    av_frame_free(&avFrame);
+    return nullptr;
+  }
+
+  // records hold the planes back to back without padding
+  int planes = (fe->planes > 0)? fe->planes : 1;
+  int offset = 0;
+  for(int pos = streamPos_; pos < end;)
+  {
+    const ShMRecord *record = (const ShMRecord *) (data_ + pos);
+    const FFMPEGSMElement *e = (const FFMPEGSMElement *) (record + 1);
+    const unsigned char *payload = (const unsigned char *) (e + 1);
+    for(int i = 0; i < planes; i++)
+    {
+      memcpy(avFrame->extended_data[i] + offset, payload + audioPlaneOffset(e, i), e->linesize[0]);
+    }
+    offset += e->linesize[0];
+    pos += shm_recordsize(record->size);
+  }
+  streamPos_ = end;
+
+  AVFrameExt *ret = new AVFrameExt();
+  ret->timeBase = fe->timebase;
+  ret->fieldOrder = fe->fieldOrder;
+  ret->mediaType = fe->mediaType;
+  ret->streamIndex = fe->streamIndex;
+  ret->times = fe->times;
+  ret->AVFrame = avFrame;
+  return ret;
+}
+
+// measure: stamp our consume time on the latency trail and add it to the histograms
+void FFMPEGSharedMemoryConsumer::measure(AVFrameExt *_frame)
+{
+  long long now = shm_timestamp();
+  FFMPEGSMTimes &times = _frame->times;
+  times.consumed(now);
+
+  glass_.add(now - times.capture);
+  for(int i = 0; i < times.hops; i++)
+  {
+    long long from = (i == 0)? times.capture : times.hop[i - 1].consume;
+    process_[i].add(times.hop[i].publish - from);
+    transit_[i].add(times.hop[i].consume - times.hop[i].publish);
+  }
+  hops_ = std::max(hops_, times.hops);
+
+  if(lastReport_ == 0)
+  {
+    lastReport_ = now;
+  }
+  else if(now - lastReport_ >= LATENCY_REPORT_INTERVAL)
+  {
+    reportLatency();
+    lastReport_ = now;
+  }
+}
+
+// reportLatency: histograms since the last report. Per hop: engine processing (previous consume or capture
+// to publish) and ring transit (publish to consume)
+void FFMPEGSharedMemoryConsumer::reportLatency()
+{
+  if(glass_.count() == 0) return;
+
+  notifyInfo("SM client %s latency glass to glass %s", ID_.c_str(), glass_.summary().c_str());
+  for(int i = 0; i < hops_; i++)
+  {
+    notifyInfo("SM client %s latency hop %d process %s, transit %s", ID_.c_str(), i, process_[i].summary().c_str(), transit_[i].summary().c_str());
+    process_[i].reset();
+    transit_[i].reset();
+  }
+  glass_.reset();
+  hops_ = 0;
+}
+
+// verify: integrity mode, payload against the crc32c written by the producer. A mismatch on a slot the
+// producer already wrote over is a torn read, not a corrupted frame
+bool FFMPEGSharedMemoryConsumer::verify(const unsigned char *_data, int _size, long long _seq)
+{
+  FFMPEGSMElement *fe = (FFMPEGSMElement *) _data;
+  if(!(fe->flags & FFMPEGSM_FLAG_CRC32C)) return true;
+
+  bool ok = (_size >= fe->size) && (crc32c(0, _data + fe->size, _size - fe->size) == fe->checksum);
+  if(!ok)
+  {
+    if((_data >= data_ && _data < data_ + dataSize_) || valid(_seq))
+    {
+      crcErrors_++;
+      notifyWarning("SM client %s payload crc mismatch (seq %lld)", ID_.c_str(), _seq);
+    }
+    else
+    {
+      tear();
+    }
+  }
+  return ok;
+}
+
+// own: planes moved from data_ into buffers of the frame. Zero copy callers hold frames across reads, the
+// next copy overwrites data_ (and remap frees it)
+AVFrameExt * FFMPEGSharedMemoryConsumer::own(AVFrameExt *_frame)
+{
+  if(!_frame) return nullptr;
+
+  bool ok = false;
+  if(_frame->AVFrame)
+  {
+    AVFrame *src = _frame->AVFrame;
+    AVFrame *dst = av_frame_alloc();
+    if(dst)
+    {
+      dst->format = src->format;
+      dst->width = src->width;
+      dst->height = src->height;
+      dst->nb_samples = src->nb_samples;
+      ok = (av_channel_layout_copy(&dst->ch_layout, &src->ch_layout) >= 0) && (av_frame_get_buffer(dst, 0) >= 0) &&
+           (av_frame_copy(dst, src) >= 0) && (av_frame_copy_props(dst, src) >= 0);
+      if(ok)
+      {
+        av_frame_free(&_frame->AVFrame);
+        _frame->AVFrame = dst;
+      }
+      else
+      {
+        av_frame_free(&dst);
+      }
     }
+  }
+  else if(_frame->AVPacket)
+  {
+    // no buf yet: the payload is copied into a new one
+    ok = av_packet_make_refcounted(_frame->AVPacket) >= 0;
+  }
+
+  if(!ok)
+  {
+    free_AVFrameExt(&_frame);
+  }
+  return _frame;
+}
 
-    std::this_thread::sleep_for(1ms);
-    timeout = Clock::instance().elapsed() >= timeoutTime;
+// unpack: AVFrameExt with planes pointing into _data (no copy)
+AVFrameExt * FFMPEGSharedMemoryConsumer::unpack(const unsigned char *_data)
+{
+  FFMPEGSMElement *fe = (FFMPEGSMElement *) _data;
+
+  AVFrameExt *ret = new AVFrameExt();
+  ret->timeBase = fe->timebase;
+  ret->fieldOrder = fe->fieldOrder;
+  ret->mediaType = fe->mediaType;
+  ret->streamIndex = fe->streamIndex;
+  ret->times = fe->times;
+
+  // packets (data ring) keep the media type of their stream
+  if( (fe->packetSize == 0) && ((fe->mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO) || (fe->mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO)) )
+  {
+    AVFrame *avFrame = av_frame_alloc();
+    if(avFrame)
+    {
+      avFrame->width = fe->width;
+      avFrame->height = fe->height;
+      avFrame->format = fe->format;
+      avFrame->duration = fe->duration;
+      avFrame->pts = fe->pts;
+      avFrame->pkt_dts = fe->dts;
+      avFrame->best_effort_timestamp = fe->bestEffortTimestamp;
+      avFrame->nb_samples = fe->nbSamples;
+      avFrame->sample_rate = fe->sampleRate;
+      avFrame->ch_layout.order = (AVChannelOrder) fe->channelOrder;
+      avFrame->ch_layout.nb_channels = fe->channels;
+      avFrame->ch_layout.u.mask = fe->channelMask;
+      unsigned char *avBuffer = (unsigned char *) (fe + 1);
+      if(fe->mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO)
+      {
+        // planes as laid out by the producer (padded linesize, aligned planes)
+        for(int i = 0; (i < AV_NUM_DATA_POINTERS) && (fe->linesize[i] > 0); i++)
+        {
+          avFrame->data[i] = avBuffer + fe->planeOffset[i];
+          avFrame->linesize[i] = fe->linesize[i];
+        }
+      }
+      else if(fe->mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO)
+      {
+        // every plane in place, more planes than data[] go through extended_data
+        int planes = (fe->planes > 0)? fe->planes : 1;
+        if(planes > AV_NUM_DATA_POINTERS)
+        {
+          avFrame->extended_data = (uint8_t **) av_calloc(planes, sizeof(uint8_t *));
+        }
+        for(int i = 0; avFrame->extended_data && (i < planes); i++)
+        {
+          avFrame->extended_data[i] = avBuffer + audioPlaneOffset(fe, i);
+          if(i < AV_NUM_DATA_POINTERS) avFrame->data[i] = avFrame->extended_data[i];
+        }
+        avFrame->linesize[0] = fe->linesize[0];
+      }
+      ret->AVFrame = avFrame;
+    }
+  }
+  else
+  {
+    AVPacket *packet = av_packet_alloc();
+    if(packet)
+    {
+      packet->size = fe->packetSize;
+      packet->pts = fe->pts;
+      packet->dts = fe->dts;
+      packet->duration = fe->duration;
+      packet->flags = fe->packetFlags;
+      packet->stream_index = fe->streamIndex;
+      packet->time_base = fe->timebase;
+      unsigned char *dataBuffer = (unsigned char*) (fe + 1);
+      packet->data = dataBuffer;
+      ret->AVPacket = packet;
+
+      // codec parameters travel after the packet
+      AVCodecParameters *&codecPar = codecPars_[fe->streamIndex];
+      if(fe->flags & FFMPEGSM_FLAG_CODECPAR)
+      {
+        const FFMPEGSMCodec *codec = (const FFMPEGSMCodec *) (dataBuffer + codecOffset(fe->packetSize));
+        if(!codecPar) codecPar = avcodec_parameters_alloc();
+        if(codecPar && !codec->apply(codecPar))
+        {
+          avcodec_parameters_free(&codecPar);
+        }
+      }
+      // the frame gets its own copy: the next keyframe overwrites ours, deinit frees it
+      if(codecPar)
+      {
+        ret->codecPar = avcodec_parameters_alloc();
+        if(ret->codecPar && avcodec_parameters_copy(ret->codecPar, codecPar) < 0)
+        {
+          avcodec_parameters_free(&ret->codecPar);
+        }
+        ret->codecParOwned = (ret->codecPar != nullptr);
+      }
+    }
   }
 
   return ret;
@@ -1,17 +1,97 @@
 #pragma once
 
+#include <atomic>
+#include <map>
+#include <vector>
 #include "sm_consumer.h"
 #include "FFMPEG_sm_element.h"
+#include "latency.h"
 
+#define LATENCY_REPORT_INTERVAL 10000000000LL   // ns between latency reports
+#define BACKUP_STALL 100                          // ms without frames before switching to the backup (frame duration unknown)
+#define BACKUP_POLL 5                             // ms, wait on the backup between looks at this source
+#define BACKUP_RETRY 100                          // ms between backup connection attempts
+#define RENDITION_RENEW 500000000LL               // ns between rendition lease renewals (SHM_RENDITION_LEASE)
+#define PIN_REQUEST 2                             // pinned slots a pinning consumer asks the producer for
+
+// FFMPEGSMMapping: ring mapping shared by a consumer and the zero copy frames pointing into it. Unmapped by
+// whichever lets go of it last
+struct FFMPEGSMMapping
+{
+  RingBuffer *rb = nullptr;
+  ShMHandle handle;                 // owned here once the consumer retired the ring
+  std::atomic<int> refs;            // consumer + zero copy frames
+};
+
+// FFMPEGSharedMemoryConsumer: subscribes to one of the producer media rings (video by default), or to a
+// rendition (scaled copy of the video) the producer generates on request. Stream rings (audio) return every
+// frame written since the last read joined into one frame. Packets of the data ring come with the codec
+// parameters of their stream once a keyframe (or the first packet of the ring) brought them
 class FFMPEGSharedMemoryConsumer : public SharedMemoryConsumer
 {
 public:
   FFMPEGSharedMemoryConsumer();
   virtual ~FFMPEGSharedMemoryConsumer();
-  bool init(const char *_id, int _msTimeout);
+  bool init(const char *_id, int _msTimeout, AVMediaType _mediaType = AVMEDIA_TYPE_VIDEO);
   bool deinit();
   AVFrameExt * read();
+  void setBackup(const char *_id, int _msStall = 0);
+  bool onBackup() { return onBackup_; }
+  void setZeroCopy(bool _zeroCopy) { zeroCopy_ = _zeroCopy; }
+  void setPinned(bool _pinned) { pinned_ = _pinned; }
+  void setRendition(int _width, int _height, int _format = -1);
+  bool rendition() { return rendition_; }
+  unsigned long long crcErrors() { return crcErrors_; }
+  const AVCodecParameters * codecParameters(int _streamIndex);
+  const LatencyHistogram & latency() { return glass_; }
+  static bool lookup(const char *_id, ShMSource *_source = nullptr);
+  static bool waitSource(const char *_id, int _msTimeout);
+
+protected:
+  AVFrameExt * readFrame(int _msTimeout);
+  AVFrameExt * readStream(int _msTimeout);
+  AVFrameExt * joinRecords();
+  bool stalled(long long _now);
+  long long stallTime();
+  bool connectBackup();
+  bool requestRendition(const char *_id);
+  void renewRendition();
+  void retire(ShMHandle *_handle) override;
+  bool hold(AVFrameExt *_frame, const unsigned char *_data, int _size, int _slot, long long _stamp);
+  static void unpinBuffer(void *_opaque, unsigned char *_data);
+  static void unmapBuffer(void *_opaque, unsigned char *_data);
+  static void releaseMapping(FFMPEGSMMapping *_mapping);
+  AVFrameExt * unpack(const unsigned char *_data);
+  AVFrameExt * own(AVFrameExt *_frame);
+  bool verify(const unsigned char *_data, int _size, long long _seq);
+  void measure(AVFrameExt *_frame);
+  void reportLatency();
 
 protected:
-  unsigned long long lastMsgID_ = 0;
+  bool zeroCopy_ = false;           // planes point straight into the shared memory slot
+  bool pinned_ = false;             // zero copy frames pin their slot, intact until the frame is freed
+  std::vector<FFMPEGSMMapping *> mappings_;  // rings zero copy frames point into
+  unsigned long long crcErrors_ = 0;  // integrity mode: payloads that did not match the producer checksum
+  LatencyHistogram glass_;                        // capture to consume
+  LatencyHistogram process_[FFMPEGSM_MAX_HOPS];   // hop i: previous consume (capture) to publish
+  LatencyHistogram transit_[FFMPEGSM_MAX_HOPS];   // hop i: publish to consume
+  int hops_ = 0;                                  // hops seen since the last report
+  long long lastReport_ = 0;
+  AVMediaType mediaType_ = AVMEDIA_TYPE_VIDEO;
+  std::string backupID_;                          // backup source UID, empty: none
+  FFMPEGSharedMemoryConsumer *backup_ = nullptr;  // standby consumer of the backup source
+  bool onBackup_ = false;                         // frames currently come from the backup
+  int msStall_ = 0;                               // stall time, 0: two frame durations
+  long long lastFrame_ = 0;                       // shm_timestamp() of the last frame from this source
+  long long frameDuration_ = 0;                   // ns, last frame from this source
+  long long lastBackupTry_ = 0;
+  int renditionWidth_ = 0;                        // requested rendition, 0: the source video
+  int renditionHeight_ = 0;
+  int renditionFormat_ = -1;                      // -1: source format
+  bool rendition_ = false;                        // reading the rendition ring
+  ShMControlHandle sourceCtl_ = {};               // source control segment, rendition requests go there
+  long long lastRenew_ = 0;
+  std::map<int, AVCodecParameters *> codecPars_;  // packet rings: last codec parameters of each stream
+  int streamPos_ = 0;                             // stream rings: records drained into data_ not returned yet
+  int streamEnd_ = 0;
 };
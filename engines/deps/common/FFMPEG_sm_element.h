@@ -1,11 +1,50 @@
 #pragma once
 
+#include <string>
+#include "shmhelper.h"
+
 extern "C" {
 #include <libavutil/frame.h>
+#include <libavutil/rational.h>
+#include <libavutil/samplefmt.h>
 #include <libavcodec/defs.h>
 #include <libavcodec/packet.h>
+#include <libavcodec/codec_par.h>
 }
 
+#define FFMPEGSM_MAX_HOPS 8                 // engines a frame goes through. Oldest hops dropped past it
+
+// FFMPEGSMHop: one engine the frame went through. shm_timestamp() ns, monotonic and system wide
+struct FFMPEGSMHop
+{
+  long long publish = 0;          // written into the ring
+  long long consume = 0;          // read out of the ring by the next engine
+};
+
+// FFMPEGSMTimes: latency trail. Follows the frame from engine to engine, each hop appends to it
+struct FFMPEGSMTimes
+{
+  long long capture = 0;          // frame entered the chain (packet read, page painted). Else first publish
+  int hops = 0;
+  FFMPEGSMHop hop[FFMPEGSM_MAX_HOPS];
+  void published(long long _now)
+  {
+    if(capture == 0) capture = _now;
+    if(hops == FFMPEGSM_MAX_HOPS)
+    {
+      for(int i = 1; i < FFMPEGSM_MAX_HOPS; i++) hop[i - 1] = hop[i];
+      hops--;
+    }
+    hop[hops].publish = _now;
+    hop[hops].consume = 0;
+    hops++;
+  }
+  void consumed(long long _now)
+  {
+    if(hops > 0) hop[hops - 1].consume = _now;
+  }
+};
+
 struct AVFrameExt
 {
   AVRational timeBase = {1, 25};  
@@ -14,6 +53,13 @@ struct AVFrameExt
   int streamIndex = -1;
   AVFrame *AVFrame = nullptr;
   AVPacket *AVPacket = nullptr;
+  AVCodecParameters *codecPar = nullptr;  // packets: stream codec parameters, owned by the demuxer
+  bool codecParOwned = false;             // codecPar is a copy freed with the frame (sm consumer)
+  RingBuffer *smRing = nullptr;   // zero copy: ring the planes point into
+  long long smSeq = -1;           // zero copy: ring sequence of the slot
+  int smSlot = -1;                // pinned zero copy: slot held until the frame buffer is freed
+  long long smStamp = -1;         // pinned zero copy: slot write stamp when pinned
+  FFMPEGSMTimes times;            // latency trail. Engines forwarding a frame keep it
   void copy(AVFrameExt *_copy)
   {
     timeBase = _copy->timeBase;    
@@ -22,6 +68,13 @@ struct AVFrameExt
     streamIndex = _copy->streamIndex;
     AVFrame = _copy->AVFrame;
     AVPacket = _copy->AVPacket;
+    codecPar = _copy->codecPar;
+    codecParOwned = _copy->codecParOwned;
+    smRing = _copy->smRing;
+    smSeq = _copy->smSeq;
+    smSlot = _copy->smSlot;
+    smStamp = _copy->smStamp;
+    times = _copy->times;
   }
 };
 
@@ -31,6 +84,7 @@ __inline void free_AVFrameExt(AVFrameExt **_AVFrameExt)
   av_frame_free(&frame);
   AVPacket *packet = (*_AVFrameExt)->AVPacket;
   av_packet_free(&packet);
+  if((*_AVFrameExt)->codecParOwned) avcodec_parameters_free(&(*_AVFrameExt)->codecPar);
   delete (*_AVFrameExt);
   *_AVFrameExt = nullptr;
 }
@@ -42,6 +96,49 @@ __inline long long frameDuration(AVFrameExt *_frame)
   return (long long) ((_frame->AVFrame->duration * (_frame->timeBase.num * 10000000LL) / _frame->timeBase.den) * numFields);
 }
 
+// framePeriod: frame duration as a rational number of seconds (FramePacer), fields counted as frameDuration does
+__inline AVRational framePeriod(AVFrameExt *_frame)
+{
+  AVRational ret = { 0, 1 };
+  if(!_frame->AVFrame) return ret;
+  int numFields = _frame->fieldOrder <= AVFieldOrder::AV_FIELD_PROGRESSIVE ? 1 : 2;
+  long long duration = (_frame->AVFrame->duration > 0)? _frame->AVFrame->duration : 1;
+  av_reduce(&ret.num, &ret.den, duration * _frame->timeBase.num * numFields, _frame->timeBase.den, INT_MAX);
+  return ret;
+}
+
+// frameValid: false when planes point into a shared memory slot the producer already wrote over.
+// Pinned slots are only written over once the producer runs out of spare slots
+__inline bool frameValid(AVFrameExt *_frame)
+{
+  if(!_frame->smRing) return true;
+  if(_frame->smSlot >= 0) return shm_pin_valid(_frame->smRing, _frame->smSlot, _frame->smStamp);
+  return shm_slot_valid(_frame->smRing, _frame->smSeq);
+}
+
+// mediaRing: ring carrying a media type. Anything but video and audio goes to the data ring
+__inline AVMediaType mediaRing(AVMediaType _mediaType)
+{
+  if(_mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO || _mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO) return _mediaType;
+  return AVMediaType::AVMEDIA_TYPE_DATA;
+}
+
+// subRingName: producers publish one ring per media type. Video keeps the producer ID
+__inline std::string subRingName(const char *_id, AVMediaType _mediaType)
+{
+  if(_mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO) return _id;
+  return std::string(_id) + ((_mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO)? ".audio" : ".data");
+}
+
+// renditionName: ring of a scaled copy of the producer video, ID.WxH (source format) or ID.WxH.format
+__inline std::string renditionName(const char *_id, int _width, int _height, int _format)
+{
+  char name[SHM_NAME_SIZE];
+  if(_format < 0) snprintf(name, sizeof(name), "%s.%dx%d", _id, _width, _height);
+  else snprintf(name, sizeof(name), "%s.%dx%d.%d", _id, _width, _height, _format);
+  return name;
+}
+
 struct SMElement
 {
   int size;                           // sizeof struct
@@ -49,6 +146,9 @@ struct SMElement
   int version;                        // version of the object
 };
 
+#define FFMPEGSM_FLAG_CRC32C 1              // checksum holds the crc32c of the payload (integrity mode)
+#define FFMPEGSM_FLAG_CODECPAR 2            // packet followed by its stream codec parameters (FFMPEGSMCodec)
+
 // FFMPEGSMElement: Object shared between sm producer / consumer
 struct FFMPEGSMElement : public SMElement
 {
@@ -61,12 +161,28 @@ struct FFMPEGSMElement : public SMElement
   int height = 0;
   long long duration = 0;
   int linesize[AV_NUM_DATA_POINTERS] = { 0 };
+  int planeOffset[AV_NUM_DATA_POINTERS] = { 0 };   // from payload start (end of this struct). Video planes and rows
+                                                  // are SHM_ALIGN aligned in the slot
+  int planeHeight[AV_NUM_DATA_POINTERS] = { 0 };   // video: rows of each plane (chroma subsampled ones included)
   int packetSize = 0;
+  int packetFlags = 0;                            // AV_PKT_FLAG_*
+  int flags = 0;
+  unsigned int checksum = 0;                      // payload crc32c (FFMPEGSM_FLAG_CRC32C)
+  long long pts = AV_NOPTS_VALUE;                 // media timestamps, timebase units
+  long long dts = AV_NOPTS_VALUE;                 // frame: pkt_dts
+  long long bestEffortTimestamp = AV_NOPTS_VALUE;
+  int nbSamples = 0;                              // audio. format is the AVSampleFormat
+  int planes = 0;                                 // audio planes (planar: one per channel), see audioPlaneOffset
+  int sampleRate = 0;
+  int channelOrder = 0;                           // AVChannelOrder. Custom layouts travel as unspecified
+  int channels = 0;
+  unsigned long long channelMask = 0;
+  FFMPEGSMTimes times;                            // latency trail
   FFMPEGSMElement()
   {
     size = sizeof(FFMPEGSMElement);
     type = 1;
-    version = 1;
+    version = 8;
   }
   void init(AVFrameExt *_frame)
   {
@@ -81,10 +197,146 @@ struct FFMPEGSMElement : public SMElement
       height = _frame->AVFrame->height;
       duration = _frame->AVFrame->duration;
       memcpy(linesize, _frame->AVFrame->linesize, sizeof(int) * AV_NUM_DATA_POINTERS);
+      pts = _frame->AVFrame->pts;
+      dts = _frame->AVFrame->pkt_dts;
+      bestEffortTimestamp = _frame->AVFrame->best_effort_timestamp;
+      nbSamples = _frame->AVFrame->nb_samples;
+      if(mediaType == AVMediaType::AVMEDIA_TYPE_AUDIO)
+      {
+        planes = av_sample_fmt_is_planar((AVSampleFormat) format)? _frame->AVFrame->ch_layout.nb_channels : 1;
+      }
+      sampleRate = _frame->AVFrame->sample_rate;
+      const AVChannelLayout &layout = _frame->AVFrame->ch_layout;
+      channels = layout.nb_channels;
+      channelOrder = (layout.order == AV_CHANNEL_ORDER_NATIVE || layout.order == AV_CHANNEL_ORDER_AMBISONIC)? layout.order : AV_CHANNEL_ORDER_UNSPEC;
+      channelMask = (channelOrder != AV_CHANNEL_ORDER_UNSPEC)? layout.u.mask : 0;
     }
     if(_frame->AVPacket)
     {
       packetSize = _frame->AVPacket->size;
+      packetFlags = _frame->AVPacket->flags;
+      pts = _frame->AVPacket->pts;
+      dts = _frame->AVPacket->dts;
+      duration = _frame->AVPacket->duration;
+    }
+    times = _frame->times;
+  }
+};
+
+// FFMPEGSMCodec: stream codec parameters, after the packet payload (codecOffset) of FFMPEGSM_FLAG_CODECPAR packets. Then
+// extradataSize bytes of extradata. Sent with keyframes and the first packet of a stream in every ring epoch,
+// so consumers joining late can remux or decode from the next keyframe on
+struct FFMPEGSMCodec
+{
+  int codecType = 0;
+  int codecId = 0;
+  unsigned int codecTag = 0;
+  int format = -1;
+  long long bitRate = 0;
+  int profile = 0;
+  int level = 0;
+  int width = 0;                                  // video
+  int height = 0;
+  AVRational sampleAspectRatio = {0, 1};
+  int fieldOrder = 0;
+  int colorRange = 0;
+  int colorPrimaries = 0;
+  int colorTrc = 0;
+  int colorSpace = 0;
+  int chromaLocation = 0;
+  int videoDelay = 0;
+  int sampleRate = 0;                             // audio
+  int channelOrder = 0;
+  int channels = 0;
+  unsigned long long channelMask = 0;
+  int frameSize = 0;
+  int blockAlign = 0;
+  int initialPadding = 0;
+  int trailingPadding = 0;
+  int extradataSize = 0;
+  void init(const AVCodecParameters *_par)
+  {
+    codecType = _par->codec_type;
+    codecId = _par->codec_id;
+    codecTag = _par->codec_tag;
+    format = _par->format;
+    bitRate = _par->bit_rate;
+    profile = _par->profile;
+    level = _par->level;
+    width = _par->width;
+    height = _par->height;
+    sampleAspectRatio = _par->sample_aspect_ratio;
+    fieldOrder = _par->field_order;
+    colorRange = _par->color_range;
+    colorPrimaries = _par->color_primaries;
+    colorTrc = _par->color_trc;
+    colorSpace = _par->color_space;
+    chromaLocation = _par->chroma_location;
+    videoDelay = _par->video_delay;
+    sampleRate = _par->sample_rate;
+    channels = _par->ch_layout.nb_channels;
+    channelOrder = (_par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE || _par->ch_layout.order == AV_CHANNEL_ORDER_AMBISONIC)? _par->ch_layout.order : AV_CHANNEL_ORDER_UNSPEC;
+    channelMask = (channelOrder != AV_CHANNEL_ORDER_UNSPEC)? _par->ch_layout.u.mask : 0;
+    frameSize = _par->frame_size;
+    blockAlign = _par->block_align;
+    initialPadding = _par->initial_padding;
+    trailingPadding = _par->trailing_padding;
+    extradataSize = _par->extradata? _par->extradata_size : 0;
+  }
+  // apply: into _par, extradata (right after this struct) copied
+  bool apply(AVCodecParameters *_par) const
+  {
+    _par->codec_type = (AVMediaType) codecType;
+    _par->codec_id = (AVCodecID) codecId;
+    _par->codec_tag = codecTag;
+    _par->format = format;
+    _par->bit_rate = bitRate;
+    _par->profile = profile;
+    _par->level = level;
+    _par->width = width;
+    _par->height = height;
+    _par->sample_aspect_ratio = sampleAspectRatio;
+    _par->field_order = (AVFieldOrder) fieldOrder;
+    _par->color_range = (AVColorRange) colorRange;
+    _par->color_primaries = (AVColorPrimaries) colorPrimaries;
+    _par->color_trc = (AVColorTransferCharacteristic) colorTrc;
+    _par->color_space = (AVColorSpace) colorSpace;
+    _par->chroma_location = (AVChromaLocation) chromaLocation;
+    _par->video_delay = videoDelay;
+    _par->sample_rate = sampleRate;
+    av_channel_layout_uninit(&_par->ch_layout);
+    _par->ch_layout.order = (AVChannelOrder) channelOrder;
+    _par->ch_layout.nb_channels = channels;
+    _par->ch_layout.u.mask = channelMask;
+    _par->frame_size = frameSize;
+    _par->block_align = blockAlign;
+    _par->initial_padding = initialPadding;
+    _par->trailing_padding = trailingPadding;
+
+    av_freep(&_par->extradata);
+    _par->extradata_size = 0;
+    if(extradataSize > 0)
+    {
+      _par->extradata = (uint8_t *) av_mallocz(extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+      if(!_par->extradata) return false;
+      memcpy(_par->extradata, this + 1, extradataSize);
+      _par->extradata_size = extradataSize;
     }
+    return true;
   }
 };
+
+// audioPlaneOffset: audio plane _plane from the payload start. Planes hold linesize[0] bytes each, those past
+// the plane table follow the last one back to back
+__inline int audioPlaneOffset(const FFMPEGSMElement *_fe, int _plane)
+{
+  if(_plane < AV_NUM_DATA_POINTERS) return _fe->planeOffset[_plane];
+  return _fe->planeOffset[AV_NUM_DATA_POINTERS - 1] + (_plane - AV_NUM_DATA_POINTERS + 1) * _fe->linesize[0];
+}
+
+// codecOffset: FFMPEGSMCodec after a _packetSize bytes packet payload, aligned for the struct
+__inline int codecOffset(int _packetSize)
+{
+  const int align = (int) alignof(FFMPEGSMCodec);
+  return (_packetSize + align - 1) & ~(align - 1);
+}
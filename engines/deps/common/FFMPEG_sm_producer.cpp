@@ -1,5 +1,16 @@
+#include <algorithm>
 #include "FFMPEG_sm_producer.h"
 #include "FFMPEG_sm_element.h"
+#include "crc32c.h"
+#include "fastcopy.h"
+#include "notifier.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
 
 FFMPEGSharedMemoryProducer::FFMPEGSharedMemoryProducer()
 :SharedMemoryProducer()
@@ -12,68 +23,610 @@ FFMPEGSharedMemoryProducer::~FFMPEGSharedMemoryProducer()
 
 }
 
-bool FFMPEGSharedMemoryProducer::init(const char *_id, int _size, int _count)
+bool FFMPEGSharedMemoryProducer::init(const char *_id, int _size, int _count, int _policy)
 {
-  bool ret = SharedMemoryProducer::init(_id, _size, _count);
-  if(ret)
+  if(!SharedMemoryProducer::init(_id, _size, _count, _policy)) return false;
+
+  // consumers find us here instead of probing the ring
+  if(!registry_.reg)
   {
-    data_ = new unsigned char[smHandle_.rb->size];
+    registry_ = shm_registry_open();
   }
-  return ret;
+  int frameRateNum = source_.frameRateNum;
+  int frameRateDen = source_.frameRateDen;
+  source_ = ShMSource();
+  snprintf(source_.uid, sizeof(source_.uid), "%s", _id);
+  source_.media = 1 << AVMEDIA_TYPE_VIDEO;
+  source_.frameRateNum = frameRateNum;
+  source_.frameRateDen = frameRateDen;
+  source_.started = shm_timestamp();
+  publishSource();
+
+  return true;
 }
 
 bool FFMPEGSharedMemoryProducer::deinit()
 {
-  bool ret = SharedMemoryProducer::deinit();
-  if(data_)
+  for(auto &rendition : renditions_)
   {
-    delete[] data_;
+    closeRendition(&rendition);
+  }
+  renditions_.clear();
+
+  if(registry_.reg)
+  {
+    shm_registry_remove(&registry_, ID_.c_str());
+    shm_registry_close(&registry_);
+  }
+  if(audioRing_.capacity() > 0) audioRing_.deinit();
+  if(dataRing_.capacity() > 0) dataRing_.deinit();
+  codecEpoch_.clear();
+  return SharedMemoryProducer::deinit();
+}
+
+// setFrameRate: nominal frame rate published with the source, 0/0 unknown
+void FFMPEGSharedMemoryProducer::setFrameRate(int _num, int _den)
+{
+  source_.frameRateNum = _num;
+  source_.frameRateDen = _den;
+  if(capacity() > 0) publishSource();
+}
+
+// publishSource: registry entry brought up to date with the rings and video format
+void FFMPEGSharedMemoryProducer::publishSource()
+{
+  if(!registry_.reg) return;
+
+  source_.format = format_;
+  source_.width = width_;
+  source_.height = height_;
+  source_.size = (unsigned int) capacity();
+  source_.count = count_;
+  source_.policy = policy_;
+  if(!shm_registry_publish(&registry_, &source_))
+  {
+    notifyWarning("SM producer %s could not be published in the registry", ID_.c_str());
   }
-  return ret;
 }
 
-int getDivisorForPlane(enum AVPixelFormat pixelFormat, int planeIndex)
+// subRing: ring for a media type. Audio and data rings are created with the first frame of their type
+SharedMemoryProducer * FFMPEGSharedMemoryProducer::subRing(AVMediaType _mediaType)
 {
-  switch (pixelFormat)
+  if(_mediaType == AVMEDIA_TYPE_VIDEO) return this;
+
+  bool audio = (_mediaType == AVMEDIA_TYPE_AUDIO);
+  SharedMemoryProducer *ring = audio? &audioRing_ : &dataRing_;
+  if(ring->capacity() == 0)
   {
-    case AV_PIX_FMT_YUV420P:
-      return (planeIndex == 0) ? 1 : 2;
-    // Add cases for other pixel formats as needed
-    default:
-    return 1; // Default to no division
+    std::string name = subRingName(ID_.c_str(), audio? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_DATA);
+    ring->setPinLimit(pinned_);
+    ring->setStream(audio);
+    if(!ring->init(name.c_str(), audio? AUDIO_STREAM_SIZE : DATA_SMELEM_SIZE, audio? 1 : DATA_SM_SIZE, policy_))
+    {
+      notifyError("SM producer %s could not create sub ring", name.c_str());
+      return nullptr;
+    }
+    source_.media |= 1 << (audio? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_DATA);
+    publishSource();
   }
+  return ring;
+}
+
+// planeLayout: plane table of a video frame copied into a slot after a _header bytes element. Planes start
+// SHM_ALIGN aligned in the slot and rows are padded to SHM_ALIGN. Returns the payload size, -1 unknown format
+static int planeLayout(const AVFrame *_frame, int _header, FFMPEGSMElement *_sme)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) _frame->format);
+  int planes = av_pix_fmt_count_planes((AVPixelFormat) _frame->format);
+  if(!desc || planes <= 0) return -1;
+
+  int size = 0;
+  for(int i = 0; i < planes; i++)
+  {
+    int bytewidth = av_image_get_linesize((AVPixelFormat) _frame->format, _frame->width, i);
+    if(bytewidth < 0) return -1;
+    bool chroma = (i == 1 || i == 2);
+    _sme->planeOffset[i] = FFALIGN(_header + size, SHM_ALIGN) - _header;
+    _sme->linesize[i] = FFALIGN(bytewidth, SHM_ALIGN);
+    _sme->planeHeight[i] = chroma? AV_CEIL_RSHIFT(_frame->height, desc->log2_chroma_h) : _frame->height;
+    size = _sme->planeOffset[i] + _sme->linesize[i] * _sme->planeHeight[i];
+  }
+  for(int i = planes; i < AV_NUM_DATA_POINTERS; i++)
+  {
+    _sme->planeOffset[i] = 0;
+    _sme->linesize[i] = 0;
+    _sme->planeHeight[i] = 0;
+  }
+
+  return size;
+}
+
+// slotSize: slot that fits a _width x _height _format frame, copied (write) or decoded into (slotBuffer)
+int FFMPEGSharedMemoryProducer::slotSize(int _width, int _height, int _format)
+{
+  // room for the codec dimension alignment (avcodec_align_dimensions2)
+  int width = FFALIGN(_width, SHM_ALIGN) + SHM_ALIGN;
+  int height = FFALIGN(_height, SHM_ALIGN) + 2;
+
+  int linesize[4] = { 0 };
+  if(av_image_fill_linesizes(linesize, (AVPixelFormat) _format, width) < 0) return DEFAULT_SMELEM_SIZE;
+
+  ptrdiff_t linesizes[4] = { 0 };
+  for(int i = 0; i < 4; i++)
+  {
+    linesizes[i] = FFALIGN(linesize[i], SHM_ALIGN);
+  }
+
+  size_t planeSizes[4] = { 0 };
+  if(av_image_fill_plane_sizes(planeSizes, (AVPixelFormat) _format, height, linesizes) < 0) return DEFAULT_SMELEM_SIZE;
+
+  size_t size = FFALIGN(sizeof(FFMPEGSMElement), SHM_ALIGN);
+  for(int i = 0; i < 4; i++)
+  {
+    size = FFALIGN(size + planeSizes[i], SHM_ALIGN);
+  }
+  size += AV_INPUT_BUFFER_PADDING_SIZE;
+
+  return (int) size;
+}
+
+// renegotiate: new ring when the video format changes, the frame does not fit the current slots or consumers
+// asked for pinned slots
+bool FFMPEGSharedMemoryProducer::renegotiate(SharedMemoryProducer *_ring, AVFrameExt *_frame)
+{
+  int required = (int) sizeof(FFMPEGSMElement);
+  if(_frame->AVFrame)
+  {
+    FFMPEGSMElement sme;
+    int size = planeLayout(_frame->AVFrame, sme.size, &sme);
+    if(size < 0) return false;
+    required += size;
+  }
+  if(_frame->AVPacket)
+  {
+    required += _frame->AVPacket->size + codecSize(_frame);
+  }
+
+  int size = 0;
+  AVFrame *frame = _frame->AVFrame;
+  if( (_ring == this) && frame &&
+      ((frame->width != width_) || (frame->height != height_) || (frame->format != format_)) )
+  {
+    // first frame just records the format the ring was created for, if it fits
+    bool negotiated = (format_ >= 0);
+    width_ = frame->width;
+    height_ = frame->height;
+    format_ = frame->format;
+    if(negotiated || (required > _ring->capacity()))
+    {
+      size = std::max(required, slotSize(width_, height_, format_));
+    }
+  }
+  else if(required > _ring->capacity())
+  {
+    size = required;
+  }
+
+  // consumers pinning frames asked for more pinned slots: same slot size, more of them
+  if(size == 0 && _ring->pinsRequested())
+  {
+    size = _ring->capacity();
+  }
+
+  if(size == 0)
+  {
+    // first frame format, same ring
+    if(format_ != source_.format) publishSource();
+    return true;
+  }
+
+  notifyInfo("SM producer %s remap, slot size %d (%dx%d format %d)", ID_.c_str(), size, width_, height_, format_);
+  bool ret = _ring->remap(size);
+  if(_ring == this) publishSource();
+  return ret;
 }
 
 bool FFMPEGSharedMemoryProducer::write(AVFrameExt *_frame)
 {
-  int dataSize = 0;
+  bool ret = writeFrame(_frame);
+  if(ret && !_frame->AVPacket && (_frame->mediaType == AVMEDIA_TYPE_VIDEO) && _frame->AVFrame)
+  {
+    frames_++;
+    writeRenditions(_frame);
+  }
+  return ret;
+}
+
+// writeRenditions: renditions consumers currently ask for (see shm_rendition_request), scaled from _frame once
+// whatever the number of consumers reading them. Renditions nobody renewed are closed
+void FFMPEGSharedMemoryProducer::writeRenditions(AVFrameExt *_frame)
+{
+  ShMControl *ctl = ctlHandle_.ctl;
+  if(!ctl) return;
+  long long now = shm_timestamp();
+
+  for(auto it = renditions_.begin(); it != renditions_.end();)
+  {
+    if(requested(it->key, now))
+    {
+      it++;
+      continue;
+    }
+    notifyInfo("SM producer %s rendition %s closed", ID_.c_str(), it->ring->ID_.c_str());
+    closeRendition(&(*it));
+    it = renditions_.erase(it);
+  }
+
+  for(int i = 0; i < SHM_MAX_RENDITIONS; i++)
+  {
+    long long key = ctl->renditions[i].key;
+    if(key == 0 || now - ctl->renditions[i].lease > SHM_RENDITION_LEASE) continue;
+
+    FFMPEGSMRendition *rendition = nullptr;
+    for(auto &r : renditions_)
+    {
+      if(r.key == key) rendition = &r;
+    }
+    if(!rendition)
+    {
+      int width = 0, height = 0, requestedFormat = -1;
+      shm_renditionformat(key, &width, &height, &requestedFormat);
+      if(width <= 0 || height <= 0) continue;
+      int format = (requestedFormat < 0)? _frame->AVFrame->format : requestedFormat;
+
+      FFMPEGSMRendition r;
+      r.key = key;
+      r.ring = new FFMPEGSharedMemoryProducer();
+      r.ring->setPinLimit(pinned_);
+      // written from inside write(): a stuck rendition reader must not hold up the main ring, renditions drop
+      r.ring->setBestEffort(true);
+      std::string name = renditionName(ID_.c_str(), width, height, requestedFormat);
+      if(!r.ring->init(name.c_str(), slotSize(width, height, format), count_, SHM_POLICY_LATEST))
+      {
+        notifyError("SM producer %s could not create rendition %s", ID_.c_str(), name.c_str());
+        delete r.ring;
+        continue;
+      }
+      r.ring->setFrameRate(source_.frameRateNum, source_.frameRateDen);
+      notifyInfo("SM producer %s rendition %s opened", ID_.c_str(), name.c_str());
+      renditions_.push_back(r);
+      rendition = &renditions_.back();
+    }
+
+    if(rendition->written != frames_)
+    {
+      writeRendition(rendition, _frame);
+      rendition->written = frames_;
+    }
+  }
+}
+
+// requested: some consumer renewed the rendition lately
+bool FFMPEGSharedMemoryProducer::requested(long long _key, long long _now)
+{
+  ShMControl *ctl = ctlHandle_.ctl;
+  for(int i = 0; ctl && i < SHM_MAX_RENDITIONS; i++)
+  {
+    if(ctl->renditions[i].key == _key && _now - ctl->renditions[i].lease <= SHM_RENDITION_LEASE) return true;
+  }
+  return false;
+}
+
+// waitConsumer: until a reader registers on the video ring or some consumer requests a rendition. Offline runs
+// hold their first frame for it, lossless rings deliver from the registration point on
+bool FFMPEGSharedMemoryProducer::waitConsumer(int _msTimeout)
+{
+  long long deadline = shm_timestamp() + (_msTimeout * 1000000LL);
+  while(smHandle_.rb)
+  {
+    long long now = shm_timestamp();
+    if(shm_slowest_reader(&smHandle_) >= 0) return true;
+    for(int i = 0; ctlHandle_.ctl && i < SHM_MAX_RENDITIONS; i++)
+    {
+      if(ctlHandle_.ctl->renditions[i].key != 0 && requested(ctlHandle_.ctl->renditions[i].key, now)) return true;
+    }
+    if(now >= deadline) break;
+
+    // readers registering wake us. Rendition requests do not, they are looked at every WAIT_CONSUMER_SLICE
+    int ms = (int) std::min<long long>((deadline - now + 999999) / 1000000, WAIT_CONSUMER_SLICE);
+    shm_wait_readers(&smHandle_, -1, ms);
+  }
+  return false;
+}
+
+bool FFMPEGSharedMemoryProducer::writeRendition(FFMPEGSMRendition *_rendition, AVFrameExt *_frame)
+{
+  AVFrame *src = _frame->AVFrame;
+  int width = 0, height = 0, format = -1;
+  shm_renditionformat(_rendition->key, &width, &height, &format);
+  if(format < 0) format = src->format;
+
+  // source format changed: new scaled frame
+  if(_rendition->frame && (_rendition->frame->format != format))
+  {
+    av_frame_free(&_rendition->frame);
+  }
+  if(!_rendition->frame)
+  {
+    _rendition->frame = av_frame_alloc();
+    _rendition->frame->width = width;
+    _rendition->frame->height = height;
+    _rendition->frame->format = format;
+    if(av_frame_get_buffer(_rendition->frame, SHM_ALIGN) < 0)
+    {
+      av_frame_free(&_rendition->frame);
+      return false;
+    }
+  }
+
+  _rendition->sws = sws_getCachedContext(_rendition->sws, src->width, src->height, (AVPixelFormat) src->format,
+                                         width, height, (AVPixelFormat) format, SWS_BILINEAR, nullptr, nullptr, nullptr);
+  if(!_rendition->sws) return false;
+
+  AVFrame *frame = _rendition->frame;
+  sws_scale(_rendition->sws, src->data, src->linesize, 0, src->height, frame->data, frame->linesize);
+  av_frame_copy_props(frame, src);
+
+  AVFrameExt frameExt;
+  frameExt.copy(_frame);
+  frameExt.AVFrame = frame;
+  frameExt.smRing = nullptr;
+  frameExt.smSeq = -1;
+  return _rendition->ring->write(&frameExt);
+}
+
+void FFMPEGSharedMemoryProducer::closeRendition(FFMPEGSMRendition *_rendition)
+{
+  if(_rendition->ring)
+  {
+    _rendition->ring->deinit();
+    delete _rendition->ring;
+    _rendition->ring = nullptr;
+  }
+  sws_freeContext(_rendition->sws);
+  _rendition->sws = nullptr;
+  av_frame_free(&_rendition->frame);
+}
+
+bool FFMPEGSharedMemoryProducer::writeFrame(AVFrameExt *_frame)
+{
+  // undecoded packets go to the data ring whatever their stream type
+  SharedMemoryProducer *ring = subRing(_frame->AVPacket? AVMEDIA_TYPE_DATA : _frame->mediaType);
+  if(ring && ring->stream()) return writeRecord(ring, _frame);
+  if(!ring || !renegotiate(ring, _frame)) return false;
+
   FFMPEGSMElement sme;
   sme.init(_frame);
-  memcpy(data_, &sme, sme.size);
-  unsigned char *p = data_ + sme.size;
-  dataSize = sme.size;
+  int dataSize = sme.size;
+
+  // decoded straight into a reserved slot (see attach). Only the element header is missing
+  const unsigned char *reserved = (ring == this)? reservedSlot(_frame->AVFrame) : nullptr;
+  if(reserved)
+  {
+    const unsigned char *payload = reserved + sme.size;
+    FFMPEGSMElement layout;
+    planeLayout(_frame->AVFrame, sme.size, &layout);
+    for(int i = 0; i < AV_NUM_DATA_POINTERS && _frame->AVFrame->data[i]; i++)
+    {
+      sme.planeOffset[i] = (int) (_frame->AVFrame->data[i] - payload);
+      sme.planeHeight[i] = layout.planeHeight[i];
+      dataSize = sme.size + sme.planeOffset[i] + sme.linesize[i] * sme.planeHeight[i];
+    }
+    if(integrity_)
+    {
+      sme.flags |= FFMPEGSM_FLAG_CRC32C;
+      sme.checksum = crc32c(0, payload, dataSize - sme.size);
+    }
+    sme.times.published(shm_timestamp());
+    memcpy((unsigned char *) reserved, &sme, sme.size);
+    return commit(reserved, dataSize);
+  }
+
+  // copy into the slot, no staging buffer
+  int capacity = 0;
+  unsigned char *slot = ring->acquire(&capacity);
+  if(!slot) return false;
+  unsigned char *p = slot + sme.size;
 
   if(_frame->AVFrame)
   {
-    for(int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+    // plane table, then every plane at its aligned offset. Rows are repacked when the frame linesize differs
+    AVFrame *frame = _frame->AVFrame;
+    int size = planeLayout(frame, sme.size, &sme);
+    if(size < 0 || sme.size + size > capacity) return false;
+    for(int i = 0; i < AV_NUM_DATA_POINTERS && sme.linesize[i] > 0; i++)
     {
-      int size = _frame->AVFrame->linesize[i];
-      if(_frame->mediaType == AVMediaType::AVMEDIA_TYPE_VIDEO)
+      unsigned char *dst = p + sme.planeOffset[i];
+      if(frame->linesize[i] == sme.linesize[i])
       {
-        size = (_frame->AVFrame->linesize[i] * _frame->AVFrame->height) / getDivisorForPlane((AVPixelFormat) _frame->AVFrame->format, i);
+        fastcopy(dst, frame->data[i], sme.linesize[i] * sme.planeHeight[i]);
+      }
+      else
+      {
+        int bytewidth = av_image_get_linesize((AVPixelFormat) frame->format, frame->width, i);
+        av_image_copy_plane(dst, sme.linesize[i], frame->data[i], frame->linesize[i], bytewidth, sme.planeHeight[i]);
       }
-      memcpy(p, _frame->AVFrame->data[i], size);
-      p += size;
-      dataSize += size;
     }
+    p += size;
+    dataSize += size;
   }
   if(_frame->AVPacket)
   {
     int size = _frame->AVPacket->size;
-    memcpy(p, _frame->AVPacket->data, size);
+    if(dataSize + size > capacity) return false;
+    fastcopy(p, _frame->AVPacket->data, size);
     p += size;
     dataSize += size;
+
+    // codec parameters: keyframes and the first packet of the stream in this ring epoch
+    int streamIndex = _frame->streamIndex;
+    bool key = (_frame->AVPacket->flags & AV_PKT_FLAG_KEY) != 0;
+    auto sent = codecEpoch_.find(streamIndex);
+    size = codecSize(_frame);
+    if(size > 0 && (key || sent == codecEpoch_.end() || sent->second != ring->epoch()))
+    {
+      if(dataSize + size > capacity) return false;
+      int pad = codecOffset(_frame->AVPacket->size) - _frame->AVPacket->size;
+      FFMPEGSMCodec codec;
+      codec.init(_frame->codecPar);
+      memcpy(p + pad, &codec, sizeof(codec));
+      if(codec.extradataSize > 0) memcpy(p + pad + sizeof(codec), _frame->codecPar->extradata, codec.extradataSize);
+      p += size;
+      dataSize += size;
+      sme.flags |= FFMPEGSM_FLAG_CODECPAR;
+      codecEpoch_[streamIndex] = ring->epoch();
+    }
+  }
+
+  if(integrity_)
+  {
+    sme.flags |= FFMPEGSM_FLAG_CRC32C;
+    sme.checksum = crc32c(0, slot + sme.size, dataSize - sme.size);
   }
+  // latency trail, this hop
+  sme.times.published(shm_timestamp());
+  memcpy(slot, &sme, sme.size);
+
+  return ring->commit(dataSize);
+}
+
+// codecSize: bytes the codec parameters of a packet take (alignment pad included), 0 when it has none
+int FFMPEGSharedMemoryProducer::codecSize(AVFrameExt *_frame)
+{
+  if(!_frame->AVPacket || !_frame->codecPar) return 0;
+  int pad = codecOffset(_frame->AVPacket->size) - _frame->AVPacket->size;
+  return pad + (int) sizeof(FFMPEGSMCodec) + (_frame->codecPar->extradata? _frame->codecPar->extradata_size : 0);
+}
+
+// writeRecord: audio frame as one record of a stream ring. Element header, then the planes back to back
+// holding just the samples (no padding), so consumers can join consecutive records
+bool FFMPEGSharedMemoryProducer::writeRecord(SharedMemoryProducer *_ring, AVFrameExt *_frame)
+{
+  AVFrame *frame = _frame->AVFrame;
+  if(!frame) return false;
+
+  // native sample format, planar audio (decoder fltp, s16p, ...) keeps one plane per channel
+  int planar = av_sample_fmt_is_planar((AVSampleFormat) frame->format);
+  int planeSize = av_samples_get_buffer_size(nullptr, planar? 1 : frame->ch_layout.nb_channels, frame->nb_samples, (AVSampleFormat) frame->format, 1);
+  if(planeSize < 0) return false;
+
+  FFMPEGSMElement sme;
+  sme.init(_frame);
+  int planes = sme.planes;
+  int dataSize = sme.size + planes * planeSize;
+  unsigned char *record = _ring->beginRecord(dataSize);
+  if(!record) return false;
+
+  unsigned char *p = record + sme.size;
+  for(int i = 0; i < planes; i++)
+  {
+    if(i < AV_NUM_DATA_POINTERS)
+    {
+      sme.linesize[i] = planeSize;
+      sme.planeOffset[i] = i * planeSize;
+    }
+    memcpy(p + i * planeSize, frame->extended_data[i], planeSize);
+  }
+
+  if(integrity_)
+  {
+    sme.flags |= FFMPEGSM_FLAG_CRC32C;
+    sme.checksum = crc32c(0, p, dataSize - sme.size);
+  }
+  sme.times.published(shm_timestamp());
+  memcpy(record, &sme, sme.size);
+
+  return _ring->commitRecord();
+}
+
+// attach: decoder writes frames straight into the shared memory slot that will be published (get_buffer2).
+// Only for decoders that accept custom buffers (DR1) and do not keep references to decoded frames (intra only),
+// otherwise the ring would write over reference frames
+bool FFMPEGSharedMemoryProducer::attach(AVCodecContext *_codecCtx, const AVCodec *_codec)
+{
+  if(!_codecCtx || !_codec || (_codecCtx->codec_type != AVMEDIA_TYPE_VIDEO)) return false;
+  if(!(_codec->capabilities & AV_CODEC_CAP_DR1)) return false;
+  const AVCodecDescriptor *desc = avcodec_descriptor_get(_codec->id);
+  if(!desc || !(desc->props & AV_CODEC_PROP_INTRA_ONLY)) return false;
+
+  _codecCtx->opaque = this;
+  _codecCtx->get_buffer2 = getBuffer2;
+  return true;
+}
+
+int FFMPEGSharedMemoryProducer::getBuffer2(AVCodecContext *_codecCtx, AVFrame *_frame, int _flags)
+{
+  FFMPEGSharedMemoryProducer *producer = (FFMPEGSharedMemoryProducer *) _codecCtx->opaque;
+  if(producer && (_codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) && (producer->slotBuffer(_codecCtx, _frame) >= 0))
+  {
+    return 0;
+  }
+
+  // slot busy (frame threading) or frame does not fit
+  return avcodec_default_get_buffer2(_codecCtx, _frame, _flags);
+}
+
+void FFMPEGSharedMemoryProducer::releaseBuffer(void *_opaque, unsigned char *_data)
+{
+  FFMPEGSharedMemoryProducer *producer = (FFMPEGSharedMemoryProducer *) _opaque;
+  producer->release(_data);
+}
+
+// slotBuffer: frame planes laid out in the spare slot, after the element header
+int FFMPEGSharedMemoryProducer::slotBuffer(AVCodecContext *_codecCtx, AVFrame *_frame)
+{
+  int width = _frame->width;
+  int height = _frame->height;
+  int linesizeAlign[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(_codecCtx, &width, &height, linesizeAlign);
+
+  int linesize[4] = { 0 };
+  if(av_image_fill_linesizes(linesize, (AVPixelFormat) _frame->format, width) < 0) return -1;
+
+  ptrdiff_t linesizes[4] = { 0 };
+  for(int i = 0; i < 4; i++)
+  {
+    linesize[i] = FFALIGN(linesize[i], SHM_ALIGN);
+    linesizes[i] = linesize[i];
+  }
+
+  size_t planeSizes[4] = { 0 };
+  if(av_image_fill_plane_sizes(planeSizes, (AVPixelFormat) _frame->format, height, linesizes) < 0) return -1;
+
+  int capacity = 0;
+  unsigned char *slot = reserve(&capacity);
+  if(!slot) return -1;
+
+  size_t offset = FFALIGN(sizeof(FFMPEGSMElement), SHM_ALIGN);
+  for(int i = 0; i < 4 && planeSizes[i] > 0; i++)
+  {
+    _frame->data[i] = slot + offset;
+    _frame->linesize[i] = linesize[i];
+    offset = FFALIGN(offset + planeSizes[i], SHM_ALIGN);
+  }
+  offset += AV_INPUT_BUFFER_PADDING_SIZE;
+
+  if(offset <= (size_t) capacity)
+  {
+    _frame->buf[0] = av_buffer_create(slot, capacity, releaseBuffer, this, 0);
+  }
+  if(!_frame->buf[0])
+  {
+    release(slot);
+    memset(_frame->data, 0, sizeof(_frame->data));
+    memset(_frame->linesize, 0, sizeof(_frame->linesize));
+    return -1;
+  }
+  _frame->extended_data = _frame->data;
+
+  return 0;
+}
+
+// reservedSlot: slot the frame was decoded into, if it is still the one reserved
+const unsigned char * FFMPEGSharedMemoryProducer::reservedSlot(AVFrame *_frame)
+{
+  if(!_frame || !_frame->buf[0] || (av_buffer_get_opaque(_frame->buf[0]) != this)) return nullptr;
 
-  return SharedMemoryProducer::write(data_, dataSize);
+  std::lock_guard<std::mutex> lock(reserveMutex_);
+  return (_frame->buf[0]->data == reserved_)? reserved_ : nullptr;
 }
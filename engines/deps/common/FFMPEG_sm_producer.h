@@ -1,17 +1,77 @@
 #pragma once
 
+#include <map>
+#include <vector>
 #include "sm_producer.h"
 #include "FFMPEG_sm_element.h"
 
+#define AUDIO_STREAM_SIZE (1024 * 1024)   // audio ring: stream of frame records, ~2.7 s of 48 kHz 8 ch float
+#define DATA_SMELEM_SIZE (1024 * 1024)
+#define DATA_SM_SIZE 8
+#define WAIT_CONSUMER_SLICE 50            // ms, waitConsumer looks at rendition requests this often
+
+struct AVCodecContext;
+struct AVCodec;
+struct SwsContext;
+class FFMPEGSharedMemoryProducer;
+
+// FFMPEGSMRendition: scaled copy of the video a consumer asked for (ShMControl::renditions)
+struct FFMPEGSMRendition
+{
+  long long key = 0;                          // shm_renditionkey()
+  FFMPEGSharedMemoryProducer *ring = nullptr; // ID.WxH[.format]
+  SwsContext *sws = nullptr;                  // cached scaler
+  AVFrame *frame = nullptr;                   // scaled frame, reused
+  long long written = -1;                     // frames_ at the last write, duplicate requests write once
+};
+
+// FFMPEGSharedMemoryProducer: video ring at the producer ID, audio and data sub rings (ID.audio, ID.data)
+// created with the first frame of their type. Each ring has its own slots and sequence numbers, the audio
+// ring is a stream of frame records readers drain in one go (no slot per frame to lose under bursts).
+// Compressed packets go to the data ring with their stream codec parameters (remux, restream).
+// The source (rings, format, frame rate) is published in the registry while the producer is up.
+// Renditions consumers request are scaled once per frame into their own ring
+
 class FFMPEGSharedMemoryProducer : public SharedMemoryProducer
 {
 public:
   FFMPEGSharedMemoryProducer();
   virtual ~FFMPEGSharedMemoryProducer();
-  bool init(const char *_id, int _size = DEFAULT_SMELEM_SIZE, int _count = DEFAULT_SM_SIZE);
+  bool init(const char *_id, int _size = DEFAULT_SMELEM_SIZE, int _count = DEFAULT_SM_SIZE, int _policy = SHM_POLICY_LATEST);
   bool deinit();
   bool write(AVFrameExt *_frame);
+  bool attach(AVCodecContext *_codecCtx, const AVCodec *_codec);
+  void setIntegrity(bool _integrity) { integrity_ = _integrity; }
+  void setFrameRate(int _num, int _den);
+  bool waitConsumer(int _msTimeout);
+  static int slotSize(int _width, int _height, int _format);
+
+protected:
+  static int getBuffer2(AVCodecContext *_codecCtx, AVFrame *_frame, int _flags);
+  static void releaseBuffer(void *_opaque, unsigned char *_data);
+  int slotBuffer(AVCodecContext *_codecCtx, AVFrame *_frame);
+  const unsigned char * reservedSlot(AVFrame *_frame);
+  SharedMemoryProducer * subRing(AVMediaType _mediaType);
+  bool renegotiate(SharedMemoryProducer *_ring, AVFrameExt *_frame);
+  void publishSource();
+  bool writeFrame(AVFrameExt *_frame);
+  bool writeRecord(SharedMemoryProducer *_ring, AVFrameExt *_frame);
+  int codecSize(AVFrameExt *_frame);
+  void writeRenditions(AVFrameExt *_frame);
+  bool requested(long long _key, long long _now);
+  bool writeRendition(FFMPEGSMRendition *_rendition, AVFrameExt *_frame);
+  void closeRendition(FFMPEGSMRendition *_rendition);
 
 protected:
-  unsigned char *data_ = nullptr;
+  bool integrity_ = false;          // debug: crc32c of the payload in the element header
+  int width_ = 0;                   // video format the ring is sized for
+  int height_ = 0;
+  int format_ = -1;
+  SharedMemoryProducer audioRing_;  // audio sub ring
+  SharedMemoryProducer dataRing_;   // data (packets, subtitles, ...) sub ring
+  ShMRegistryHandle registry_ = {}; // source registry, not required to produce
+  ShMSource source_;                // our registry entry
+  std::vector<FFMPEGSMRendition> renditions_;
+  long long frames_ = 0;            // video frames written
+  std::map<int, long long> codecEpoch_;  // stream index: data ring epoch its codec parameters were sent in
 };
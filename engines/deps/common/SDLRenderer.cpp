@@ -2,6 +2,7 @@
 #include "SDLRenderer.h"
 #include "notifier.h"
 #include "FFMPEG_utils.h"
+#include "fastcopy.h"
 
 SDLRenderer::SDLRenderer()
 {
@@ -122,7 +123,7 @@ bool SDLRenderer::render(AVFrame *_frame, SDL_Color _textColor)
   SDL_LockTexture(texture_, nullptr, &pixels, &pitch);
 
   // Copy RGB frame to SDL texture
-  memcpy(pixels, rgbFrame->data[0], height_ * rgbFrame->linesize[0]);
+  fastcopy(pixels, rgbFrame->data[0], height_ * rgbFrame->linesize[0]);
 
   // Unlock SDL texture
   SDL_UnlockTexture(texture_);
@@ -2,13 +2,18 @@
 
 #include <iostream>
 #include <chrono>
+#include <atomic>
 
+// Clock: process time since restart(). Virtual (offline mode) it only moves when frames complete (advance()),
+// so a pipeline runs as fast as it can while its time still follows the frame count
 class Clock
 {
 private:
   using ClockType = std::chrono::high_resolution_clock;
   using TimePoint = std::chrono::time_point<ClockType>;
   TimePoint startTime_;
+  bool virtual_ = false;
+  std::atomic<long long> virtualTime_ { 0 };
 
   Clock()
   {
@@ -28,11 +33,28 @@ public:
     startTime_ = ClockType::now();
   }
 
+  // virtual time: set before any engine thread starts
+  void setVirtual(bool _virtual)
+  {
+    virtual_ = _virtual;
+    virtualTime_ = 0;
+  }
+  bool isVirtual() const { return virtual_; }
+
+  // advance: virtual time moves on to _ns, never back
+  void advance(long long _ns)
+  {
+    long long t = virtualTime_.load();
+    while(_ns > t && !virtualTime_.compare_exchange_weak(t, _ns)) { }
+  }
+
   // elapsed
   long long elapsed() const
   {
+    if(virtual_) return virtualTime_.load();
+
     auto currentTime = ClockType::now();
     auto elapsedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(currentTime - startTime_);
     return elapsedTime.count();
   }
-};
\ No newline at end of file
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define CRC32C_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+// crc32c (Castagnoli). SSE4.2 crc32 instruction when the cpu has it, table otherwise
+
+__inline uint32_t crc32c_sw(uint32_t _crc, const unsigned char *_data, size_t _size)
+{
+  static uint32_t table[256] = { 0 };
+  static bool tableInit = false;
+  if(!tableInit)
+  {
+    for(uint32_t i = 0; i < 256; i++)
+    {
+      uint32_t c = i;
+      for(int k = 0; k < 8; k++)
+      {
+        c = (c & 1)? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+      }
+      table[i] = c;
+    }
+    tableInit = true;
+  }
+
+  uint32_t crc = ~_crc;
+  for(size_t i = 0; i < _size; i++)
+  {
+    crc = table[(crc ^ _data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#ifdef CRC32C_SSE42
+CRC32C_SSE42 __inline uint32_t crc32c_hw(uint32_t _crc, const unsigned char *_data, size_t _size)
+{
+  uint64_t crc = ~_crc;
+#if defined(_M_X64) || defined(__x86_64__)
+  for(; _size >= 8; _size -= 8, _data += 8)
+  {
+    uint64_t v;
+    memcpy(&v, _data, 8);
+    crc = _mm_crc32_u64(crc, v);
+  }
+#endif
+  uint32_t crc32 = (uint32_t) crc;
+  for(; _size > 0; _size--, _data++)
+  {
+    crc32 = _mm_crc32_u8(crc32, *_data);
+  }
+  return ~crc32;
+}
+
+__inline bool crc32c_hwsupport()
+{
+  static int support = -1;
+  if(support < 0)
+  {
+#if defined(_MSC_VER)
+    int info[4] = { 0 };
+    __cpuid(info, 1);
+    support = (info[2] >> 20) & 1;
+#else
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    support = __get_cpuid(1, &eax, &ebx, &ecx, &edx)? (ecx >> 20) & 1 : 0;
+#endif
+  }
+  return support == 1;
+}
+#endif
+
+__inline uint32_t crc32c(uint32_t _crc, const void *_data, size_t _size)
+{
+#ifdef CRC32C_SSE42
+  if(crc32c_hwsupport())
+  {
+    return crc32c_hw(_crc, (const unsigned char *) _data, _size);
+  }
+#endif
+  return crc32c_sw(_crc, (const unsigned char *) _data, _size);
+}
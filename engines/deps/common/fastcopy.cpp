@@ -0,0 +1,305 @@
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "fastcopy.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define FASTCOPY_X86
+#define FASTCOPY_AVX2
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define FASTCOPY_X86
+#define FASTCOPY_AVX2 __attribute__((target("avx2")))
+#endif
+
+#ifdef FASTCOPY_X86
+// copy head until _dst is _align aligned, returns the bytes copied
+static __inline size_t copyHead(unsigned char *_dst, const unsigned char *_src, size_t _size, size_t _align)
+{
+  size_t head = (_align - ((uintptr_t) _dst & (_align - 1))) & (_align - 1);
+  if(head > _size) head = _size;
+  memcpy(_dst, _src, head);
+  return head;
+}
+
+// non temporal stores, 16 bytes
+static void copyStreamSSE2(unsigned char *_dst, const unsigned char *_src, size_t _size)
+{
+  size_t head = copyHead(_dst, _src, _size, 16);
+  _dst += head; _src += head; _size -= head;
+
+  for(; _size >= 64; _size -= 64, _dst += 64, _src += 64)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *) (_src + 0));
+    __m128i b = _mm_loadu_si128((const __m128i *) (_src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *) (_src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *) (_src + 48));
+    _mm_stream_si128((__m128i *) (_dst + 0), a);
+    _mm_stream_si128((__m128i *) (_dst + 16), b);
+    _mm_stream_si128((__m128i *) (_dst + 32), c);
+    _mm_stream_si128((__m128i *) (_dst + 48), d);
+  }
+  for(; _size >= 16; _size -= 16, _dst += 16, _src += 16)
+  {
+    _mm_stream_si128((__m128i *) _dst, _mm_loadu_si128((const __m128i *) _src));
+  }
+  memcpy(_dst, _src, _size);
+  _mm_sfence();
+}
+
+// non temporal stores, 32 bytes
+FASTCOPY_AVX2 static void copyStreamAVX2(unsigned char *_dst, const unsigned char *_src, size_t _size)
+{
+  size_t head = copyHead(_dst, _src, _size, 32);
+  _dst += head; _src += head; _size -= head;
+
+  for(; _size >= 128; _size -= 128, _dst += 128, _src += 128)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (_src + 0));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (_src + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *) (_src + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *) (_src + 96));
+    _mm256_stream_si256((__m256i *) (_dst + 0), a);
+    _mm256_stream_si256((__m256i *) (_dst + 32), b);
+    _mm256_stream_si256((__m256i *) (_dst + 64), c);
+    _mm256_stream_si256((__m256i *) (_dst + 96), d);
+  }
+  for(; _size >= 32; _size -= 32, _dst += 32, _src += 32)
+  {
+    _mm256_stream_si256((__m256i *) _dst, _mm256_loadu_si256((const __m256i *) _src));
+  }
+  _mm256_zeroupper();
+  memcpy(_dst, _src, _size);
+  _mm_sfence();
+}
+
+// cpu and os support for avx2 (ymm state saved by the os)
+static bool avx2Support()
+{
+  unsigned int ecx1 = 0, ebx7 = 0;
+#if defined(_MSC_VER)
+  int info[4] = { 0 };
+  __cpuid(info, 0);
+  if(info[0] < 7) return false;
+  __cpuid(info, 1);
+  ecx1 = info[2];
+  __cpuidex(info, 7, 0);
+  ebx7 = info[1];
+#else
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if(__get_cpuid_max(0, nullptr) < 7) return false;
+  __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+  ecx1 = ecx;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  ebx7 = ebx;
+#endif
+  bool osxsave = (ecx1 >> 27) & 1;
+  bool avx = (ecx1 >> 28) & 1;
+  if(!osxsave || !avx || !((ebx7 >> 5) & 1)) return false;
+
+#if defined(_MSC_VER)
+  unsigned long long xcr0 = _xgetbv(0);
+#else
+  unsigned int xlo = 0, xhi = 0;
+  __asm__ volatile("xgetbv" : "=a"(xlo), "=d"(xhi) : "c"(0));
+  unsigned long long xcr0 = ((unsigned long long) xhi << 32) | xlo;
+#endif
+  return (xcr0 & 6) == 6;
+}
+#endif
+
+typedef void (*CopyKernel)(unsigned char *, const unsigned char *, size_t);
+
+static void copyTemporal(unsigned char *_dst, const unsigned char *_src, size_t _size)
+{
+  memcpy(_dst, _src, _size);
+}
+
+// streaming kernel for this cpu
+static CopyKernel streamKernel()
+{
+  static CopyKernel kernel = nullptr;
+  if(!kernel)
+  {
+#ifdef FASTCOPY_X86
+    kernel = avx2Support()? copyStreamAVX2 : copyStreamSSE2;
+#else
+    kernel = copyTemporal;
+#endif
+  }
+  return kernel;
+}
+
+// splits one copy in chunks, the calling thread copies too. One split copy at a time,
+// a caller finding the pool busy copies on its own thread
+class CopyPool
+{
+private:
+  std::vector<std::thread> threads_;
+  std::mutex runMutex_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable doneCond_;
+  int numThreads_ = 0;
+  bool running_ = false;
+  long long job_ = 0;
+
+  // current job
+  CopyKernel kernel_ = nullptr;
+  unsigned char *dst_ = nullptr;
+  const unsigned char *src_ = nullptr;
+  size_t size_ = 0;
+  size_t chunk_ = 0;
+  int chunks_ = 0;
+  int next_ = 0;
+  int pending_ = 0;
+
+  CopyPool()
+  {
+    unsigned int hw = std::thread::hardware_concurrency();
+    numThreads_ = (int) ((hw / 2 < FASTCOPY_MAX_THREADS)? hw / 2 : FASTCOPY_MAX_THREADS);
+  }
+
+  ~CopyPool()
+  {
+    stop();
+  }
+
+  void start()
+  {
+    running_ = true;
+    for(int i = 1; i < numThreads_; i++)
+    {
+      threads_.push_back(std::thread(&CopyPool::workerThread, this));
+    }
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    cond_.notify_all();
+    for(auto &t : threads_)
+    {
+      t.join();
+    }
+    threads_.clear();
+  }
+
+  // copy chunks until none left
+  void copyChunks()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(next_ < chunks_)
+    {
+      int i = next_++;
+      lock.unlock();
+      size_t offset = i * chunk_;
+      size_t size = (offset + chunk_ > size_)? size_ - offset : chunk_;
+      kernel_(dst_ + offset, src_ + offset, size);
+      lock.lock();
+      if(--pending_ == 0)
+      {
+        doneCond_.notify_all();
+      }
+    }
+  }
+
+  void workerThread()
+  {
+    long long job = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(1)
+    {
+      cond_.wait(lock, [&] { return !running_ || job_ != job; });
+      if(!running_) break;
+      job = job_;
+      lock.unlock();
+      copyChunks();
+      lock.lock();
+    }
+  }
+
+public:
+  static CopyPool& instance()
+  {
+    static CopyPool instance;
+    return instance;
+  }
+
+  void setThreads(int _threads)
+  {
+    std::lock_guard<std::mutex> runLock(runMutex_);
+    stop();
+    numThreads_ = (_threads < 1)? 1 : _threads;
+  }
+
+  // false when the pool is busy or disabled
+  bool copy(unsigned char *_dst, const unsigned char *_src, size_t _size, CopyKernel _kernel)
+  {
+    std::unique_lock<std::mutex> runLock(runMutex_, std::try_to_lock);
+    if(!runLock.owns_lock() || numThreads_ <= 1)
+    {
+      return false;
+    }
+
+    if(!running_)
+    {
+      start();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      kernel_ = _kernel;
+      dst_ = _dst;
+      src_ = _src;
+      size_ = _size;
+      // cache line multiple chunks
+      chunk_ = ((_size / numThreads_) + 63) & ~((size_t) 63);
+      chunks_ = (int) ((_size + chunk_ - 1) / chunk_);
+      next_ = 0;
+      pending_ = chunks_;
+      job_++;
+    }
+    cond_.notify_all();
+
+    copyChunks();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    doneCond_.wait(lock, [&] { return pending_ == 0; });
+    return true;
+  }
+};
+
+void fastcopy(void *_dst, const void *_src, size_t _size, bool _stream)
+{
+  unsigned char *dst = (unsigned char *) _dst;
+  const unsigned char *src = (const unsigned char *) _src;
+
+  if(_size < FASTCOPY_NT_THRESHOLD)
+  {
+    memcpy(dst, src, _size);
+    return;
+  }
+
+  CopyKernel kernel = _stream? streamKernel() : copyTemporal;
+  if(_size >= FASTCOPY_MT_THRESHOLD && CopyPool::instance().copy(dst, src, _size, kernel))
+  {
+    return;
+  }
+
+  kernel(dst, src, _size);
+}
+
+void fastcopy_setthreads(int _threads)
+{
+  CopyPool::instance().setThreads(_threads);
+}
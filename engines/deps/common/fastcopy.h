@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+#define FASTCOPY_NT_THRESHOLD (256 * 1024)       // below this a plain memcpy, the destination may stay cache resident
+#define FASTCOPY_MT_THRESHOLD (4 * 1024 * 1024)  // above this the copy is split across the copy pool
+#define FASTCOPY_MAX_THREADS 4                   // copy pool cap, leave the cores to the other engines
+
+// frame sized copies. _stream uses non temporal stores, for destinations this process will not read back
+// (shared memory slots, textures). Large copies are split across a small pool, AVX2/SSE2 picked at runtime
+void fastcopy(void *_dst, const void *_src, size_t _size, bool _stream = true);
+// copy pool size (calling thread included), 1 disables the pool
+void fastcopy_setthreads(int _threads);
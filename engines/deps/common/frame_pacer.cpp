@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include "frame_pacer.h"
+#include "clock.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#define FRAMEPACER_SPIN 1000000LL         // ns spun before the deadline, high resolution timers wake up within ~0.5 ms
+#else
+#include <time.h>
+#include <errno.h>
+#include <thread>
+#define FRAMEPACER_SPIN 200000LL          // clock_nanosleep wakes up within tens of us
+#endif
+
+static long long gcd(long long _a, long long _b)
+{
+  while(_b != 0)
+  {
+    long long t = _a % _b;
+    _a = _b;
+    _b = t;
+  }
+  return _a;
+}
+
+// frame _k ends _k * _num / _den seconds (ns) after the anchor, exact
+static long long offset(long long _k, long long _num, long long _den)
+{
+  return (_k * _num / _den) * 1000000000LL + (((_k * _num) % _den) * 1000000000LL) / _den;
+}
+
+// first frame ending after _t ns from the anchor
+static long long frameAfter(long long _t, long long _num, long long _den)
+{
+  long long k = (long long) ((long double) _t * _den / (_num * 1000000000.0L));
+  if(k < 0) k = 0;
+  while(k > 0 && offset(k, _num, _den) > _t) k--;
+  while(offset(k, _num, _den) <= _t) k++;
+  return k;
+}
+
+// monotonic ns, system wide (the house clock is shared between processes)
+long long FramePacer::now()
+{
+  return shm_timestamp();
+}
+
+bool FramePacer::lock(long long _phase, bool _master)
+{
+  if(!house_.clock) house_ = shm_clock_open();
+  phase_ = _phase;
+  masterAllowed_ = _master;
+  deadline_ = -1;
+  return house_.clock != nullptr;
+}
+
+void FramePacer::unlock()
+{
+  if(master_) shm_clock_release(&house_);
+  master_ = false;
+  shm_clock_close(&house_);
+}
+
+long long FramePacer::wait(long long _num, long long _den)
+{
+  if(_num <= 0 || _den <= 0) return 0;
+  long long g = gcd(_num, _den);
+  _num /= g;
+  _den /= g;
+
+  if(Clock::instance().isVirtual()) return advance(_num, _den);
+
+  long long late = 0;
+  if(house_.clock && waitLocked(_num, _den, &late)) return late;
+
+  long long start = now();
+  if(anchor_ < 0)
+  {
+    anchor_ = start;
+    count_ = 0;
+  }
+  else if(_num != num_ || _den != den_)
+  {
+    // new period: schedule goes on from the start of this frame
+    anchor_ += offset(count_, num_, den_);
+    count_ = 0;
+  }
+  num_ = _num;
+  den_ = _den;
+
+  count_++;
+  long long deadline = anchor_ + offset(count_, num_, den_);
+  if(count_ == den_)
+  {
+    // den frames take num seconds exactly, the anchor moves on so the products stay small
+    anchor_ = deadline;
+    count_ = 0;
+  }
+
+  frames_++;
+  long long period = offset(1, num_, den_);
+  if(start > deadline + period)
+  {
+    // more than a frame late (stall, debugger, suspend). Start over from now
+    missed_++;
+    anchor_ = start;
+    count_ = 0;
+    return start - deadline;
+  }
+
+  sleepUntil(deadline);
+  late = now() - deadline;
+  jitter_.add(late);
+  return late;
+}
+
+// waitLocked: frame end aligned on the house clock, false when it has no master (free running meanwhile)
+bool FramePacer::waitLocked(long long _num, long long _den, long long *_late)
+{
+  long long start = now();
+
+  // house rate in frames per second: our period upside down
+  if(masterAllowed_)
+  {
+    master_ = shm_clock_claim(&house_, (int) _den, (int) _num, start);
+  }
+  int rateNum = 0, rateDen = 0;
+  long long anchor = 0;
+  if(!shm_clock_read(&house_, &rateNum, &rateDen, &anchor))
+  {
+    master_ = false;
+    return false;
+  }
+
+  // next frame after the last one, or after now when more than a frame late
+  long long base = anchor + phase_;
+  long long period = offset(1, _num, _den);
+  long long from = (deadline_ >= 0)? deadline_ : start;
+  long long k = frameAfter(from - base, _num, _den);
+  long long deadline = base + offset(k, _num, _den);
+  if(start > deadline + period)
+  {
+    missed_++;
+    k = frameAfter(start - base, _num, _den);
+    deadline = base + offset(k, _num, _den);
+  }
+
+  frames_++;
+  sleepUntil(deadline);
+  *_late = now() - deadline;
+  jitter_.add(*_late);
+  deadline_ = deadline;
+
+  // the master runs at the house rate, its frame k is house frame k
+  if(master_)
+  {
+    shm_clock_tick(&house_, k, anchor + offset(k, _num, _den));
+  }
+
+  // dropping back to free running goes on from here
+  anchor_ = deadline;
+  count_ = 0;
+  num_ = _num;
+  den_ = _den;
+  return true;
+}
+
+// advance: offline, the frame is done. The virtual clock moves on to its deadline (exact, same schedule as
+// wait), nothing sleeps and the house clock is left alone
+long long FramePacer::advance(long long _num, long long _den)
+{
+  Clock &clock = Clock::instance();
+  if(anchor_ < 0 || _num != num_ || _den != den_)
+  {
+    anchor_ = clock.elapsed();
+    count_ = 0;
+  }
+  num_ = _num;
+  den_ = _den;
+
+  count_++;
+  long long deadline = anchor_ + offset(count_, num_, den_);
+  if(count_ == den_)
+  {
+    anchor_ = deadline;
+    count_ = 0;
+  }
+
+  frames_++;
+  clock.advance(deadline);
+  return 0;
+}
+
+long long FramePacer::houseAlign(long long _t, long long _phase)
+{
+  ShMClockHandle house = shm_clock_open();
+  int rateNum = 0, rateDen = 0;
+  long long anchor = 0;
+  bool master = shm_clock_read(&house, &rateNum, &rateDen, &anchor);
+  shm_clock_close(&house);
+  if(!master || rateNum <= 0 || rateDen <= 0) return _t;
+
+  // house period rateDen / rateNum seconds
+  long long base = anchor + _phase;
+  if(_t <= base) return base;
+  return base + offset(frameAfter(_t - base - 1, rateDen, rateNum), rateDen, rateNum);
+}
+
+// sleepUntil: timer sleep up to FRAMEPACER_SPIN before _deadline, spin the rest
+void FramePacer::sleepUntil(long long _deadline)
+{
+  long long wake = _deadline - FRAMEPACER_SPIN;
+#ifdef _WIN32
+  static thread_local HANDLE timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+  long long remaining = wake - now();
+  if(timer && remaining > 0)
+  {
+    LARGE_INTEGER due;
+    due.QuadPart = -(remaining / 100);
+    if(SetWaitableTimer(timer, &due, 0, nullptr, nullptr, FALSE))
+    {
+      WaitForSingleObject(timer, INFINITE);
+    }
+  }
+  // no high resolution timer (before windows 10 1803)
+  while(wake - now() > 2000000LL)
+  {
+    Sleep(1);
+  }
+  while(now() < _deadline)
+  {
+    YieldProcessor();
+  }
+#else
+  if(wake > now())
+  {
+    struct timespec ts;
+    ts.tv_sec = wake / 1000000000LL;
+    ts.tv_nsec = wake % 1000000000LL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) { }
+  }
+  while(now() < _deadline)
+  {
+    std::this_thread::yield();
+  }
+#endif
+}
+
+std::string FramePacer::report()
+{
+  long long t = now();
+  if(lastReport_ == 0) lastReport_ = t;
+  if(t - lastReport_ < FRAMEPACER_REPORT_INTERVAL) return "";
+
+  char str[192];
+  if(Clock::instance().isVirtual())
+  {
+    // offline: throughput against real time
+    long long elapsed = Clock::instance().elapsed();
+    snprintf(str, sizeof(str), "offline %.1f fps, x%.2f real time", (frames_ - reportFrames_) * 1e9 / (t - lastReport_),
+             (double) (elapsed - reportVirtual_) / (t - lastReport_));
+    reportFrames_ = frames_;
+    reportVirtual_ = elapsed;
+  }
+  else
+  {
+    snprintf(str, sizeof(str), "jitter %s, missed %lld", jitter_.summary().c_str(), missed_);
+  }
+  jitter_.reset();
+  missed_ = 0;
+  lastReport_ = t;
+  return str;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include "latency.h"
+#include "shmhelper.h"
+
+#define FRAMEPACER_REPORT_INTERVAL 60000000000LL   // ns between report() summaries
+
+// FramePacer: paces a loop at a frame period. Deadlines are absolute (anchor + frame count * period, the
+// period a rational number of seconds), so sleep error never adds up. Sleeps on an absolute / high
+// resolution timer up to a short spin before the deadline. A frame late by more than a period restarts the
+// schedule from now instead of bursting to catch up.
+// Locked to the house clock (ShMClock) frames end _phase ns after the house ticks instead, so engines across
+// the host tick phase aligned. Frames missed while locked skip to the next house aligned deadline.
+// On a virtual Clock (offline mode) nothing sleeps: each frame moves the clock on by its period
+class FramePacer
+{
+public:
+  FramePacer() {};
+  ~FramePacer() { unlock(); }
+
+  // wait: until the end of the current frame, _num/_den seconds long. Returns ns past the deadline on wake up
+  long long wait(long long _num, long long _den);
+  void restart() { anchor_ = -1; deadline_ = -1; }
+
+  // house clock. _master: tick it at our rate while nobody else does. Free running while it has no master
+  bool lock(long long _phase, bool _master = true);
+  void unlock();
+  bool locked() const { return house_.clock != nullptr; }
+  bool master() const { return master_; }
+
+  // statistics
+  long long frames() const { return frames_; }
+  long long missed() const { return missed_; }
+  const LatencyHistogram & jitter() const { return jitter_; }
+  // report: "jitter n 1500 p50 0.01 p99 0.05 max 0.20 ms, missed 0" (offline: "offline 812.4 fps, x32.50
+  // real time") once per FRAMEPACER_REPORT_INTERVAL (statistics start over), empty otherwise
+  std::string report();
+
+  static long long now();
+  // sleepUntil: absolute now() ns, timer then spin
+  static void sleepUntil(long long _deadline);
+  // houseAlign: first house tick at or after _t plus _phase ns, _t when the house clock has no master
+  static long long houseAlign(long long _t, long long _phase);
+
+protected:
+  bool waitLocked(long long _num, long long _den, long long *_late);
+  long long advance(long long _num, long long _den);
+
+protected:
+  long long anchor_ = -1;           // now() at frame 0 of the schedule
+  long long num_ = 0;               // frame period, seconds
+  long long den_ = 1;
+  long long count_ = 0;             // frames since the anchor, wraps with the anchor every den_ frames
+  long long frames_ = 0;
+  long long missed_ = 0;            // frames woken up more than a period late
+  LatencyHistogram jitter_;         // wake up past the deadline
+  long long lastReport_ = 0;
+  long long reportFrames_ = 0;      // frames_ and virtual time at the last report, offline
+  long long reportVirtual_ = 0;
+  ShMClockHandle house_ = {};       // house clock, locked when mapped
+  long long phase_ = 0;             // ns after the house ticks
+  bool masterAllowed_ = false;
+  bool master_ = false;             // we tick the house clock
+  long long deadline_ = -1;         // last deadline, locked
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+#define LATENCY_BUCKETS 128                 // microsecond buckets, 4 per power of two (<25% error), up to ~1 hour
+
+// LatencyHistogram: log linear histogram of ns samples. Percentiles are bucket upper bounds
+class LatencyHistogram
+{
+public:
+  LatencyHistogram() { reset(); };
+
+  void reset()
+  {
+    for(int i = 0; i < LATENCY_BUCKETS; i++) buckets_[i] = 0;
+    count_ = 0;
+    max_ = 0;
+  }
+
+  void add(long long _ns)
+  {
+    if(_ns < 0) _ns = 0;
+    buckets_[bucket(_ns / 1000)]++;
+    count_++;
+    if(_ns > max_) max_ = _ns;
+  }
+
+  long long count() const { return count_; }
+  long long max() const { return max_; }
+
+  // percentile: upper bound (ns) of the bucket holding the _p (0..1) sample
+  long long percentile(double _p) const
+  {
+    long long rank = (long long) (_p * count_ + 0.5);
+    long long seen = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+      seen += buckets_[i];
+      if(seen >= rank && seen > 0)
+      {
+        long long bound = upperBound(i) * 1000;
+        return (bound < max_)? bound : max_;
+      }
+    }
+    return max_;
+  }
+
+  // summary: "n 250 p50 2.05 p99 8.19 max 9.31 ms"
+  std::string summary() const
+  {
+    char str[128];
+    snprintf(str, sizeof(str), "n %lld p50 %.2f p99 %.2f max %.2f ms", count_, percentile(0.5) / 1e6, percentile(0.99) / 1e6, max_ / 1e6);
+    return str;
+  }
+
+protected:
+  // bucket: values under 4 us get their own bucket, then 4 buckets per power of two
+  static int bucket(long long _us)
+  {
+    if(_us < 4) return (int) _us;
+    int msb = 0;
+    for(long long v = _us; v > 1; v >>= 1) msb++;
+    int index = 4 + (msb - 2) * 4 + (int) ((_us >> (msb - 2)) & 3);
+    return (index < LATENCY_BUCKETS)? index : LATENCY_BUCKETS - 1;
+  }
+
+  // upperBound: first us value past _bucket
+  static long long upperBound(int _bucket)
+  {
+    if(_bucket < 4) return _bucket + 1;
+    int msb = (_bucket - 4) / 4 + 2;
+    long long sub = (_bucket - 4) % 4;
+    return (5 + sub) << (msb - 2);
+  }
+
+protected:
+  long long buckets_[LATENCY_BUCKETS];
+  long long count_ = 0;
+  long long max_ = 0;
+};
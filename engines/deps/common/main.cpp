@@ -5,6 +5,8 @@
 #include <fstream>
 #include "base64.h"
 #include "notifier.h"
+#include "shmhelper.h"
+#include "clock.h"
 
 using namespace std::chrono_literals;
 
@@ -23,6 +25,8 @@ std::string configJson;   // the config Json
 bool version = false;     // print version and exit
 bool schema = false;      // print schema and exit
 bool debug = false;
+bool lockMemory = false;  // lock shared memory pages
+bool offline = false;     // virtual clock: frames as fast as the pipeline goes, none dropped
 
 #include <Windows.h> // exe path
 #include <direct.h>  // _chdir
@@ -63,6 +67,14 @@ void readParams(int argc, char *argv[])
     {
       debug = true;
     }
+    else if(!_stricmp(argv[i], "-l"))
+    {
+      lockMemory = true;
+    }
+    else if(!_stricmp(argv[i], "-o"))
+    {
+      offline = true;
+    }
   }
 }
 
@@ -75,6 +87,18 @@ int main(int argc, char * argv[])
   // read params
   readParams(argc, argv);
 
+  // shared memory backing
+  if(lockMemory)
+  {
+    shm_setflags(shm_getflags() | SHM_FLAG_LOCK);
+  }
+
+  // offline: time moves with the frames, not the wall clock
+  if(offline)
+  {
+    Clock::instance().setVirtual(true);
+  }
+
   // invoked from Launcher
   if(!debug)
   {
@@ -3,13 +3,109 @@
 
 /*
  * Based on https://stackoverflow.com/questions/16283517/single-producer-consumer-ring-buffer-in-shared-memory
- * gcc -I./ -o shmringbuffer shmringbuffer.cpp shmhelper.linux.cpp -lrt
+ * gcc -I./ -o shmringbuffer shmringbuffer.cpp shmhelper.linux.cpp -lrt -lpthread
  */
 
+#include <stdio.h>
+
+#define SHM_ALIGN 64                        // data slots start on a cache line / SIMD boundary
+#define MAX_NUM_READERS 16                  // registered readers per ring
+#define READER_LEASE_TIMEOUT 2000000000LL   // ns without activity before a reader is expired
+#define SHM_NAME_SIZE 256
+#define SHM_CONTROL_MAGIC 0x4D48534E        // 'NSHM'
+#define SHM_HUGEPAGE_SIZE (2ULL * 1024 * 1024)
+#define SHM_REGISTRY_NAME "neurona.registry"   // well known segment producers publish themselves in
+#define SHM_REGISTRY_MAGIC 0x4752534E       // 'NSRG'
+#define SHM_REGISTRY_SIZE 64                // sources
+#define SHM_CLOCK_NAME "neurona.clock"      // well known house clock segment
+#define SHM_CLOCK_MAGIC 0x4b4c434e          // 'NCLK'
+#define SHM_CLOCK_STALE 1000000000LL        // ns without a master tick before another pacer takes the clock over
+#define SHM_MAX_RENDITIONS 8                // scaled copies of the video ring consumers can ask a producer for
+#define SHM_RENDITION_LEASE 2000000000LL    // ns a rendition request lives without being renewed
+#define SHM_MAX_PINNED 8                    // spare slots standing in for slots consumers pinned
+#define SHM_MAX_SLOTS 64                    // data slots with pin bookkeeping (messages + spare + pinned)
+
+// ShMFlags: how ring memory is backed (shm_setflags, process wide)
+enum ShMFlags
+{
+  SHM_FLAG_HUGEPAGES = 1,                   // huge pages (linux: hugetlbfs memfd, else transparent huge pages)
+  SHM_FLAG_POPULATE = 2,                    // fault every page in when mapping, no first frame stalls
+  SHM_FLAG_LOCK = 4,                        // mlock / VirtualLock, never swapped out
+};
+
+// ShMPolicy: what happens when a reader is slower than the producer
+enum ShMPolicy
+{
+  SHM_POLICY_LATEST = 0,                    // readers jump to the newest message, slow readers drop
+  SHM_POLICY_LOSSLESS = 1,                  // producer waits on the slowest reader
+};
+
 struct Message
 {
   unsigned long long id;
   unsigned long offset;	            // offset from RingBuffer start
+  unsigned long size;               // payload size written by the producer
+  volatile long long seq;           // write sequence stored in this slot, set after the payload (seqlock end)
+  volatile long long wbegin;        // write sequence being written, set before the payload (seqlock begin)
+};
+
+// Reader: per reader cursor
+struct Reader
+{
+  volatile long long rseq;          // next sequence to read. -1 when free
+  volatile long long lease;         // shm_timestamp() of last activity
+};
+
+// ShMReaderStats: per reader counters, written by that reader only
+struct ShMReaderStats
+{
+  volatile long long reads;         // messages consumed
+  volatile long long drops;         // messages skipped (latest policy jumps, lapped by the producer)
+  volatile long long torn;          // copies the producer wrote over while they were read
+  volatile long long lag;           // messages behind the producer at the last read
+};
+
+// ShMMode: how the ring data is laid out
+enum ShMMode
+{
+  SHM_MODE_MESSAGES = 0,                    // one message per slot, wseq counts messages
+  SHM_MODE_STREAM = 1,                      // byte stream of records in a single slot, wseq counts bytes
+};
+
+// ShMRecord: stream rings. Records sit back to back in the data slot and never straddle its end, a pad
+// record fills the tail instead. Message 0 carries the newest record position (seq) and the end of the
+// region being written (wbegin), readers further behind than the slot size were written over
+struct ShMRecord
+{
+  int size;                         // payload bytes after the header, -1: pad up to the end of the slot
+  int reserved;
+  long long pos;                    // stream position (bytes since the ring started) of this record
+};
+
+// stream bytes taken by a record with _size payload bytes
+__inline unsigned int shm_recordsize(int _size)
+{
+  return (unsigned int) ((sizeof(ShMRecord) + _size + 15) & ~15);
+}
+
+// ShMStats: ring statistics. Every counter has a single writer (producer or owning reader) and is
+// updated relaxed (shm_stat_add). Monitoring tools read them without registering
+struct ShMStats
+{
+  volatile long long writes;        // messages published
+  volatile long long bytes;         // payload bytes published
+  volatile long long overruns;      // messages written over before the slowest live reader got to them
+  volatile long long stalls;        // lossless: writes that had to wait on the slowest reader
+  volatile long long lastWrite;     // shm_timestamp() of the last publish
+  volatile long long unpinned;      // pinned slots written over, every spare slot was pinned too
+  ShMReaderStats readers[MAX_NUM_READERS];
+};
+
+// ShMSlot: data slot bookkeeping. Slots move between messages, the producer keeps off pinned ones
+struct ShMSlot
+{
+  volatile long long pins;          // consumer frames holding the slot (shm_pin / shm_unpin)
+  volatile long long stamp;         // bumped every time the producer claims the slot to write it
 };
 
 #pragma warning(disable:4200)
@@ -19,7 +115,21 @@ struct RingBuffer
   unsigned int size = 0;
   unsigned int count = 0;
   long long wseq = -1;
-  long long keepAlive = -1;   // producer increment counter every second. Consumer use this counter as keepAlive
+  int policy = SHM_POLICY_LATEST;
+  int mode = SHM_MODE_MESSAGES;
+  volatile int futex = 0;     // bumped on every write. Readers block on it (linux)
+  volatile int waiters = 0;   // readers blocked on futex (windows: unregistered readers on the wake semaphore)
+  volatile int rfutex = 0;    // bumped every time a reader moves on. The lossless producer blocks on it (linux)
+  volatile int rwaiters = 0;  // producer blocked on the readers (rfutex, windows: writer event)
+  Reader readers[MAX_NUM_READERS];
+  volatile long long heartbeat = 0; // producer liveness, shm_timestamp() of the last publish. 0 once it closed the ring
+  long long pid = 0;          // producer process, looked at by consumers when the heartbeat goes stale
+  unsigned long spare = 0;    // offset of the data slot no message points to (producer reserve / commit)
+  unsigned int pinned = 0;    // extra spare slots, taken instead of message slots consumers pinned
+  unsigned long parked[SHM_MAX_PINNED] = { };  // their offsets. A pinned slot a message moves off is parked here
+  ShMSlot slots[SHM_MAX_SLOTS] = { };   // per data slot, see shm_slotindex
+  unsigned long long maplen = 0;  // mapping length (shm_length rounded up to the page size backing it)
+  ShMStats stats = {};        // counters, see ShMStats
 
   /* always last member */
   Message buffer[];
@@ -31,12 +141,196 @@ struct ShMHandle
 {
   unsigned long long shm_handle = 0;  // shared memory handle  
   RingBuffer *rb = nullptr;           // ring buffer
+  int reader = -1;                    // registered reader index (consumer side)
+  unsigned long long event = 0;       // reader wake event (consumer side, windows)
+  unsigned long long events[MAX_NUM_READERS] = { };   // reader wake events (producer side, windows)
+  unsigned long long writer = 0;      // producer wake event, signaled by readers moving on (windows)
+  unsigned long long semaphore = 0;   // wake semaphore of unregistered readers (windows)
+  char name[SHM_NAME_SIZE] = { };     // shared memory name
+  unsigned long long length = 0;      // mapped length
+  long long server = -1;              // socket handing the ring fd to consumers (producer side, linux)
+};
+
+// ShMRendition: scaled copy of the video ring requested by consumers. Consumers asking for the same
+// geometry share the entry and renew its lease, the producer drops the rendition once it expires
+struct ShMRendition
+{
+  volatile long long key = 0;         // shm_renditionkey(). 0 when free
+  volatile long long lease = 0;       // shm_timestamp() of the last renewal
 };
 
-ShMHandle shm_init(const char *_shmname, int _messageSize, int _messageCount);
-ShMHandle shm_connect(const char *_shmname);
+// ShMControl: small fixed segment named after the producer ID. Points consumers to the current ring,
+// which lives in its own segment (ID#epoch) so the producer can remap it with a different slot size
+struct ShMControl
+{
+  unsigned int magic = 0;
+  unsigned int version = 1;
+  volatile long long epoch = -1;      // ring generation. Bumped on every remap
+  unsigned int size = 0;              // current ring message size
+  unsigned int count = 0;             // current ring message count
+  ShMRendition renditions[SHM_MAX_RENDITIONS];  // consumer requests, kept across producer restarts
+  volatile int pins = 0;              // pinned slots consumers asked for (shm_pins_request), kept as well
+};
+
+struct ShMControlHandle
+{
+  unsigned long long shm_handle = 0;  // shared memory handle
+  ShMControl *ctl = nullptr;          // control segment
+};
+
+// relaxed counter update. Single writer per counter, aligned 64 bit stores are atomic
+__inline void shm_stat_add(volatile long long *_counter, long long _value)
+{
+  *_counter = *_counter + _value;
+}
+
+// rendition key: width, height and pixel format (-1: the source format) packed in one word
+__inline long long shm_renditionkey(int _width, int _height, int _format)
+{
+  return (long long) (_width & 0xffff) | ((long long) (_height & 0xffff) << 16) | ((long long) (_format + 1) << 32);
+}
+
+__inline void shm_renditionformat(long long _key, int *_width, int *_height, int *_format)
+{
+  *_width = (int) (_key & 0xffff);
+  *_height = (int) ((_key >> 16) & 0xffff);
+  *_format = (int) (_key >> 32) - 1;
+}
+
+// pinned slots request: consumers that pin frames ask for them, the producer remaps with the most asked for
+__inline void shm_pins_request(ShMControlHandle *_handle, int _pins)
+{
+  if(_handle->ctl && _handle->ctl->pins < _pins) _handle->ctl->pins = _pins;
+}
+
+// ShMSource: registry entry. Written by the producer process owning it, read by anyone
+struct ShMSource
+{
+  volatile long long pid = 0;         // owner process. 0 when free
+  volatile long long version = 0;     // odd while the owner updates the entry
+  long long started = 0;              // shm_timestamp() the source was published
+  char uid[SHM_NAME_SIZE] = { };      // producer ID (control segment name)
+  int media = 0;                      // rings published, bit per media type (1 << AVMediaType)
+  int format = -1;                    // video
+  int width = 0;
+  int height = 0;
+  int frameRateNum = 0;
+  int frameRateDen = 0;
+  unsigned int size = 0;              // video ring geometry
+  unsigned int count = 0;
+  int policy = SHM_POLICY_LATEST;
+};
+
+// ShMRegistry: sources currently published. A zero filled segment is an empty registry
+struct ShMRegistry
+{
+  unsigned int magic = 0;
+  unsigned int version = 1;
+  volatile long long generation = 0;  // bumped on every change
+  volatile int futex = 0;             // bumped with generation. Subscribers block on it (linux)
+  volatile int waiters = 0;           // subscribers blocked on futex (windows: on the change semaphore)
+  ShMSource sources[SHM_REGISTRY_SIZE];
+};
+
+struct ShMRegistryHandle
+{
+  unsigned long long shm_handle = 0;  // shared memory handle
+  ShMRegistry *reg = nullptr;         // registry segment
+  unsigned long long semaphore = 0;   // change semaphore (windows)
+};
+
+// ShMClock: house clock, one per host. House frame k starts at anchor + k * rateDen / rateNum seconds
+// (shm_timestamp() ns). A master ticks it every frame, engines locked to it derive their own deadlines from
+// anchor and rate plus a phase offset, so they all tick phase aligned. A zero filled segment has no master
+struct ShMClock
+{
+  unsigned int magic = 0;
+  unsigned int reserved = 0;
+  volatile long long version = 0;     // odd while the master changes rate and anchor (seqlock)
+  volatile long long pid = 0;         // master process, 0: none
+  volatile int rateNum = 0;
+  volatile int rateDen = 0;
+  volatile long long anchor = 0;      // house frame 0
+  volatile long long tick = -1;       // last house frame the master ticked
+  volatile long long deadline = 0;    // and its deadline
+};
+
+struct ShMClockHandle
+{
+  unsigned long long shm_handle = 0;  // shared memory handle
+  ShMClock *clock = nullptr;          // clock segment
+};
+
+// ring segment name for a control segment epoch
+__inline void shm_ringname(char *_name, int _nameSize, const char *_shmname, long long _epoch)
+{
+  snprintf(_name, _nameSize, "%s#%lld", _shmname, _epoch);
+}
+
+// header (ring + messages) rounded up so data slots are SHM_ALIGN aligned
+__inline unsigned long long shm_headersize(unsigned int _messageCount)
+{
+  unsigned long long size = sizeof(RingBuffer) + (_messageCount * sizeof(Message));
+  return (size + SHM_ALIGN - 1) & ~((unsigned long long) SHM_ALIGN - 1);
+}
+
+// whole mapping: header + one data slot per message + spare slot + pinned spare slots
+__inline unsigned long long shm_length(unsigned int _messageSize, unsigned int _messageCount, unsigned int _pinned = 0)
+{
+  return shm_headersize(_messageCount) + ((unsigned long long) _messageSize * (_messageCount + 1 + _pinned));
+}
+
+// data slot at _offset, -1 past the slots with pin bookkeeping
+__inline int shm_slotindex(RingBuffer *_ringBuffer, unsigned long long _offset)
+{
+  unsigned long long header = shm_headersize(_ringBuffer->count);
+  if(_offset < header || _ringBuffer->size == 0) return -1;
+  unsigned long long slot = (_offset - header) / _ringBuffer->size;
+  return (slot < SHM_MAX_SLOTS)? (int) slot : -1;
+}
+
+ShMHandle shm_init(const char *_shmname, int _messageSize, int _messageCount, int _policy = SHM_POLICY_LATEST, int _pinned = 0);
+ShMHandle shm_connect(const char *_shmname, bool _readOnly = false);
 bool shm_write_increment(ShMHandle *_handle);
+bool shm_write_advance(ShMHandle *_handle, long long _bytes);
+bool shm_stream_valid(RingBuffer *_ringBuffer, long long _pos);
 bool shm_close(ShMHandle *_handle);
 unsigned char * shm_getmessagedata(RingBuffer *_ringBuffer, Message *_message);
+bool shm_slot_valid(RingBuffer *_ringBuffer, long long _seq);
+void shm_message_begin(Message *_message, long long _seq);
+bool shm_slot_claim(RingBuffer *_ringBuffer, unsigned long *_offset);
+long long shm_pin(RingBuffer *_ringBuffer, long long _seq, int *_slot);
+void shm_unpin(RingBuffer *_ringBuffer, int _slot);
+bool shm_pin_valid(RingBuffer *_ringBuffer, int _slot, long long _stamp);
+bool shm_wake(ShMHandle *_handle);
+bool shm_remove(const char *_shmname);
+ShMControlHandle shm_control_init(const char *_shmname);
+ShMControlHandle shm_control_connect(const char *_shmname);
+bool shm_control_close(ShMControlHandle *_handle);
+bool shm_rendition_request(ShMControlHandle *_handle, int _width, int _height, int _format);
+ShMRegistryHandle shm_registry_open();
+bool shm_registry_close(ShMRegistryHandle *_handle);
+bool shm_registry_publish(ShMRegistryHandle *_handle, const ShMSource *_source);
+bool shm_registry_remove(ShMRegistryHandle *_handle, const char *_uid);
+bool shm_registry_find(ShMRegistryHandle *_handle, const char *_uid, ShMSource *_source);
+int shm_registry_list(ShMRegistryHandle *_handle, ShMSource *_sources, int _maxSources);
+bool shm_registry_wait(ShMRegistryHandle *_handle, long long _generation, int _msTimeout);
+ShMClockHandle shm_clock_open();
+bool shm_clock_close(ShMClockHandle *_handle);
+bool shm_clock_claim(ShMClockHandle *_handle, int _rateNum, int _rateDen, long long _anchor);
+bool shm_clock_release(ShMClockHandle *_handle);
+bool shm_clock_read(ShMClockHandle *_handle, int *_rateNum, int *_rateDen, long long *_anchor);
+bool shm_clock_tick(ShMClockHandle *_handle, long long _tick, long long _deadline);
+void shm_setflags(int _flags);
+int shm_getflags();
+long long shm_timestamp();
+long long shm_pid();
+bool shm_process_alive(long long _pid);
+int shm_reader_register(ShMHandle *_handle);
+bool shm_reader_unregister(ShMHandle *_handle);
+bool shm_read_set(ShMHandle *_handle, long long _seq);
+long long shm_slowest_reader(ShMHandle *_handle, long long _leaseTimeout = READER_LEASE_TIMEOUT);
+bool shm_wait(ShMHandle *_handle, long long _seq, int _msTimeout);
+bool shm_wait_readers(ShMHandle *_handle, long long _slowest, int _msTimeout);
 
 #endif // SM_HELPER_INCLUDE
@@ -1,138 +1,1398 @@
-#ifdef __linux__ 
+#ifdef __linux__
 
 #include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include "shmhelper.h"
 
-ShMHandle shm_init(const char *shmname, int messageSize, int messageCount)
+static int shm_flags = SHM_FLAG_HUGEPAGES | SHM_FLAG_POPULATE;
+
+void shm_setflags(int _flags)
+{
+  shm_flags = _flags;
+}
+
+int shm_getflags()
+{
+  return shm_flags;
+}
+
+// posix shared memory names start with '/'
+static std::string shm_posixname(const char *_shmname)
+{
+  std::string name = _shmname;
+  if(name.empty() || name[0] != '/')
+  {
+    name = "/" + name;
+  }
+  return name;
+}
+
+// abstract unix socket the producer hands the ring fd out on
+static socklen_t shm_socketaddr(const char *_shmname, struct sockaddr_un *_addr)
+{
+  std::string name = std::string("neurona.shm.") + _shmname;
+  memset(_addr, 0, sizeof(*_addr));
+  _addr->sun_family = AF_UNIX;
+  size_t len = std::min(name.size(), sizeof(_addr->sun_path) - 2);
+  memcpy(_addr->sun_path + 1, name.c_str(), len);
+  return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+// shm_map: map _fd, optionally faulting every page in and locking it. Read only mappings are left alone
+static void * shm_map(int _fd, unsigned long long _length, bool _populate, bool _readOnly = false)
+{
+  int flags = MAP_SHARED | ((_populate && !_readOnly && (shm_flags & SHM_FLAG_POPULATE))? MAP_POPULATE : 0);
+  void *addr = mmap(0, (size_t) _length, _readOnly? PROT_READ : PROT_READ | PROT_WRITE, flags, _fd, 0);
+  if(addr != MAP_FAILED && !_readOnly && (shm_flags & SHM_FLAG_LOCK))
+  {
+    // best effort, RLIMIT_MEMLOCK may be too low
+    mlock(addr, (size_t) _length);
+  }
+  return addr;
+}
+
+// shm_memfd: anonymous memory file for the ring. hugetlbfs when the system has huge pages reserved,
+// regular pages with transparent huge pages advised otherwise
+static int shm_memfd(const char *_shmname, unsigned long long _length, unsigned long long *_maplen, void **_addr)
+{
+#ifdef MFD_HUGETLB
+  if(shm_flags & SHM_FLAG_HUGEPAGES)
+  {
+    unsigned long long maplen = (_length + SHM_HUGEPAGE_SIZE - 1) & ~(SHM_HUGEPAGE_SIZE - 1);
+    int fd = memfd_create(_shmname, MFD_CLOEXEC | MFD_HUGETLB);
+    if(fd >= 0)
+    {
+      void *addr = (ftruncate(fd, (off_t) maplen) == 0)? shm_map(fd, maplen, true) : MAP_FAILED;
+      if(addr != MAP_FAILED)
+      {
+        *_maplen = maplen;
+        *_addr = addr;
+        return fd;
+      }
+      close(fd);
+    }
+  }
+#endif
+
+  int fd = memfd_create(_shmname, MFD_CLOEXEC);
+  if(fd < 0)
+  {
+    return -1;
+  }
+
+  // advise huge pages before the pages are faulted in
+  void *addr = (ftruncate(fd, (off_t) _length) == 0)? shm_map(fd, _length, false) : MAP_FAILED;
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+  if(shm_flags & SHM_FLAG_HUGEPAGES)
+  {
+    madvise(addr, (size_t) _length, MADV_HUGEPAGE);
+  }
+  if(shm_flags & SHM_FLAG_POPULATE)
+  {
+#ifdef MADV_POPULATE_WRITE
+    if(madvise(addr, (size_t) _length, MADV_POPULATE_WRITE) != 0)
+#endif
+    {
+      long pageSize = sysconf(_SC_PAGESIZE);
+      for(unsigned long long i = 0; i < _length; i += pageSize)
+      {
+        ((volatile char *) addr)[i] = 0;
+      }
+    }
+  }
+
+  *_maplen = _length;
+  *_addr = addr;
+  return fd;
+}
+
+// shm_sendfd / shm_recvfd: fd over a unix socket (SCM_RIGHTS)
+static bool shm_sendfd(int _socket, int _fd)
+{
+  char data = 'f';
+  struct iovec iov = { &data, 1 };
+  char control[CMSG_SPACE(sizeof(int))] = { 0 };
+  struct msghdr msg = { };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &_fd, sizeof(int));
+  return sendmsg(_socket, &msg, MSG_NOSIGNAL) == 1;
+}
+
+static int shm_recvfd(const char *_shmname)
+{
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(sock < 0)
+  {
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  socklen_t addrlen = shm_socketaddr(_shmname, &addr);
+  struct timeval tv = { 1, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if(connect(sock, (struct sockaddr *) &addr, addrlen) != 0)
+  {
+    close(sock);
+    return -1;
+  }
+
+  char data = 0;
+  struct iovec iov = { &data, 1 };
+  char control[CMSG_SPACE(sizeof(int))] = { 0 };
+  struct msghdr msg = { };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int fd = -1;
+  if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1)
+  {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  close(sock);
+
+  return fd;
+}
+
+// ShMFdServer: hands the memfd of every ring this process produces to the consumers that connect. Each ring
+// listens on its own socket, one thread polls them all. shm_close drops the ring, the last one stops the thread
+struct ShMFdServer
+{
+  std::mutex mutex;
+  std::map<int, int> rings;         // listening socket -> dup of the ring fd
+  std::thread thread;
+  bool running = false;
+  int wake[2] = { -1, -1 };         // pipe, rings changed: the thread polls the new set
+
+  ~ShMFdServer()
+  {
+    // rings never closed, the process is going away
+    if(thread.joinable()) thread.detach();
+  }
+};
+
+static ShMFdServer shm_fdserver;
+
+// shm_peer_allowed: abstract sockets have no file permissions, anyone can connect. Only processes of the
+// producer user get the ring, like the 0600 named segments
+static bool shm_peer_allowed(int _client)
+{
+  struct ucred cred = { };
+  socklen_t len = sizeof(cred);
+  if(getsockopt(_client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || len != sizeof(cred))
+  {
+    return false;
+  }
+  return cred.uid == geteuid();
+}
+
+static void shm_fdserver_func()
+{
+  std::vector<struct pollfd> fds;
+  while(true)
+  {
+    {
+      std::lock_guard<std::mutex> lock(shm_fdserver.mutex);
+      if(!shm_fdserver.running)
+      {
+        return;
+      }
+      fds.clear();
+      fds.push_back({ shm_fdserver.wake[0], POLLIN, 0 });
+      for(auto it = shm_fdserver.rings.begin(); it != shm_fdserver.rings.end(); it++)
+      {
+        fds.push_back({ it->first, POLLIN, 0 });
+      }
+    }
+
+    if(poll(fds.data(), (nfds_t) fds.size(), -1) < 0)
+    {
+      continue;
+    }
+
+    char drain[64];
+    while(read(shm_fdserver.wake[0], drain, sizeof(drain)) > 0);
+
+    // under the lock: a socket shm_close dropped meanwhile is not in rings any more
+    std::lock_guard<std::mutex> lock(shm_fdserver.mutex);
+    for(size_t i = 1; i < fds.size(); i++)
+    {
+      auto it = shm_fdserver.rings.find(fds[i].fd);
+      if(!(fds[i].revents & POLLIN) || it == shm_fdserver.rings.end())
+      {
+        continue;
+      }
+      int client = accept4(it->first, NULL, NULL, SOCK_CLOEXEC);
+      if(client >= 0)
+      {
+        if(shm_peer_allowed(client))
+        {
+          shm_sendfd(client, it->second);
+        }
+        close(client);
+      }
+    }
+  }
+}
+
+// shm_serve: hand _fd to every consumer that connects to the _shmname socket. The fd server keeps a dup of the
+// fd, shm_unserve with the returned socket drops it
+static int shm_serve(const char *_shmname, int _fd)
+{
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if(sock < 0)
+  {
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  socklen_t addrlen = shm_socketaddr(_shmname, &addr);
+  if(bind(sock, (struct sockaddr *) &addr, addrlen) != 0 || listen(sock, MAX_NUM_READERS) != 0)
+  {
+    close(sock);
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(shm_fdserver.mutex);
+  if(shm_fdserver.wake[0] < 0 && pipe2(shm_fdserver.wake, O_CLOEXEC | O_NONBLOCK) != 0)
+  {
+    close(sock);
+    return -1;
+  }
+  shm_fdserver.rings[sock] = dup(_fd);
+  if(!shm_fdserver.running)
+  {
+    // a thread stopped by the last shm_unserve may still be on its way out
+    if(shm_fdserver.thread.joinable()) shm_fdserver.thread.join();
+    shm_fdserver.running = true;
+    shm_fdserver.thread = std::thread(shm_fdserver_func);
+  }
+  else
+  {
+    char c = 'r';
+    (void) !write(shm_fdserver.wake[1], &c, 1);
+  }
+
+  return sock;
+}
+
+// shm_unserve: stop handing out the ring behind _sock. The fd server thread stops with the last ring
+static void shm_unserve(int _sock)
+{
+  std::thread thread;
+  {
+    std::lock_guard<std::mutex> lock(shm_fdserver.mutex);
+    auto it = shm_fdserver.rings.find(_sock);
+    if(it == shm_fdserver.rings.end())
+    {
+      return;
+    }
+    close(it->second);
+    close(it->first);
+    shm_fdserver.rings.erase(it);
+    if(shm_fdserver.rings.empty())
+    {
+      shm_fdserver.running = false;
+      thread = std::move(shm_fdserver.thread);
+    }
+    char c = 'u';
+    (void) !write(shm_fdserver.wake[1], &c, 1);
+  }
+
+  if(thread.joinable())
+  {
+    thread.join();
+  }
+}
+
+ShMHandle shm_init(const char *_shmname, int _messageSize, int _messageCount, int _policy, int _pinned)
+{
+  ShMHandle ret = { };
+
+  // slots past SHM_MAX_SLOTS can not be pinned, no point in spares for them
+  int pinned = (_pinned > SHM_MAX_PINNED)? SHM_MAX_PINNED : _pinned;
+  if(pinned > SHM_MAX_SLOTS - _messageCount - 1) pinned = SHM_MAX_SLOTS - _messageCount - 1;
+  if(pinned < 0) pinned = 0;
+
+  unsigned int messageSize = (_messageSize + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+  unsigned long long shmlen = shm_length(messageSize, _messageCount, pinned);
+  unsigned long long maplen = shmlen;
+  void *addr = MAP_FAILED;
+  bool existing = false;
+
+  // memfd handed out over a socket. Named posix shared memory when memfd is not available
+  int fd = shm_memfd(_shmname, shmlen, &maplen, &addr);
+  if(fd >= 0)
+  {
+    ret.server = shm_serve(_shmname, fd);
+    if(ret.server < 0)
+    {
+      munmap(addr, (size_t) maplen);
+      close(fd);
+      return ret;
+    }
+  }
+  else
+  {
+    fd = shm_open(shm_posixname(_shmname).c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0)
+    {
+      fd = shm_open(shm_posixname(_shmname).c_str(), O_RDWR, 0600);
+      existing = true;
+    }
+    if(fd < 0)
+    {
+      return ret;
+    }
+
+    struct stat st = { };
+    if(fstat(fd, &st) != 0 || (unsigned long long) st.st_size < shmlen)
+    {
+      if(ftruncate(fd, (off_t) shmlen) != 0)
+      {
+        close(fd);
+        return ret;
+      }
+    }
+
+    addr = shm_map(fd, maplen, true);
+    if(addr == MAP_FAILED)
+    {
+      close(fd);
+      return ret;
+    }
+  }
+  ret.shm_handle = (unsigned long long) fd;
+  ret.rb = (RingBuffer *) addr;
+  ret.length = maplen;
+  strncpy(ret.name, _shmname, SHM_NAME_SIZE - 1);
+
+  ret.rb->size = messageSize;
+  ret.rb->count = _messageCount;
+  ret.rb->wseq = 0;
+  ret.rb->policy = _policy;
+  ret.rb->mode = SHM_MODE_MESSAGES;
+  ret.rb->maplen = maplen;
+  ret.rb->pid = shm_pid();
+  ret.rb->heartbeat = shm_timestamp();
+  memset((void *) &ret.rb->stats, 0, sizeof(ShMStats));
+
+  /* readers. Keep them registered when the producer restarts over an existing mapping */
+  if(!existing)
+  {
+    for(int i = 0; i < MAX_NUM_READERS; i++)
+    {
+      ret.rb->readers[i].rseq = -1;
+      ret.rb->readers[i].lease = 0;
+    }
+  }
+
+  /* data offsets */
+  unsigned long p = (unsigned long) shm_headersize(_messageCount);
+  for(unsigned int i = 0; i < ret.rb->count; i++)
+  {
+    ret.rb->buffer[i].offset = p;
+    ret.rb->buffer[i].size = 0;
+    ret.rb->buffer[i].seq = -1;
+    ret.rb->buffer[i].wbegin = -1;
+    p += ret.rb->size;
+  }
+  ret.rb->spare = p;
+  ret.rb->pinned = pinned;
+  for(int i = 0; i < pinned; i++)
+  {
+    p += ret.rb->size;
+    ret.rb->parked[i] = p;
+  }
+  memset((void *) ret.rb->slots, 0, sizeof(ret.rb->slots));
+
+  return ret;
+}
+
+ShMHandle shm_connect(const char *_shmname, bool _readOnly)
+{
+  ShMHandle ret = { };
+
+  // ring fd from the producer socket, named posix shared memory otherwise
+  int fd = shm_recvfd(_shmname);
+  if(fd < 0)
+  {
+    fd = shm_open(shm_posixname(_shmname).c_str(), _readOnly? O_RDONLY : O_RDWR, 0600);
+  }
+  if(fd < 0)
+  {
+    return ret;
+  }
+
+  // header through read(), hugetlbfs mappings must be huge page sized
+  RingBuffer header;
+  if(pread(fd, &header, sizeof(RingBuffer), 0) != (ssize_t) sizeof(RingBuffer) || header.count == 0)
+  {
+    close(fd);
+    return ret;
+  }
+
+  unsigned long long maplen = header.maplen;
+  if(maplen < shm_length(header.size, header.count, header.pinned))
+  {
+    close(fd);
+    return ret;
+  }
+  void *addr = shm_map(fd, maplen, true, _readOnly);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    return ret;
+  }
+  ret.shm_handle = (unsigned long long) fd;
+  ret.rb = (RingBuffer *) addr;
+  ret.length = maplen;
+  strncpy(ret.name, _shmname, SHM_NAME_SIZE - 1);
+
+  return ret;
+}
+
+bool shm_write_increment(ShMHandle *_handle)
+{
+  __sync_fetch_and_add(&_handle->rb->wseq, 1);
+  return shm_wake(_handle);
+}
+
+// shm_write_advance: stream rings, _bytes more published
+bool shm_write_advance(ShMHandle *_handle, long long _bytes)
+{
+  __sync_fetch_and_add(&_handle->rb->wseq, _bytes);
+  return shm_wake(_handle);
+}
+
+// shm_stream_valid: stream rings. What a reader copied from _pos on was not written over meanwhile
+bool shm_stream_valid(RingBuffer *_ringBuffer, long long _pos)
+{
+  if(!_ringBuffer)
+  {
+    return false;
+  }
+
+  __sync_synchronize();
+  return (_ringBuffer->buffer[0].wbegin - _pos) <= (long long) _ringBuffer->size;
+}
+
+// shm_wake: wake blocked readers. Shared futex, the word lives in the mapping
+bool shm_wake(ShMHandle *_handle)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return false;
+  }
+
+  __sync_fetch_and_add(&_handle->rb->futex, 1);
+  if(_handle->rb->waiters > 0)
+  {
+    syscall(SYS_futex, &_handle->rb->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+  return true;
+}
+
+// shm_wake_writer: a reader arrived, moved on or left, wake the producer if it waits on the readers
+static void shm_wake_writer(RingBuffer *_ringBuffer)
+{
+  __sync_fetch_and_add(&_ringBuffer->rfutex, 1);
+  if(_ringBuffer->rwaiters > 0)
+  {
+    syscall(SYS_futex, &_ringBuffer->rfutex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+bool shm_close(ShMHandle *_handle)
+{
+  if(!_handle)
+  {
+    return false;
+  }
+
+  if(_handle->rb)
+  {
+    munmap(_handle->rb, (size_t) _handle->length);
+  }
+  _handle->rb = nullptr;
+
+  // consumers connecting from now on get no fd
+  if(_handle->server >= 0)
+  {
+    shm_unserve((int) _handle->server);
+  }
+  _handle->server = -1;
+
+  if(_handle->shm_handle)
+  {
+    close((int) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
+  return true;
+}
+
+unsigned char * shm_getmessagedata(RingBuffer *_ringBuffer, Message *_message)
+{
+  if(!_ringBuffer)
+  {
+    return nullptr;
+  }
+
+  unsigned long long addr = (unsigned long long) _ringBuffer;
+  return (unsigned char *) (addr + _message->offset);
+}
+
+bool shm_slot_valid(RingBuffer *_ringBuffer, long long _seq)
+{
+  if(!_ringBuffer || _seq < 0)
+  {
+    return false;
+  }
+
+  // slot still holds _seq and the producer has not started to write over it (seqlock: begin == end == _seq).
+  // A full lossless ring (wseq - _seq == count) still holds its oldest message
+  __sync_synchronize();
+  Message *msg = &_ringBuffer->buffer[_seq % _ringBuffer->count];
+  return (msg->seq == _seq) && (msg->wbegin == _seq) && ((_ringBuffer->wseq - _seq) <= _ringBuffer->count);
+}
+
+// shm_message_begin: producer is about to write _seq into the slot. Readers still on the previous
+// sequence see begin != end and drop what they copied
+void shm_message_begin(Message *_message, long long _seq)
+{
+  _message->wbegin = _seq;
+  __sync_synchronize();
+}
+
+// shm_slot_claim: producer is about to write the slot at *_offset (message slot after shm_message_begin,
+// or the spare one). A pinned slot is swapped for a parked one nobody pins. False when every candidate
+// is pinned and a pinned frame gets written over
+bool shm_slot_claim(RingBuffer *_ringBuffer, unsigned long *_offset)
+{
+  // message begin visible before pins are looked at, shm_pin does the reverse
+  __sync_synchronize();
+  int slot = shm_slotindex(_ringBuffer, *_offset);
+  if(slot < 0)
+  {
+    return true;
+  }
+
+  if(_ringBuffer->slots[slot].pins > 0)
+  {
+    for(unsigned int i = 0; i < _ringBuffer->pinned; i++)
+    {
+      int parked = shm_slotindex(_ringBuffer, _ringBuffer->parked[i]);
+      if(parked >= 0 && _ringBuffer->slots[parked].pins == 0)
+      {
+        unsigned long offset = _ringBuffer->parked[i];
+        _ringBuffer->parked[i] = *_offset;
+        *_offset = offset;
+        slot = parked;
+        break;
+      }
+    }
+  }
+
+  bool ret = (_ringBuffer->slots[slot].pins == 0);
+  if(!ret)
+  {
+    shm_stat_add(&_ringBuffer->stats.unpinned, 1);
+  }
+  _ringBuffer->slots[slot].stamp = _ringBuffer->slots[slot].stamp + 1;
+  __sync_synchronize();
+  return ret;
+}
+
+// shm_pin: keep the slot holding _seq from being written until shm_unpin. Returns the slot write stamp
+// (see shm_pin_valid), -1 when the producer already moved on
+long long shm_pin(RingBuffer *_ringBuffer, long long _seq, int *_slot)
+{
+  if(!_ringBuffer || _seq < 0)
+  {
+    return -1;
+  }
+
+  Message *msg = &_ringBuffer->buffer[_seq % _ringBuffer->count];
+  unsigned long offset = msg->offset;
+  int slot = shm_slotindex(_ringBuffer, offset);
+  if(slot < 0)
+  {
+    return -1;
+  }
+
+  __sync_fetch_and_add(&_ringBuffer->slots[slot].pins, 1);
+  long long stamp = _ringBuffer->slots[slot].stamp;
+  if(msg->offset != offset || !shm_slot_valid(_ringBuffer, _seq))
+  {
+    __sync_fetch_and_sub(&_ringBuffer->slots[slot].pins, 1);
+    return -1;
+  }
+
+  *_slot = slot;
+  return stamp;
+}
+
+void shm_unpin(RingBuffer *_ringBuffer, int _slot)
+{
+  if(_ringBuffer && _slot >= 0 && _slot < SHM_MAX_SLOTS)
+  {
+    __sync_fetch_and_sub(&_ringBuffer->slots[_slot].pins, 1);
+  }
+}
+
+// shm_pin_valid: pinned slot not written over since it was pinned (pin limit reached)
+bool shm_pin_valid(RingBuffer *_ringBuffer, int _slot, long long _stamp)
+{
+  if(!_ringBuffer || _slot < 0 || _slot >= SHM_MAX_SLOTS)
+  {
+    return false;
+  }
+
+  __sync_synchronize();
+  return _ringBuffer->slots[_slot].stamp == _stamp;
+}
+
+long long shm_timestamp()
+{
+  // CLOCK_MONOTONIC is system wide, so timestamps can be compared between processes
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long shm_pid()
+{
+  return (long long) getpid();
+}
+
+// shm_process_alive: signal 0 only checks the process exists. EPERM: exists, owned by someone else
+bool shm_process_alive(long long _pid)
+{
+  if(_pid <= 0)
+  {
+    return false;
+  }
+  return (kill((pid_t) _pid, 0) == 0) || (errno == EPERM);
+}
+
+int shm_reader_register(ShMHandle *_handle)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return -1;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  long long now = shm_timestamp();
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    Reader *reader = &rb->readers[i];
+    long long rseq = reader->rseq;
+
+    // free slot, or a reader that stopped renewing its lease (crashed consumer)
+    bool expired = (rseq >= 0) && (now - reader->lease > READER_LEASE_TIMEOUT);
+    if(rseq >= 0 && !expired)
+    {
+      continue;
+    }
+
+    reader->lease = now;
+    if(__sync_val_compare_and_swap(&reader->rseq, rseq, rb->wseq) == rseq)
+    {
+      _handle->reader = i;
+      memset((void *) &rb->stats.readers[i], 0, sizeof(ShMReaderStats));
+      // producers waiting for a consumer (waitConsumer)
+      shm_wake_writer(rb);
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+bool shm_reader_unregister(ShMHandle *_handle)
+{
+  if(!_handle || !_handle->rb || _handle->reader < 0)
+  {
+    return false;
+  }
+
+  __sync_lock_test_and_set(&_handle->rb->readers[_handle->reader].rseq, -1);
+  _handle->reader = -1;
+  shm_wake_writer(_handle->rb);
+
+  return true;
+}
+
+bool shm_read_set(ShMHandle *_handle, long long _seq)
 {
-  ShMHandle ret = { };
-  
-  int shmlen = sizeof(RingBuffer) + (messageCount * sizeof(Message)) + (messageSize * messageCount);
-  ret.shm_handle = (unsigned long long) shm_open(shmname, O_RDWR | O_CREAT, 0600);
-  if(!ret.shm_handle)
+  if(!_handle || !_handle->rb || _handle->reader < 0)
   {
-    return ret;
+    return false;
+  }
+
+  Reader *reader = &_handle->rb->readers[_handle->reader];
+  reader->lease = shm_timestamp();
+  __sync_lock_test_and_set(&reader->rseq, _seq);
+  shm_wake_writer(_handle->rb);
+
+  return true;
+}
+
+long long shm_slowest_reader(ShMHandle *_handle, long long _leaseTimeout)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return -1;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  long long now = shm_timestamp();
+  long long slowest = -1;
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    Reader *reader = &rb->readers[i];
+    long long rseq = reader->rseq;
+    if(rseq < 0)
+    {
+      continue;
+    }
+
+    // expire readers that stopped renewing the lease, they must not block the producer forever
+    if(now - reader->lease > _leaseTimeout)
+    {
+      __sync_val_compare_and_swap(&reader->rseq, rseq, -1);
+      continue;
+    }
+
+    if(slowest < 0 || rseq < slowest)
+    {
+      slowest = rseq;
+    }
+  }
+
+  return slowest;
+}
+
+// shm_wait: block until the producer writes past _seq or _msTimeout expires. True when there is data to read
+bool shm_wait(ShMHandle *_handle, long long _seq, int _msTimeout)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return false;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  int value = rb->futex;
+  if(rb->wseq > _seq)
+  {
+    return true;
+  }
+
+  // a write after we sampled value changes the futex word and FUTEX_WAIT returns straight away
+  __sync_fetch_and_add(&rb->waiters, 1);
+  if(rb->wseq <= _seq)
+  {
+    struct timespec ts;
+    ts.tv_sec = (_msTimeout > 0)? _msTimeout / 1000 : 0;
+    ts.tv_nsec = (_msTimeout > 0)? (_msTimeout % 1000) * 1000000L : 0;
+    syscall(SYS_futex, &rb->futex, FUTEX_WAIT, value, &ts, NULL, 0);
+  }
+  __sync_fetch_and_sub(&rb->waiters, 1);
+
+  return rb->wseq > _seq;
+}
+
+// shm_wait_readers: producer side, lossless rings. Block until the slowest reader is no longer at _slowest
+// (moved on, left or expired) or _msTimeout expires. True when it moved
+bool shm_wait_readers(ShMHandle *_handle, long long _slowest, int _msTimeout)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return false;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  int value = rb->rfutex;
+  if(shm_slowest_reader(_handle) != _slowest)
+  {
+    return true;
+  }
+
+  // a reader moving on after we sampled value changes the futex word and FUTEX_WAIT returns straight away
+  __sync_fetch_and_add(&rb->rwaiters, 1);
+  if(shm_slowest_reader(_handle) == _slowest)
+  {
+    struct timespec ts;
+    ts.tv_sec = (_msTimeout > 0)? _msTimeout / 1000 : 0;
+    ts.tv_nsec = (_msTimeout > 0)? (_msTimeout % 1000) * 1000000L : 0;
+    syscall(SYS_futex, &rb->rfutex, FUTEX_WAIT, value, &ts, NULL, 0);
   }
+  __sync_fetch_and_sub(&rb->rwaiters, 1);
 
-  ftruncate(ret.shm_handle, shmlen + 1);
-  ret.rb = (RingBuffer *) mmap( 0, shmlen, PROT_READ | PROT_WRITE, MAP_SHARED, ret.shm_handle, 0);
-  if(!ret.rb)
+  return shm_slowest_reader(_handle) != _slowest;
+}
+
+// shm_remove: unlink the name. Processes that have it mapped keep their mapping
+bool shm_remove(const char *_shmname)
+{
+  return shm_unlink(shm_posixname(_shmname).c_str()) == 0;
+}
+
+ShMControlHandle shm_control_init(const char *_shmname)
+{
+  ShMControlHandle ret = { };
+
+  int fd = shm_open(shm_posixname(_shmname).c_str(), O_RDWR | O_CREAT, 0600);
+  if(fd < 0)
   {
-    close(ret.shm_handle);
-	  ret.shm_handle = 0;
     return ret;
   }
-  close(ret.shm_handle);
 
-  ret.rb->_size = messageSize;
-  ret.rb->_count = messageCount;
-  ret.rb->_wseq = 0;
-  for(int i = 0; i < MAX_NUM_READERS; ret.rb->_rseq[i++] = -1);
+  struct stat st = { };
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShMControl))
+  {
+    if(ftruncate(fd, sizeof(ShMControl)) != 0)
+    {
+      close(fd);
+      return ret;
+    }
+  }
+
+  void *addr = mmap(0, sizeof(ShMControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    return ret;
+  }
+  ret.shm_handle = (unsigned long long) fd;
+  ret.ctl = (ShMControl *) addr;
 
-  /* data offsets */
-  unsigned long p = sizeof(RingBuffer) + (messageCount * sizeof(Message));
-  for(unsigned int i = 0; i < ret.rb->_count; i++)
+  // new segment. An existing one (consumers still attached) keeps its epoch so they follow the new ring
+  if(ret.ctl->magic != SHM_CONTROL_MAGIC)
   {
-	  ret.rb->_buffer[i]._offset = p;
-	  p += ret.rb->_size;
+    ret.ctl->version = 1;
+    ret.ctl->epoch = -1;
+    ret.ctl->magic = SHM_CONTROL_MAGIC;
   }
 
   return ret;
 }
 
-ShMHandle shm_connect(const char *shmname, int *rIndex)
+ShMControlHandle shm_control_connect(const char *_shmname)
 {
-  ShMHandle ret = { };
+  ShMControlHandle ret = { };
+
+  int fd = shm_open(shm_posixname(_shmname).c_str(), O_RDWR, 0600);
+  if(fd < 0)
+  {
+    return ret;
+  }
 
-  ret.shm_handle = (unsigned long long) shm_open(shmname, O_RDWR, 0600);
-  if(ret.shm_handle == -1)
+  void *addr = mmap(0, sizeof(ShMControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
     return ret;
+  }
+  ret.shm_handle = (unsigned long long) fd;
+  ret.ctl = (ShMControl *) addr;
+
+  if(ret.ctl->magic != SHM_CONTROL_MAGIC)
+  {
+    shm_control_close(&ret);
+  }
+
+  return ret;
+}
 
-  ret.rb = (RingBuffer *) mmap( 0, sizeof(RingBuffer), PROT_READ | PROT_WRITE, MAP_SHARED, ret.shm_handle, 0 );
-  if(!ret.rb)
+bool shm_control_close(ShMControlHandle *_handle)
+{
+  if(!_handle)
   {
-    close(ret.shm_handle);
-	  ret.shm_handle = -1;
-	  return ret;
+    return false;
   }
 
-  int shmlen = sizeof(RingBuffer) + (ret.rb->_count * sizeof(Message)) + (ret.rb->_size * ret.rb->_count);
-  munmap(ret.rb, sizeof(RingBuffer));
-  ret.rb = (RingBuffer *) mmap( 0, shmlen, PROT_READ | PROT_WRITE, MAP_SHARED, ret.shm_handle, 0 );
-  if(!ret.rb)
+  if(_handle->ctl)
   {
-	  close(ret.shm_handle);
-	  ret.shm_handle = -1;
-	  return ret;
+    munmap(_handle->ctl, sizeof(ShMControl));
   }
+  _handle->ctl = nullptr;
 
-  // reader index
-  if(rIndex)
+  if(_handle->shm_handle)
   {
-	  *rIndex = -1;
-    for(int i = 0; i < MAX_NUM_READERS; i++)
+    close((int) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
+  return true;
+}
+
+// shm_rendition_request: ask the producer for a scaled copy of its video ring, or renew the lease on it.
+// False when every entry is taken
+bool shm_rendition_request(ShMControlHandle *_handle, int _width, int _height, int _format)
+{
+  if(!_handle || !_handle->ctl)
+  {
+    return false;
+  }
+
+  ShMControl *ctl = _handle->ctl;
+  long long key = shm_renditionkey(_width, _height, _format);
+  long long now = shm_timestamp();
+  for(int i = 0; i < SHM_MAX_RENDITIONS; i++)
+  {
+    ShMRendition *r = &ctl->renditions[i];
+    if(r->key == key)
+    {
+      r->lease = now;
+      return true;
+    }
+  }
+
+  // free or expired entry
+  for(int i = 0; i < SHM_MAX_RENDITIONS; i++)
+  {
+    ShMRendition *r = &ctl->renditions[i];
+    long long current = r->key;
+    if((current == 0 || now - r->lease > SHM_RENDITION_LEASE) && __sync_bool_compare_and_swap(&r->key, current, key))
+    {
+      r->lease = now;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// shm_registry_open: well known registry segment, created by the first process that needs it
+ShMRegistryHandle shm_registry_open()
+{
+  ShMRegistryHandle ret = { };
+
+  int fd = shm_open(shm_posixname(SHM_REGISTRY_NAME).c_str(), O_RDWR | O_CREAT, 0600);
+  if(fd < 0)
+  {
+    return ret;
+  }
+
+  // zero filled on creation: an empty registry
+  struct stat st = { };
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShMRegistry))
+  {
+    if(ftruncate(fd, sizeof(ShMRegistry)) != 0)
     {
-      if(ret.rb->_rseq[i] < 0)
-	    {
-	      *rIndex = i;
-	      break;
-	    }
-    }
-	  if(*rIndex < 0)
-	  {
-	    for(int i = 0; i < MAX_NUM_READERS; i++)
-	    {
-        if(ret.rb->_rseq[i] + MAX_READER_DELAY < ret.rb->_wseq)
-		    {
-		      *rIndex = i;
-		      break;
-		    }
-	    }
-	  }
+      close(fd);
+      return ret;
+    }
+  }
+
+  void *addr = mmap(0, sizeof(ShMRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    return ret;
+  }
+  ret.shm_handle = (unsigned long long) fd;
+  ret.reg = (ShMRegistry *) addr;
+
+  if(ret.reg->magic != SHM_REGISTRY_MAGIC)
+  {
+    ret.reg->version = 1;
+    __sync_val_compare_and_swap(&ret.reg->magic, 0, SHM_REGISTRY_MAGIC);
   }
 
   return ret;
 }
 
-bool shm_write_increment(ShMHandle *h)
+bool shm_registry_close(ShMRegistryHandle *_handle)
+{
+  if(!_handle)
+  {
+    return false;
+  }
+
+  if(_handle->reg)
+  {
+    munmap(_handle->reg, sizeof(ShMRegistry));
+  }
+  _handle->reg = nullptr;
+
+  if(_handle->shm_handle)
+  {
+    close((int) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
+  return true;
+}
+
+// registry changed: bump the generation and wake subscribers
+static void shm_registry_changed(ShMRegistry *_reg)
 {
-  __sync_fetch_and_add(&h->rb->_wseq, 1);
+  __sync_fetch_and_add(&_reg->generation, 1);
+  __sync_fetch_and_add(&_reg->futex, 1);
+  if(_reg->waiters > 0)
+  {
+    syscall(SYS_futex, &_reg->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+// consistent copy of a live entry (seqlock on version)
+static bool shm_source_read(const ShMSource *_entry, ShMSource *_source)
+{
+  for(int retry = 0; retry < 8; retry++)
+  {
+    long long pid = _entry->pid;
+    long long version = _entry->version;
+    if(pid == 0 || (version & 1)) continue;
+    __sync_synchronize();
+    memcpy((void *) _source, (const void *) _entry, sizeof(ShMSource));
+    __sync_synchronize();
+    if(_entry->version == version && _entry->pid == pid)
+    {
+      return shm_process_alive(pid);
+    }
+  }
+  return false;
+}
+
+// shm_registry_publish: add or update our entry for _source->uid. Entries of dead processes are reused
+bool shm_registry_publish(ShMRegistryHandle *_handle, const ShMSource *_source)
+{
+  if(!_handle || !_handle->reg || !_source)
+  {
+    return false;
+  }
+
+  ShMRegistry *reg = _handle->reg;
+  long long pid = shm_pid();
+  ShMSource *entry = nullptr;
+  for(int i = 0; i < SHM_REGISTRY_SIZE && !entry; i++)
+  {
+    ShMSource *s = &reg->sources[i];
+    if(s->pid == pid && strncmp(s->uid, _source->uid, SHM_NAME_SIZE) == 0) entry = s;
+  }
+  for(int i = 0; i < SHM_REGISTRY_SIZE && !entry; i++)
+  {
+    ShMSource *s = &reg->sources[i];
+    long long owner = s->pid;
+    if((owner == 0 || !shm_process_alive(owner)) && __sync_bool_compare_and_swap(&s->pid, owner, pid)) entry = s;
+  }
+  if(!entry)
+  {
+    return false;
+  }
+
+  // everything but pid and version
+  size_t offset = offsetof(ShMSource, started);
+  __sync_fetch_and_add(&entry->version, 1);
+  __sync_synchronize();
+  memcpy((char *) entry + offset, (const char *) _source + offset, sizeof(ShMSource) - offset);
+  __sync_synchronize();
+  __sync_fetch_and_add(&entry->version, 1);
+
+  shm_registry_changed(reg);
   return true;
 }
 
-bool shm_read_set(ShMHandle *h, int rIndex, long long value)
+bool shm_registry_remove(ShMRegistryHandle *_handle, const char *_uid)
+{
+  if(!_handle || !_handle->reg || !_uid)
+  {
+    return false;
+  }
+
+  ShMRegistry *reg = _handle->reg;
+  long long pid = shm_pid();
+  for(int i = 0; i < SHM_REGISTRY_SIZE; i++)
+  {
+    ShMSource *s = &reg->sources[i];
+    if(s->pid == pid && strncmp(s->uid, _uid, SHM_NAME_SIZE) == 0)
+    {
+      __sync_fetch_and_add(&s->version, 1);
+      s->uid[0] = 0;
+      __sync_fetch_and_add(&s->version, 1);
+      __sync_lock_test_and_set(&s->pid, 0);
+      shm_registry_changed(reg);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// shm_registry_find: live entry for _uid. The latest published one if a restarting producer overlaps
+bool shm_registry_find(ShMRegistryHandle *_handle, const char *_uid, ShMSource *_source)
+{
+  if(!_handle || !_handle->reg || !_uid)
+  {
+    return false;
+  }
+
+  bool found = false;
+  ShMSource source;
+  for(int i = 0; i < SHM_REGISTRY_SIZE; i++)
+  {
+    if(shm_source_read(&_handle->reg->sources[i], &source) && strncmp(source.uid, _uid, SHM_NAME_SIZE) == 0)
+    {
+      if(!found || source.started > _source->started)
+      {
+        if(_source) *_source = source;
+        found = true;
+      }
+      if(!_source) break;
+    }
+  }
+
+  return found;
+}
+
+int shm_registry_list(ShMRegistryHandle *_handle, ShMSource *_sources, int _maxSources)
+{
+  if(!_handle || !_handle->reg || !_sources)
+  {
+    return 0;
+  }
+
+  int n = 0;
+  for(int i = 0; i < SHM_REGISTRY_SIZE && n < _maxSources; i++)
+  {
+    if(shm_source_read(&_handle->reg->sources[i], &_sources[n])) n++;
+  }
+
+  return n;
+}
+
+// shm_registry_wait: block until the registry changes past _generation or _msTimeout expires
+bool shm_registry_wait(ShMRegistryHandle *_handle, long long _generation, int _msTimeout)
+{
+  if(!_handle || !_handle->reg)
+  {
+    return false;
+  }
+
+  ShMRegistry *reg = _handle->reg;
+  int value = reg->futex;
+  if(reg->generation != _generation)
+  {
+    return true;
+  }
+
+  __sync_fetch_and_add(&reg->waiters, 1);
+  if(reg->generation == _generation)
+  {
+    struct timespec ts;
+    ts.tv_sec = (_msTimeout > 0)? _msTimeout / 1000 : 0;
+    ts.tv_nsec = (_msTimeout > 0)? (_msTimeout % 1000) * 1000000L : 0;
+    syscall(SYS_futex, &reg->futex, FUTEX_WAIT, value, &ts, NULL, 0);
+  }
+  __sync_fetch_and_sub(&reg->waiters, 1);
+
+  return reg->generation != _generation;
+}
+
+// shm_clock_open: well known house clock segment, created by the first process that needs it
+ShMClockHandle shm_clock_open()
+{
+  ShMClockHandle ret = { };
+
+  int fd = shm_open(shm_posixname(SHM_CLOCK_NAME).c_str(), O_RDWR | O_CREAT, 0600);
+  if(fd < 0)
+  {
+    return ret;
+  }
+
+  // zero filled on creation: no master
+  struct stat st = { };
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShMClock))
+  {
+    if(ftruncate(fd, sizeof(ShMClock)) != 0)
+    {
+      close(fd);
+      return ret;
+    }
+  }
+
+  void *addr = mmap(0, sizeof(ShMClock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    return ret;
+  }
+  ret.shm_handle = (unsigned long long) fd;
+  ret.clock = (ShMClock *) addr;
+
+  if(ret.clock->magic != SHM_CLOCK_MAGIC)
+  {
+    __sync_val_compare_and_swap(&ret.clock->magic, 0, SHM_CLOCK_MAGIC);
+  }
+
+  return ret;
+}
+
+bool shm_clock_close(ShMClockHandle *_handle)
 {
-  __sync_lock_test_and_set(&h->rb->_rseq[rIndex], value);
+  if(!_handle)
+  {
+    return false;
+  }
+
+  if(_handle->clock)
+  {
+    munmap(_handle->clock, sizeof(ShMClock));
+  }
+  _handle->clock = nullptr;
+
+  if(_handle->shm_handle)
+  {
+    close((int) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
   return true;
 }
 
-bool shm_close(ShMHandle *h)
+// shm_clock_claim: become (or stay) the house clock master. Taken over when there is none, its process is gone
+// or it stopped ticking. A new master at the same rate keeps the anchor, locked engines see no phase jump.
+// False while another master ticks it
+bool shm_clock_claim(ShMClockHandle *_handle, int _rateNum, int _rateDen, long long _anchor)
 {
-  if(!h) return false;
+  if(!_handle || !_handle->clock || _rateNum <= 0 || _rateDen <= 0)
+  {
+    return false;
+  }
+
+  ShMClock *clock = _handle->clock;
+  long long pid = shm_pid();
+  long long master = clock->pid;
+  if(master != pid)
+  {
+    bool stale = (shm_timestamp() - clock->deadline) > SHM_CLOCK_STALE;
+    if(master != 0 && !stale && shm_process_alive(master))
+    {
+      return false;
+    }
+    if(__sync_val_compare_and_swap(&clock->pid, master, pid) != master)
+    {
+      return false;
+    }
+  }
 
-  if(h->rb)
+  if(clock->rateNum == _rateNum && clock->rateDen == _rateDen && clock->anchor != 0)
   {
-	  int shmlen = sizeof(RingBuffer) + (h->rb->_count * sizeof(Message)) + (h->rb->_size * h->rb->_count);
-    munmap(h->rb, shmlen);
+    return true;
   }
 
-  if(h->shm_handle)
-    close(h->shm_handle);
-  h->shm_handle = -1;
-  
+  // new rate: readers retry while the version is odd
+  __sync_fetch_and_add(&clock->version, 1);
+  __sync_synchronize();
+  clock->rateNum = _rateNum;
+  clock->rateDen = _rateDen;
+  clock->anchor = _anchor;
+  clock->tick = -1;
+  clock->deadline = _anchor;
+  __sync_synchronize();
+  __sync_fetch_and_add(&clock->version, 1);
+
   return true;
 }
 
-char * shm_getmessagedata(RingBuffer *rb, Message *message)
+// shm_clock_release: master steps down, the next pacer to claim the clock keeps its anchor
+bool shm_clock_release(ShMClockHandle *_handle)
+{
+  if(!_handle || !_handle->clock)
+  {
+    return false;
+  }
+
+  long long pid = shm_pid();
+  return __sync_val_compare_and_swap(&_handle->clock->pid, pid, 0) == pid;
+}
+
+// shm_clock_read: house rate and anchor. False when the clock has no master
+bool shm_clock_read(ShMClockHandle *_handle, int *_rateNum, int *_rateDen, long long *_anchor)
 {
-  if(!rb || !rb) return nullptr;
+  if(!_handle || !_handle->clock)
+  {
+    return false;
+  }
+
+  ShMClock *clock = _handle->clock;
+  for(int retry = 0; retry < 100; retry++)
+  {
+    long long version = clock->version;
+    __sync_synchronize();
+    int rateNum = clock->rateNum;
+    int rateDen = clock->rateDen;
+    long long anchor = clock->anchor;
+    long long pid = clock->pid;
+    __sync_synchronize();
+    if((version & 1) || version != clock->version)
+    {
+      continue;
+    }
+    if(pid == 0 || rateNum <= 0 || rateDen <= 0)
+    {
+      return false;
+    }
+    *_rateNum = rateNum;
+    *_rateDen = rateDen;
+    *_anchor = anchor;
+    return true;
+  }
+
+  return false;
+}
+
+// shm_clock_tick: master ticked house frame _tick, due at _deadline
+bool shm_clock_tick(ShMClockHandle *_handle, long long _tick, long long _deadline)
+{
+  if(!_handle || !_handle->clock || _handle->clock->pid != shm_pid())
+  {
+    return false;
+  }
 
-  unsigned long long addr = (unsigned long long) rb;
-  return (char *) (addr + message->_offset);
+  _handle->clock->deadline = _deadline;
+  __sync_synchronize();
+  _handle->clock->tick = _tick;
+  return true;
 }
 
 #endif // __linux__
@@ -1,20 +1,96 @@
 #ifdef _WIN32
 
 #include <windows.h>
+#include <string>
 #include "shmhelper.h"
 
-ShMHandle shm_init(const char *_shmname, int _messageSize, int _messageCount)
+static int shm_flags = SHM_FLAG_HUGEPAGES | SHM_FLAG_POPULATE;
+
+void shm_setflags(int _flags)
+{
+  shm_flags = _flags;
+}
+
+int shm_getflags()
+{
+  return shm_flags;
+}
+
+// reader wake event name
+static std::string shm_eventname(const char *_shmname, int _reader)
+{
+  return std::string(_shmname) + ".reader" + std::to_string(_reader);
+}
+
+// producer wake event name
+static std::string shm_writername(const char *_shmname)
+{
+  return std::string(_shmname) + ".writer";
+}
+
+// wake semaphore name of unregistered readers
+static std::string shm_semaphorename(const char *_shmname)
+{
+  return std::string(_shmname) + ".waiters";
+}
+
+// shm_semaphore_wait: block on a wake semaphore until _ready or _msTimeout expires. Wakers release one
+// count per waiter they see in _waiters, a count left over by a waiter that already timed out only makes
+// the next one check _ready again
+template <typename Ready>
+static bool shm_semaphore_wait(HANDLE _semaphore, volatile int *_waiters, int _msTimeout, Ready _ready)
+{
+  ULONGLONG deadline = GetTickCount64() + ((_msTimeout > 0)? _msTimeout : 0);
+  while(!_ready())
+  {
+    ULONGLONG now = GetTickCount64();
+    if(now >= deadline)
+    {
+      return false;
+    }
+
+    InterlockedIncrement((volatile LONG *) _waiters);
+    if(!_ready())
+    {
+      WaitForSingleObject(_semaphore, (DWORD) (deadline - now));
+    }
+    InterlockedDecrement((volatile LONG *) _waiters);
+  }
+
+  return true;
+}
+
+// shm_semaphore_wake: one count per blocked waiter
+static void shm_semaphore_wake(HANDLE _semaphore, volatile int *_waiters)
+{
+  MemoryBarrier();
+  LONG waiters = *_waiters;
+  if(_semaphore && waiters > 0)
+  {
+    ReleaseSemaphore(_semaphore, waiters, NULL);
+  }
+}
+
+ShMHandle shm_init(const char *_shmname, int _messageSize, int _messageCount, int _policy, int _pinned)
 {
   ShMHandle ret = { };
+
+  // slots past SHM_MAX_SLOTS can not be pinned, no point in spares for them
+  int pinned = (_pinned > SHM_MAX_PINNED)? SHM_MAX_PINNED : _pinned;
+  if(pinned > SHM_MAX_SLOTS - _messageCount - 1) pinned = SHM_MAX_SLOTS - _messageCount - 1;
+  if(pinned < 0) pinned = 0;
   
-  int shmlen = sizeof(RingBuffer) + (_messageCount * sizeof(Message)) + (_messageSize * _messageCount);
-  ret.shm_handle = (unsigned long long) CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, shmlen, _shmname);
+  unsigned int messageSize = (_messageSize + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+  unsigned long long shmlen = shm_length(messageSize, _messageCount, pinned);
+  ret.shm_handle = (unsigned long long) CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD) (shmlen >> 32), (DWORD) (shmlen & 0xffffffff), _shmname);
   if(!ret.shm_handle)
   {
     return ret;
   }
+  bool existing = (GetLastError() == ERROR_ALREADY_EXISTS);
+  strncpy_s(ret.name, _shmname, _TRUNCATE);
 
-  ret.rb = (RingBuffer *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, shmlen);
+  ret.rb = (RingBuffer *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T) shmlen);
   if(!ret.rb)
   {
     CloseHandle((HANDLE) ret.shm_handle);
@@ -22,32 +98,74 @@ ShMHandle shm_init(const char *_shmname, int _messageSize, int _messageCount)
     return ret;
   }
 
-  ret.rb->size = _messageSize;
+  ret.rb->size = messageSize;
   ret.rb->count = _messageCount;
   ret.rb->wseq = 0;
+  ret.rb->policy = _policy;
+  ret.rb->mode = SHM_MODE_MESSAGES;
+  ret.rb->maplen = shmlen;
+  ret.rb->pid = shm_pid();
+  ret.rb->heartbeat = shm_timestamp();
+  memset((void *) &ret.rb->stats, 0, sizeof(ShMStats));
+  ret.length = shmlen;
+  if(shm_flags & SHM_FLAG_LOCK)
+  {
+    // best effort, bounded by the process working set
+    VirtualLock(ret.rb, (SIZE_T) shmlen);
+  }
+
+  /* readers. Keep them registered when the producer restarts over an existing mapping */
+  if(!existing)
+  {
+    for(int i = 0; i < MAX_NUM_READERS; i++)
+    {
+      ret.rb->readers[i].rseq = -1;
+      ret.rb->readers[i].lease = 0;
+    }
+  }
 
   /* data offsets */
-  unsigned long p = sizeof(RingBuffer) + (_messageCount * sizeof(Message));
+  unsigned long p = (unsigned long) shm_headersize(_messageCount);
   for(unsigned int i = 0; i < ret.rb->count; i++)
   {
 	  ret.rb->buffer[i].offset = p;
+    ret.rb->buffer[i].size = 0;
+    ret.rb->buffer[i].seq = -1;
+    ret.rb->buffer[i].wbegin = -1;
 	  p += ret.rb->size;
   }
+  ret.rb->spare = p;
+  ret.rb->pinned = pinned;
+  for(int i = 0; i < pinned; i++)
+  {
+    p += ret.rb->size;
+    ret.rb->parked[i] = p;
+  }
+  memset((void *) ret.rb->slots, 0, sizeof(ret.rb->slots));
+
+  // auto reset, readers signal it when they move on and the producer waits on them (lossless)
+  ret.rb->rwaiters = 0;
+  ret.writer = (unsigned long long) CreateEventA(NULL, FALSE, FALSE, shm_writername(_shmname).c_str());
+
+  // readers waiting without a registered reader slot (and its event)
+  ret.semaphore = (unsigned long long) CreateSemaphoreA(NULL, 0, MAXLONG, shm_semaphorename(_shmname).c_str());
 
   return ret;
 }
 
-ShMHandle shm_connect(const char *_shmname)
+ShMHandle shm_connect(const char *_shmname, bool _readOnly)
 {
   ShMHandle ret = { };
 
-  ret.shm_handle = (unsigned long long) OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, _shmname);
+  DWORD access = _readOnly? FILE_MAP_READ : FILE_MAP_ALL_ACCESS;
+  ret.shm_handle = (unsigned long long) OpenFileMappingA(access, FALSE, _shmname);
   if(ret.shm_handle == 0)
   {
     return ret;
   }
+  strncpy_s(ret.name, _shmname, _TRUNCATE);
 
-  ret.rb = (RingBuffer *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(RingBuffer));
+  ret.rb = (RingBuffer *) MapViewOfFile((HANDLE) ret.shm_handle, access, 0, 0, sizeof(RingBuffer));
   if(!ret.rb)
   {
     CloseHandle((HANDLE) ret.shm_handle);
@@ -55,22 +173,105 @@ ShMHandle shm_connect(const char *_shmname)
 	  return ret;
   }
 
-  int shmlen = sizeof(RingBuffer) + (ret.rb->count * sizeof(Message)) + (ret.rb->size * ret.rb->count);
+  // the whole mapping: spare and parked (pinned) slots messages are swapped into included
+  unsigned long long minlen = shm_length(ret.rb->size, ret.rb->count, ret.rb->pinned);
+  unsigned long long shmlen = ret.rb->maplen;
   UnmapViewOfFile(ret.rb);
-  ret.rb = (RingBuffer *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, shmlen);
+  if(shmlen < minlen)
+  {
+    CloseHandle((HANDLE) ret.shm_handle);
+    ret.shm_handle = 0;
+    ret.rb = nullptr;
+    return ret;
+  }
+  ret.rb = (RingBuffer *) MapViewOfFile((HANDLE) ret.shm_handle, access, 0, 0, (SIZE_T) shmlen);
   if(!ret.rb)
   {
 	  CloseHandle((HANDLE )ret.shm_handle);
 	  ret.shm_handle = 0;
 	  return ret;
   }
+  ret.length = shmlen;
+  if(!_readOnly && (shm_flags & SHM_FLAG_LOCK))
+  {
+    VirtualLock(ret.rb, (SIZE_T) shmlen);
+  }
 
   return ret;
 }
 
 bool shm_write_increment(ShMHandle *_handle)
 {
-  return InterlockedIncrement64(&_handle->rb->wseq);
+  bool ret = InterlockedIncrement64(&_handle->rb->wseq);
+  shm_wake(_handle);
+  return ret;
+}
+
+// shm_write_advance: stream rings, _bytes more published
+bool shm_write_advance(ShMHandle *_handle, long long _bytes)
+{
+  InterlockedAdd64(&_handle->rb->wseq, _bytes);
+  return shm_wake(_handle);
+}
+
+// shm_stream_valid: stream rings. What a reader copied from _pos on was not written over meanwhile
+bool shm_stream_valid(RingBuffer *_ringBuffer, long long _pos)
+{
+  if(!_ringBuffer)
+  {
+    return false;
+  }
+
+  MemoryBarrier();
+  return (_ringBuffer->buffer[0].wbegin - _pos) <= (long long) _ringBuffer->size;
+}
+
+// shm_wake: signal registered readers. Event handles are opened once and cached
+bool shm_wake(ShMHandle *_handle)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return false;
+  }
+
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    if(_handle->rb->readers[i].rseq < 0)
+    {
+      continue;
+    }
+
+    if(!_handle->events[i])
+    {
+      _handle->events[i] = (unsigned long long) OpenEventA(EVENT_MODIFY_STATE, FALSE, shm_eventname(_handle->name, i).c_str());
+    }
+    if(_handle->events[i])
+    {
+      SetEvent((HANDLE) _handle->events[i]);
+    }
+  }
+  shm_semaphore_wake((HANDLE) _handle->semaphore, &_handle->rb->waiters);
+
+  return true;
+}
+
+// shm_wake_writer: a reader arrived, moved on or left, wake the producer if it waits on the readers. The event
+// handle is opened once and cached
+static void shm_wake_writer(ShMHandle *_handle)
+{
+  if(_handle->rb->rwaiters <= 0)
+  {
+    return;
+  }
+
+  if(!_handle->writer)
+  {
+    _handle->writer = (unsigned long long) OpenEventA(EVENT_MODIFY_STATE, FALSE, shm_writername(_handle->name).c_str());
+  }
+  if(_handle->writer)
+  {
+    SetEvent((HANDLE) _handle->writer);
+  }
 }
 
 bool shm_close(ShMHandle *_handle)
@@ -86,6 +287,30 @@ bool shm_close(ShMHandle *_handle)
   }
   _handle->rb = nullptr;
 
+  if(_handle->event)
+  {
+    CloseHandle((HANDLE) _handle->event);
+  }
+  _handle->event = 0;
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    if(_handle->events[i])
+    {
+      CloseHandle((HANDLE) _handle->events[i]);
+    }
+    _handle->events[i] = 0;
+  }
+  if(_handle->writer)
+  {
+    CloseHandle((HANDLE) _handle->writer);
+  }
+  _handle->writer = 0;
+  if(_handle->semaphore)
+  {
+    CloseHandle((HANDLE) _handle->semaphore);
+  }
+  _handle->semaphore = 0;
+
   if(_handle->shm_handle)
   {
     CloseHandle((HANDLE)_handle->shm_handle);
@@ -106,4 +331,800 @@ unsigned char * shm_getmessagedata(RingBuffer *_ringBuffer, Message *_message)
   return (unsigned char *) (addr + _message->offset);
 }
 
+bool shm_slot_valid(RingBuffer *_ringBuffer, long long _seq)
+{
+  if(!_ringBuffer || _seq < 0)
+  {
+    return false;
+  }
+
+  // slot still holds _seq and the producer has not started to write over it (seqlock: begin == end == _seq).
+  // A full lossless ring (wseq - _seq == count) still holds its oldest message
+  MemoryBarrier();
+  Message *msg = &_ringBuffer->buffer[_seq % _ringBuffer->count];
+  return (msg->seq == _seq) && (msg->wbegin == _seq) && ((_ringBuffer->wseq - _seq) <= _ringBuffer->count);
+}
+
+// shm_message_begin: producer is about to write _seq into the slot. Readers still on the previous
+// sequence see begin != end and drop what they copied
+void shm_message_begin(Message *_message, long long _seq)
+{
+  _message->wbegin = _seq;
+  MemoryBarrier();
+}
+
+// shm_slot_claim: producer is about to write the slot at *_offset (message slot after shm_message_begin,
+// or the spare one). A pinned slot is swapped for a parked one nobody pins. False when every candidate
+// is pinned and a pinned frame gets written over
+bool shm_slot_claim(RingBuffer *_ringBuffer, unsigned long *_offset)
+{
+  // message begin visible before pins are looked at, shm_pin does the reverse
+  MemoryBarrier();
+  int slot = shm_slotindex(_ringBuffer, *_offset);
+  if(slot < 0)
+  {
+    return true;
+  }
+
+  if(_ringBuffer->slots[slot].pins > 0)
+  {
+    for(unsigned int i = 0; i < _ringBuffer->pinned; i++)
+    {
+      int parked = shm_slotindex(_ringBuffer, _ringBuffer->parked[i]);
+      if(parked >= 0 && _ringBuffer->slots[parked].pins == 0)
+      {
+        unsigned long offset = _ringBuffer->parked[i];
+        _ringBuffer->parked[i] = *_offset;
+        *_offset = offset;
+        slot = parked;
+        break;
+      }
+    }
+  }
+
+  bool ret = (_ringBuffer->slots[slot].pins == 0);
+  if(!ret)
+  {
+    shm_stat_add(&_ringBuffer->stats.unpinned, 1);
+  }
+  _ringBuffer->slots[slot].stamp = _ringBuffer->slots[slot].stamp + 1;
+  MemoryBarrier();
+  return ret;
+}
+
+// shm_pin: keep the slot holding _seq from being written until shm_unpin. Returns the slot write stamp
+// (see shm_pin_valid), -1 when the producer already moved on
+long long shm_pin(RingBuffer *_ringBuffer, long long _seq, int *_slot)
+{
+  if(!_ringBuffer || _seq < 0)
+  {
+    return -1;
+  }
+
+  Message *msg = &_ringBuffer->buffer[_seq % _ringBuffer->count];
+  unsigned long offset = msg->offset;
+  int slot = shm_slotindex(_ringBuffer, offset);
+  if(slot < 0)
+  {
+    return -1;
+  }
+
+  InterlockedIncrement64(&_ringBuffer->slots[slot].pins);
+  long long stamp = _ringBuffer->slots[slot].stamp;
+  if(msg->offset != offset || !shm_slot_valid(_ringBuffer, _seq))
+  {
+    InterlockedDecrement64(&_ringBuffer->slots[slot].pins);
+    return -1;
+  }
+
+  *_slot = slot;
+  return stamp;
+}
+
+void shm_unpin(RingBuffer *_ringBuffer, int _slot)
+{
+  if(_ringBuffer && _slot >= 0 && _slot < SHM_MAX_SLOTS)
+  {
+    InterlockedDecrement64(&_ringBuffer->slots[_slot].pins);
+  }
+}
+
+// shm_pin_valid: pinned slot not written over since it was pinned (pin limit reached)
+bool shm_pin_valid(RingBuffer *_ringBuffer, int _slot, long long _stamp)
+{
+  if(!_ringBuffer || _slot < 0 || _slot >= SHM_MAX_SLOTS)
+  {
+    return false;
+  }
+
+  MemoryBarrier();
+  return _ringBuffer->slots[_slot].stamp == _stamp;
+}
+
+long long shm_timestamp()
+{
+  // QPC is system wide, so timestamps can be compared between processes
+  static LARGE_INTEGER freq = { };
+  if(!freq.QuadPart)
+  {
+    QueryPerformanceFrequency(&freq);
+  }
+
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (counter.QuadPart / freq.QuadPart) * 1000000000LL + ((counter.QuadPart % freq.QuadPart) * 1000000000LL) / freq.QuadPart;
+}
+
+long long shm_pid()
+{
+  return (long long) GetCurrentProcessId();
+}
+
+// shm_process_alive: process handle still not signaled. Access denied: exists, owned by someone else
+bool shm_process_alive(long long _pid)
+{
+  if(_pid <= 0)
+  {
+    return false;
+  }
+
+  HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD) _pid);
+  if(!process)
+  {
+    return GetLastError() == ERROR_ACCESS_DENIED;
+  }
+  bool alive = (WaitForSingleObject(process, 0) == WAIT_TIMEOUT);
+  CloseHandle(process);
+  return alive;
+}
+
+int shm_reader_register(ShMHandle *_handle)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return -1;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  long long now = shm_timestamp();
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    Reader *reader = &rb->readers[i];
+    long long rseq = reader->rseq;
+
+    // free slot, or a reader that stopped renewing its lease (crashed consumer)
+    bool expired = (rseq >= 0) && (now - reader->lease > READER_LEASE_TIMEOUT);
+    if(rseq >= 0 && !expired)
+    {
+      continue;
+    }
+
+    reader->lease = now;
+    if(InterlockedCompareExchange64(&reader->rseq, rb->wseq, rseq) == rseq)
+    {
+      _handle->reader = i;
+      memset((void *) &rb->stats.readers[i], 0, sizeof(ShMReaderStats));
+
+      // auto reset wake event, signaled by the producer on every write
+      if(_handle->event)
+      {
+        CloseHandle((HANDLE) _handle->event);
+      }
+      _handle->event = (unsigned long long) CreateEventA(NULL, FALSE, FALSE, shm_eventname(_handle->name, i).c_str());
+      // producers waiting for a consumer (waitConsumer)
+      shm_wake_writer(_handle);
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+bool shm_reader_unregister(ShMHandle *_handle)
+{
+  if(!_handle || !_handle->rb || _handle->reader < 0)
+  {
+    return false;
+  }
+
+  InterlockedExchange64(&_handle->rb->readers[_handle->reader].rseq, -1);
+  _handle->reader = -1;
+  shm_wake_writer(_handle);
+
+  if(_handle->event)
+  {
+    CloseHandle((HANDLE) _handle->event);
+  }
+  _handle->event = 0;
+
+  return true;
+}
+
+bool shm_read_set(ShMHandle *_handle, long long _seq)
+{
+  if(!_handle || !_handle->rb || _handle->reader < 0)
+  {
+    return false;
+  }
+
+  Reader *reader = &_handle->rb->readers[_handle->reader];
+  reader->lease = shm_timestamp();
+  InterlockedExchange64(&reader->rseq, _seq);
+  shm_wake_writer(_handle);
+
+  return true;
+}
+
+long long shm_slowest_reader(ShMHandle *_handle, long long _leaseTimeout)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return -1;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  long long now = shm_timestamp();
+  long long slowest = -1;
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    Reader *reader = &rb->readers[i];
+    long long rseq = reader->rseq;
+    if(rseq < 0)
+    {
+      continue;
+    }
+
+    // expire readers that stopped renewing the lease, they must not block the producer forever
+    if(now - reader->lease > _leaseTimeout)
+    {
+      InterlockedCompareExchange64(&reader->rseq, -1, rseq);
+      continue;
+    }
+
+    if(slowest < 0 || rseq < slowest)
+    {
+      slowest = rseq;
+    }
+  }
+
+  return slowest;
+}
+
+// shm_wait: block until the producer writes past _seq or _msTimeout expires. True when there is data to read
+bool shm_wait(ShMHandle *_handle, long long _seq, int _msTimeout)
+{
+  if(!_handle || !_handle->rb)
+  {
+    return false;
+  }
+
+  if(_handle->rb->wseq > _seq)
+  {
+    return true;
+  }
+
+  // not registered, no wake event of our own: the producer wake semaphore, opened once and cached
+  if(!_handle->event)
+  {
+    if(!_handle->semaphore)
+    {
+      _handle->semaphore = (unsigned long long) OpenSemaphoreA(SYNCHRONIZE, FALSE, shm_semaphorename(_handle->name).c_str());
+    }
+    if(!_handle->semaphore)
+    {
+      return false;
+    }
+    RingBuffer *rb = _handle->rb;
+    return shm_semaphore_wait((HANDLE) _handle->semaphore, &rb->waiters, _msTimeout, [&] { return rb->wseq > _seq; });
+  }
+
+  // auto reset event. A write between the check above and the wait leaves it signaled
+  WaitForSingleObject((HANDLE) _handle->event, (DWORD) ((_msTimeout > 0)? _msTimeout : 0));
+  return _handle->rb->wseq > _seq;
+}
+
+// shm_wait_readers: producer side, lossless rings. Block until the slowest reader is no longer at _slowest
+// (moved on, left or expired) or _msTimeout expires. True when it moved
+bool shm_wait_readers(ShMHandle *_handle, long long _slowest, int _msTimeout)
+{
+  if(!_handle || !_handle->rb || !_handle->writer)
+  {
+    return false;
+  }
+
+  RingBuffer *rb = _handle->rb;
+  if(shm_slowest_reader(_handle) != _slowest)
+  {
+    return true;
+  }
+
+  // auto reset event. A reader moving on once rwaiters is up leaves it signaled
+  InterlockedIncrement((volatile LONG *) &rb->rwaiters);
+  if(shm_slowest_reader(_handle) == _slowest)
+  {
+    WaitForSingleObject((HANDLE) _handle->writer, (DWORD) ((_msTimeout > 0)? _msTimeout : 0));
+  }
+  InterlockedDecrement((volatile LONG *) &rb->rwaiters);
+
+  return shm_slowest_reader(_handle) != _slowest;
+}
+
+// shm_remove: named mappings go away with the last handle
+bool shm_remove(const char *_shmname)
+{
+  return true;
+}
+
+ShMControlHandle shm_control_init(const char *_shmname)
+{
+  ShMControlHandle ret = { };
+
+  ret.shm_handle = (unsigned long long) CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(ShMControl), _shmname);
+  if(!ret.shm_handle)
+  {
+    return ret;
+  }
+
+  ret.ctl = (ShMControl *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShMControl));
+  if(!ret.ctl)
+  {
+    CloseHandle((HANDLE) ret.shm_handle);
+    ret.shm_handle = 0;
+    return ret;
+  }
+
+  // new segment. An existing one (consumers still attached) keeps its epoch so they follow the new ring
+  if(ret.ctl->magic != SHM_CONTROL_MAGIC)
+  {
+    ret.ctl->version = 1;
+    ret.ctl->epoch = -1;
+    ret.ctl->magic = SHM_CONTROL_MAGIC;
+  }
+
+  return ret;
+}
+
+ShMControlHandle shm_control_connect(const char *_shmname)
+{
+  ShMControlHandle ret = { };
+
+  ret.shm_handle = (unsigned long long) OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, _shmname);
+  if(!ret.shm_handle)
+  {
+    return ret;
+  }
+
+  ret.ctl = (ShMControl *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShMControl));
+  if(!ret.ctl || ret.ctl->magic != SHM_CONTROL_MAGIC)
+  {
+    shm_control_close(&ret);
+  }
+
+  return ret;
+}
+
+bool shm_control_close(ShMControlHandle *_handle)
+{
+  if(!_handle)
+  {
+    return false;
+  }
+
+  if(_handle->ctl)
+  {
+    UnmapViewOfFile(_handle->ctl);
+  }
+  _handle->ctl = nullptr;
+
+  if(_handle->shm_handle)
+  {
+    CloseHandle((HANDLE) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
+  return true;
+}
+
+// shm_rendition_request: ask the producer for a scaled copy of its video ring, or renew the lease on it.
+// False when every entry is taken
+bool shm_rendition_request(ShMControlHandle *_handle, int _width, int _height, int _format)
+{
+  if(!_handle || !_handle->ctl)
+  {
+    return false;
+  }
+
+  ShMControl *ctl = _handle->ctl;
+  long long key = shm_renditionkey(_width, _height, _format);
+  long long now = shm_timestamp();
+  for(int i = 0; i < SHM_MAX_RENDITIONS; i++)
+  {
+    ShMRendition *r = &ctl->renditions[i];
+    if(r->key == key)
+    {
+      r->lease = now;
+      return true;
+    }
+  }
+
+  // free or expired entry
+  for(int i = 0; i < SHM_MAX_RENDITIONS; i++)
+  {
+    ShMRendition *r = &ctl->renditions[i];
+    long long current = r->key;
+    if((current == 0 || now - r->lease > SHM_RENDITION_LEASE) && InterlockedCompareExchange64(&r->key, key, current) == current)
+    {
+      r->lease = now;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// shm_registry_open: well known registry segment, created by the first process that needs it
+ShMRegistryHandle shm_registry_open()
+{
+  ShMRegistryHandle ret = { };
+
+  // zero filled on creation: an empty registry
+  ret.shm_handle = (unsigned long long) CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(ShMRegistry), SHM_REGISTRY_NAME);
+  if(!ret.shm_handle)
+  {
+    return ret;
+  }
+
+  ret.reg = (ShMRegistry *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShMRegistry));
+  if(!ret.reg)
+  {
+    shm_registry_close(&ret);
+    return ret;
+  }
+
+  if(ret.reg->magic != SHM_REGISTRY_MAGIC)
+  {
+    ret.reg->version = 1;
+    InterlockedCompareExchange((volatile LONG *) &ret.reg->magic, SHM_REGISTRY_MAGIC, 0);
+  }
+
+  // created by the first process, opened by the others
+  ret.semaphore = (unsigned long long) CreateSemaphoreA(NULL, 0, MAXLONG, SHM_REGISTRY_NAME ".changed");
+
+  return ret;
+}
+
+bool shm_registry_close(ShMRegistryHandle *_handle)
+{
+  if(!_handle)
+  {
+    return false;
+  }
+
+  if(_handle->reg)
+  {
+    UnmapViewOfFile(_handle->reg);
+  }
+  _handle->reg = nullptr;
+
+  if(_handle->semaphore)
+  {
+    CloseHandle((HANDLE) _handle->semaphore);
+  }
+  _handle->semaphore = 0;
+
+  if(_handle->shm_handle)
+  {
+    CloseHandle((HANDLE) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
+  return true;
+}
+
+// registry changed: bump the generation, wake subscribers
+static void shm_registry_changed(ShMRegistryHandle *_handle)
+{
+  ShMRegistry *reg = _handle->reg;
+  InterlockedIncrement64(&reg->generation);
+  InterlockedIncrement((volatile LONG *) &reg->futex);
+  shm_semaphore_wake((HANDLE) _handle->semaphore, &reg->waiters);
+}
+
+// consistent copy of a live entry (seqlock on version)
+static bool shm_source_read(const ShMSource *_entry, ShMSource *_source)
+{
+  for(int retry = 0; retry < 8; retry++)
+  {
+    long long pid = _entry->pid;
+    long long version = _entry->version;
+    if(pid == 0 || (version & 1)) continue;
+    MemoryBarrier();
+    memcpy((void *) _source, (const void *) _entry, sizeof(ShMSource));
+    MemoryBarrier();
+    if(_entry->version == version && _entry->pid == pid)
+    {
+      return shm_process_alive(pid);
+    }
+  }
+  return false;
+}
+
+// shm_registry_publish: add or update our entry for _source->uid. Entries of dead processes are reused
+bool shm_registry_publish(ShMRegistryHandle *_handle, const ShMSource *_source)
+{
+  if(!_handle || !_handle->reg || !_source)
+  {
+    return false;
+  }
+
+  ShMRegistry *reg = _handle->reg;
+  long long pid = shm_pid();
+  ShMSource *entry = nullptr;
+  for(int i = 0; i < SHM_REGISTRY_SIZE && !entry; i++)
+  {
+    ShMSource *s = &reg->sources[i];
+    if(s->pid == pid && strncmp(s->uid, _source->uid, SHM_NAME_SIZE) == 0) entry = s;
+  }
+  for(int i = 0; i < SHM_REGISTRY_SIZE && !entry; i++)
+  {
+    ShMSource *s = &reg->sources[i];
+    long long owner = s->pid;
+    if((owner == 0 || !shm_process_alive(owner)) && InterlockedCompareExchange64(&s->pid, pid, owner) == owner) entry = s;
+  }
+  if(!entry)
+  {
+    return false;
+  }
+
+  // everything but pid and version
+  size_t offset = offsetof(ShMSource, started);
+  InterlockedIncrement64(&entry->version);
+  memcpy((char *) entry + offset, (const char *) _source + offset, sizeof(ShMSource) - offset);
+  InterlockedIncrement64(&entry->version);
+
+  shm_registry_changed(_handle);
+  return true;
+}
+
+bool shm_registry_remove(ShMRegistryHandle *_handle, const char *_uid)
+{
+  if(!_handle || !_handle->reg || !_uid)
+  {
+    return false;
+  }
+
+  ShMRegistry *reg = _handle->reg;
+  long long pid = shm_pid();
+  for(int i = 0; i < SHM_REGISTRY_SIZE; i++)
+  {
+    ShMSource *s = &reg->sources[i];
+    if(s->pid == pid && strncmp(s->uid, _uid, SHM_NAME_SIZE) == 0)
+    {
+      InterlockedIncrement64(&s->version);
+      s->uid[0] = 0;
+      InterlockedIncrement64(&s->version);
+      InterlockedExchange64(&s->pid, 0);
+      shm_registry_changed(_handle);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// shm_registry_find: live entry for _uid. The latest published one if a restarting producer overlaps
+bool shm_registry_find(ShMRegistryHandle *_handle, const char *_uid, ShMSource *_source)
+{
+  if(!_handle || !_handle->reg || !_uid)
+  {
+    return false;
+  }
+
+  bool found = false;
+  ShMSource source;
+  for(int i = 0; i < SHM_REGISTRY_SIZE; i++)
+  {
+    if(shm_source_read(&_handle->reg->sources[i], &source) && strncmp(source.uid, _uid, SHM_NAME_SIZE) == 0)
+    {
+      if(!found || source.started > _source->started)
+      {
+        if(_source) *_source = source;
+        found = true;
+      }
+      if(!_source) break;
+    }
+  }
+
+  return found;
+}
+
+int shm_registry_list(ShMRegistryHandle *_handle, ShMSource *_sources, int _maxSources)
+{
+  if(!_handle || !_handle->reg || !_sources)
+  {
+    return 0;
+  }
+
+  int n = 0;
+  for(int i = 0; i < SHM_REGISTRY_SIZE && n < _maxSources; i++)
+  {
+    if(shm_source_read(&_handle->reg->sources[i], &_sources[n])) n++;
+  }
+
+  return n;
+}
+
+// shm_registry_wait: block until the registry changes past _generation or _msTimeout expires. Subscribers
+// block on the neurona.registry.changed semaphore
+bool shm_registry_wait(ShMRegistryHandle *_handle, long long _generation, int _msTimeout)
+{
+  if(!_handle || !_handle->reg)
+  {
+    return false;
+  }
+
+  ShMRegistry *reg = _handle->reg;
+  if(!_handle->semaphore)
+  {
+    return reg->generation != _generation;
+  }
+
+  return shm_semaphore_wait((HANDLE) _handle->semaphore, &reg->waiters, _msTimeout, [&] { return reg->generation != _generation; });
+}
+
+// shm_clock_open: well known house clock segment, created by the first process that needs it
+ShMClockHandle shm_clock_open()
+{
+  ShMClockHandle ret = { };
+
+  // zero filled on creation: no master
+  ret.shm_handle = (unsigned long long) CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(ShMClock), SHM_CLOCK_NAME);
+  if(!ret.shm_handle)
+  {
+    return ret;
+  }
+
+  ret.clock = (ShMClock *) MapViewOfFile((HANDLE) ret.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShMClock));
+  if(!ret.clock)
+  {
+    shm_clock_close(&ret);
+    return ret;
+  }
+
+  if(ret.clock->magic != SHM_CLOCK_MAGIC)
+  {
+    InterlockedCompareExchange((volatile LONG *) &ret.clock->magic, SHM_CLOCK_MAGIC, 0);
+  }
+
+  return ret;
+}
+
+bool shm_clock_close(ShMClockHandle *_handle)
+{
+  if(!_handle)
+  {
+    return false;
+  }
+
+  if(_handle->clock)
+  {
+    UnmapViewOfFile(_handle->clock);
+  }
+  _handle->clock = nullptr;
+
+  if(_handle->shm_handle)
+  {
+    CloseHandle((HANDLE) _handle->shm_handle);
+  }
+  _handle->shm_handle = 0;
+
+  return true;
+}
+
+// shm_clock_claim: become (or stay) the house clock master. Taken over when there is none, its process is gone
+// or it stopped ticking. A new master at the same rate keeps the anchor, locked engines see no phase jump.
+// False while another master ticks it
+bool shm_clock_claim(ShMClockHandle *_handle, int _rateNum, int _rateDen, long long _anchor)
+{
+  if(!_handle || !_handle->clock || _rateNum <= 0 || _rateDen <= 0)
+  {
+    return false;
+  }
+
+  ShMClock *clock = _handle->clock;
+  long long pid = shm_pid();
+  long long master = clock->pid;
+  if(master != pid)
+  {
+    bool stale = (shm_timestamp() - clock->deadline) > SHM_CLOCK_STALE;
+    if(master != 0 && !stale && shm_process_alive(master))
+    {
+      return false;
+    }
+    if(InterlockedCompareExchange64(&clock->pid, pid, master) != master)
+    {
+      return false;
+    }
+  }
+
+  if(clock->rateNum == _rateNum && clock->rateDen == _rateDen && clock->anchor != 0)
+  {
+    return true;
+  }
+
+  // new rate: readers retry while the version is odd
+  InterlockedIncrement64(&clock->version);
+  MemoryBarrier();
+  clock->rateNum = _rateNum;
+  clock->rateDen = _rateDen;
+  clock->anchor = _anchor;
+  clock->tick = -1;
+  clock->deadline = _anchor;
+  MemoryBarrier();
+  InterlockedIncrement64(&clock->version);
+
+  return true;
+}
+
+// shm_clock_release: master steps down, the next pacer to claim the clock keeps its anchor
+bool shm_clock_release(ShMClockHandle *_handle)
+{
+  if(!_handle || !_handle->clock)
+  {
+    return false;
+  }
+
+  long long pid = shm_pid();
+  return InterlockedCompareExchange64(&_handle->clock->pid, 0, pid) == pid;
+}
+
+// shm_clock_read: house rate and anchor. False when the clock has no master
+bool shm_clock_read(ShMClockHandle *_handle, int *_rateNum, int *_rateDen, long long *_anchor)
+{
+  if(!_handle || !_handle->clock)
+  {
+    return false;
+  }
+
+  ShMClock *clock = _handle->clock;
+  for(int retry = 0; retry < 100; retry++)
+  {
+    long long version = clock->version;
+    MemoryBarrier();
+    int rateNum = clock->rateNum;
+    int rateDen = clock->rateDen;
+    long long anchor = clock->anchor;
+    long long pid = clock->pid;
+    MemoryBarrier();
+    if((version & 1) || version != clock->version)
+    {
+      continue;
+    }
+    if(pid == 0 || rateNum <= 0 || rateDen <= 0)
+    {
+      return false;
+    }
+    *_rateNum = rateNum;
+    *_rateDen = rateDen;
+    *_anchor = anchor;
+    return true;
+  }
+
+  return false;
+}
+
+// shm_clock_tick: master ticked house frame _tick, due at _deadline
+bool shm_clock_tick(ShMClockHandle *_handle, long long _tick, long long _deadline)
+{
+  if(!_handle || !_handle->clock || _handle->clock->pid != shm_pid())
+  {
+    return false;
+  }
+
+  _handle->clock->deadline = _deadline;
+  MemoryBarrier();
+  _handle->clock->tick = _tick;
+  return true;
+}
+
 #endif // _WIN32
@@ -1,32 +1,51 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctime>
+#include <thread>
+#include <chrono>
 #include "shmhelper.h"
 
 #define SHM_ID "SHM_TEST"
 #define SHM_COUNT 12
 #define SHM_SIZE 1024 * 1024
 
-void producerLoop()
+using namespace std::chrono_literals;
+
+void producerLoop(int _policy)
 {
-  ShMHandle h = shm_int(SHM_ID, SHM_SIZE, SHM_COUNT);
+  ShMHandle h = shm_init(SHM_ID, SHM_SIZE, SHM_COUNT, _policy);
   unsigned long long i = 0;
   clock_t begin = clock();
 
   while(1)
   {
+    // lossless: wait for the slowest reader
+    if(h.rb->policy == SHM_POLICY_LOSSLESS)
+    {
+      long long slowest = shm_slowest_reader(&h);
+      if(slowest >= 0 && (h.rb->wseq - slowest) >= SHM_COUNT)
+      {
+        std::this_thread::sleep_for(1ms);
+        continue;
+      }
+    }
+
     // write the next entry and atomically update the write sequence number
-	  Message *msg = &(h.rb->_buffer[h.rb->_wseq%SHM_COUNT]);
-	  char *msgData = shm_getmessagedata(h.rb, msg);
-	  msg->_id = i++;
+    Message *msg = &(h.rb->buffer[h.rb->wseq%SHM_COUNT]);
+    shm_message_begin(msg, h.rb->wseq);
+    unsigned char *msgData = shm_getmessagedata(h.rb, msg);
+    memcpy(msgData, &i, sizeof(i));
+    msg->id = i++;
+    msg->size = sizeof(i);
+    msg->seq = h.rb->wseq;
     shm_write_increment(&h);
 
-	  clock_t end = clock();
-	  double elapsed_secs = double(end - begin) / CLOCKS_PER_SEC;
-	  printf("w: %llu %f\r", h.rb->_wseq, elapsed_secs>0? h.rb->_wseq / elapsed_secs : 0);
+    clock_t end = clock();
+    double elapsed_secs = double(end - begin) / CLOCKS_PER_SEC;
+    printf("w: %lld %f\r", h.rb->wseq, elapsed_secs>0? h.rb->wseq / elapsed_secs : 0);
 
-	  // give consumer some time to catch up
-	  shm_sleep(10);
+    // give consumer some time to catch up
+    std::this_thread::sleep_for(10ms);
   }
 
   shm_close(&h);
@@ -34,85 +53,91 @@ void producerLoop()
 
 void consumerLoop()
 {
-  int rIndex = -1;
   ShMHandle h = {};
 
-  // connect
+  // connect and register as reader
   while(1)
   {
-    h = shm_connect(SHM_ID, &rIndex);
-	  if(rIndex >= 0)
-	    break;
-	  shm_sleep(10);
+    h = shm_connect(SHM_ID);
+    if(h.rb && shm_reader_register(&h) >= 0)
+      break;
+    shm_close(&h);
+    std::this_thread::sleep_for(10ms);
   }
 
   // initialize our sequence numbers in the ring buffer
-  long long seq = h.rb->_wseq;
+  long long seq = h.rb->readers[h.reader].rseq;
   long long pid = -1;
-  long long w2rdelay = SHM_COUNT >> 3;
   clock_t begin = clock();
   long long ref = seq;
 
   while(1)
   {
     // while there is data to consume
-    if(seq < h.rb->_wseq)
-	  {
-      Message *msg = &(h.rb->_buffer[seq%SHM_COUNT]);
-	    char *msgData = shm_getmessagedata(h.rb, msg);
-      if( (pid != -1) && (msg->_id != pid + 1) )
-	      printf("warning: %lld %lld\n", msg->_id, pid);
-	    pid = msg->_id;
+    if(seq < h.rb->wseq)
+    {
+      // reader slow, resync
+      if(h.rb->policy == SHM_POLICY_LATEST || (h.rb->wseq - seq) >= SHM_COUNT)
+      {
+        if(h.rb->wseq - seq > 1)
+          printf("warning: %lld %lld\n", seq, h.rb->wseq);
+        seq = h.rb->wseq - 1;
+      }
+
+      Message *msg = &(h.rb->buffer[seq%SHM_COUNT]);
+      if( (pid != -1) && (msg->id != (unsigned long long) (pid + 1)) )
+        printf("warning: %llu %lld\n", msg->id, pid);
+      pid = msg->id;
       ++seq;
 
-	    // reader slow, resync
-	    if((seq + w2rdelay) < h.rb->_wseq)
-	    {
-	      seq = h.rb->_wseq;
-		    ref = seq;
-	      printf("warning: %lld %lld\n", seq, h.rb->_wseq);
-	    }
-	    // atomically update the read sequence in the ring buffer
+      // atomically update the read sequence in the ring buffer
       // making it visible to the producer
-	    shm_read_set(&h, rIndex, seq);
-
-	    clock_t end = clock();
-	    double elapsed_secs = double(end - begin) / CLOCKS_PER_SEC;
-	    printf("r: %llu %f\r", h.rb->_rseq[rIndex], elapsed_secs > 0 ? (h.rb->_rseq[rIndex] - ref) / elapsed_secs : 0);
-	  }
-
-	  // master reconnection?
-	  if(h.rb->_wseq < seq)
-	  {
-      seq = h.rb->_wseq;
-	    ref = seq;
-	    printf("warning: %lld %lld\n", seq, h.rb->_wseq);
-	  }
-
-	  // wait for more data
-	  shm_sleep(1);
+      shm_read_set(&h, seq);
+
+      clock_t end = clock();
+      double elapsed_secs = double(end - begin) / CLOCKS_PER_SEC;
+      printf("r: %lld %f\r", seq, elapsed_secs > 0 ? (seq - ref) / elapsed_secs : 0);
+    }
+    else
+    {
+      // renew lease
+      shm_read_set(&h, seq);
+    }
+
+    // master reconnection?
+    if(h.rb->wseq < seq)
+    {
+      seq = h.rb->wseq;
+      ref = seq;
+      printf("warning: %lld %lld\n", seq, h.rb->wseq);
+    }
+
+    // wait for more data, woken by the producer
+    shm_wait(&h, seq, 100);
   }
 
+  shm_reader_unregister(&h);
   shm_close(&h);
 }
 
 int main(int argc, char** argv)
 {
-  if(argc != 2)
+  if(argc < 2)
   {
-    printf("please supply args (producer/consumer)\n");
-	  return -1;
+    printf("please supply args (producer [lossless]/consumer)\n");
+    return -1;
   }
-  
+
   if(strcmp(argv[1], "consumer") == 0)
   {
-	  consumerLoop();
-	  return -1;
+    consumerLoop();
+    return -1;
   }
   if(strcmp(argv[1], "producer") == 0)
   {
-    producerLoop();
-	  return -1;
+    bool lossless = (argc > 2) && (strcmp(argv[2], "lossless") == 0);
+    producerLoop(lossless? SHM_POLICY_LOSSLESS : SHM_POLICY_LATEST);
+    return -1;
   }
 
   printf("invalid arg: %s\n", argv[1]);
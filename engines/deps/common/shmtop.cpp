@@ -0,0 +1,191 @@
+/*
+ * shmtop: live view of the shared memory rings. Attaches read only, never registers as a reader
+ * g++ -I./ -o shmtop shmtop.cpp shmhelper.linux.cpp -lrt -lpthread
+ * windows: shmtop\shmtop.vc17.vcxproj (engines solution)
+ * shmtop [-i ms] [ID ...]   (no ID: every source in the registry, linux falls back to /dev/shm)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include "shmhelper.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// Ring: one producer being watched
+struct Ring
+{
+  std::string id;
+  ShMControlHandle ctl = {};
+  ShMHandle handle = {};
+  long long epoch = -1;
+  ShMStats last = {};               // counters at the previous refresh, for rates
+  long long lastTime = 0;
+};
+
+// producers: sources in the registry and their sub rings (media bit 1: ID.audio, 2: ID.data)
+static std::vector<std::string> listProducers()
+{
+  std::vector<std::string> ret;
+  static ShMRegistryHandle registry = shm_registry_open();
+  if(registry.reg)
+  {
+    ShMSource sources[SHM_REGISTRY_SIZE];
+    int n = shm_registry_list(&registry, sources, SHM_REGISTRY_SIZE);
+    for(int i = 0; i < n; i++)
+    {
+      std::string uid = sources[i].uid;
+      if(sources[i].media & 1) ret.push_back(uid);
+      if(sources[i].media & 2) ret.push_back(uid + ".audio");
+      if(sources[i].media & 4) ret.push_back(uid + ".data");
+    }
+    return ret;
+  }
+
+  // no registry: control segments in /dev/shm (ring segments carry '#epoch')
+#ifndef _WIN32
+  DIR *dir = opendir("/dev/shm");
+  if(!dir) return ret;
+  struct dirent *entry = nullptr;
+  while((entry = readdir(dir)) != nullptr)
+  {
+    std::string name = entry->d_name;
+    struct stat st = { };
+    if(name[0] == '.' || name.find('#') != std::string::npos) continue;
+    if(stat(("/dev/shm/" + name).c_str(), &st) != 0 || st.st_size != (off_t) sizeof(ShMControl)) continue;
+    ret.push_back(name);
+  }
+  closedir(dir);
+#endif
+  return ret;
+}
+
+// attach: control segment, then the ring of the current epoch
+static bool attach(Ring *_ring)
+{
+  if(!_ring->ctl.ctl)
+  {
+    _ring->ctl = shm_control_connect(_ring->id.c_str());
+    if(!_ring->ctl.ctl) return false;
+  }
+
+  long long epoch = _ring->ctl.ctl->epoch;
+  if(epoch < 0) return false;
+  if(_ring->handle.rb && epoch == _ring->epoch) return true;
+
+  // producer remapped. Counters start over with the new ring
+  shm_close(&_ring->handle);
+  char name[SHM_NAME_SIZE];
+  shm_ringname(name, sizeof(name), _ring->id.c_str(), epoch);
+  _ring->handle = shm_connect(name, true);
+  _ring->epoch = epoch;
+  memset((void *) &_ring->last, 0, sizeof(ShMStats));
+  _ring->lastTime = 0;
+  return _ring->handle.rb != nullptr;
+}
+
+static double rate(long long _value, long long _last, long long _ns)
+{
+  return (_ns > 0)? (double) (_value - _last) * 1e9 / _ns : 0;
+}
+
+static void print(Ring *_ring)
+{
+  if(!attach(_ring))
+  {
+    printf("%-24s -\n", _ring->id.c_str());
+    return;
+  }
+
+  RingBuffer *rb = _ring->handle.rb;
+  const ShMStats &stats = rb->stats;
+  long long now = shm_timestamp();
+  long long ns = _ring->lastTime? now - _ring->lastTime : 0;
+  long long age = rb->heartbeat? (now - rb->heartbeat) / 1000000 : -1;
+  bool alive = rb->heartbeat && shm_process_alive(rb->pid);
+
+  printf("%-24s %7lld%c %5lld %9u %3u %-8s %10lld %8.1f %8.1f %8lld %8lld %8lld\n", _ring->id.c_str(), rb->pid, alive? ' ' : '!', _ring->epoch, rb->size, rb->count,
+         (rb->policy == SHM_POLICY_LOSSLESS)? "lossless" : "latest", stats.writes, rate(stats.writes, _ring->last.writes, ns),
+         rate(stats.bytes, _ring->last.bytes, ns) / (1024 * 1024), stats.overruns, stats.stalls, age);
+
+  for(int i = 0; i < MAX_NUM_READERS; i++)
+  {
+    long long rseq = rb->readers[i].rseq;
+    if(rseq < 0) continue;
+    const ShMReaderStats &reader = stats.readers[i];
+    printf("  reader %-2d rseq %-10lld lag %-4lld %8.1f/s reads %-10lld drops %-8lld torn %-8lld lease %lld ms\n", i, rseq, reader.lag,
+           rate(reader.reads, _ring->last.readers[i].reads, ns), reader.reads, reader.drops, reader.torn,
+           (now - rb->readers[i].lease) / 1000000);
+  }
+
+  memcpy((void *) &_ring->last, (const void *) &stats, sizeof(ShMStats));
+  _ring->lastTime = now;
+}
+
+int main(int argc, char** argv)
+{
+  int interval = 1000;
+  std::vector<std::string> ids;
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+    {
+      interval = atoi(argv[++i]);
+    }
+    else
+    {
+      ids.push_back(argv[i]);
+    }
+  }
+
+  bool scan = ids.empty();
+  std::vector<Ring *> rings;
+
+  while(1)
+  {
+    // producers come and go
+    if(scan)
+    {
+      for(auto &id : listProducers())
+      {
+        bool known = false;
+        for(auto ring : rings) known |= (ring->id == id);
+        if(!known)
+        {
+          Ring *ring = new Ring();
+          ring->id = id;
+          rings.push_back(ring);
+        }
+      }
+    }
+    else if(rings.empty())
+    {
+      for(auto &id : ids)
+      {
+        Ring *ring = new Ring();
+        ring->id = id;
+        rings.push_back(ring);
+      }
+    }
+
+    // clear screen, home
+    printf("\033[2J\033[H");
+    printf("%-24s %8s %5s %9s %3s %-8s %10s %8s %8s %8s %8s %8s\n", "ID", "pid", "epoch", "size", "n", "policy", "writes", "msg/s", "MB/s", "overrun", "stalls", "age ms");
+    for(auto ring : rings)
+    {
+      print(ring);
+    }
+    fflush(stdout);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+  }
+
+  return 0;
+}
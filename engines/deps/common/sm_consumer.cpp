@@ -1,6 +1,7 @@
 #include <string>
-#include <clock.h>
+#include <string.h>
 #include "sm_consumer.h"
+#include "fastcopy.h"
 
 using namespace std::chrono_literals;
 
@@ -17,20 +18,34 @@ SharedMemoryConsumer::~SharedMemoryConsumer()
 bool SharedMemoryConsumer::init(const char *_id, int _msTimeout)
 {
   ID_ = _id;
+  msTimeout_ = _msTimeout;
 
-  // shared memory init
-  smHandle_ = shm_connect(_id);
-  bool ok = (smHandle_.shm_handle != 0);
+  // shared memory init. Control segment points to the current ring
+  ctlHandle_ = shm_control_connect(_id);
+  bool ok = (ctlHandle_.ctl != nullptr) && (ctlHandle_.ctl->epoch >= 0);
+  if(ok)
+  {
+    epoch_ = ctlHandle_.ctl->epoch;
+    char name[SHM_NAME_SIZE];
+    shm_ringname(name, sizeof(name), _id, epoch_);
+    smHandle_ = shm_connect(name);
+    ok = (smHandle_.shm_handle != 0);
+  }
   if(ok)
   {
     dataSize_ = smHandle_.rb->size;
     data_ = new unsigned char[dataSize_];
     opened_ = true;
 
-    // keep alive
-    workerThread_ = std::thread([&] {
-      keepAliveThreadFunc();
-    });
+    // reader cursor
+    dropped_ = 0;
+    torn_ = 0;
+    lastCheck_ = 0;
+    attach(false);
+  }
+  else
+  {
+    shm_control_close(&ctlHandle_);
   }
 
   return ok;
@@ -43,62 +58,358 @@ bool SharedMemoryConsumer::deinit()
     delete[] data_;
   }
   data_ = NULL;
+  opened_ = false;
+
+  /* sm close */
+  shm_reader_unregister(&smHandle_);
+  retire(&smHandle_);
+  retire(&retired_);
+  shm_control_close(&ctlHandle_);
+  epoch_ = -1;
+
+  return true;
+}
+
+// suspend: stay mapped but stop being a reader (standby source). The producer does not wait on us
+void SharedMemoryConsumer::suspend()
+{
+  shm_reader_unregister(&smHandle_);
+  readSeq_ = -1;
+}
+
+// resume: reader again, from the newest message on
+void SharedMemoryConsumer::resume()
+{
+  if(!attached()) return;
+  if(ctlHandle_.ctl->epoch != epoch_ && remap()) return;
+  shm_reader_unregister(&smHandle_);
+  attach(false);
+  lastCheck_ = 0;
+  opened_ = alive();
+}
 
-  // keep alive
-  if(workerThread_.joinable())
+// attach: register as reader of the current ring. Lossless rings deliver from the registration point on,
+// or from the first message when following a remap (nothing of the new ring is lost). Stream rings are
+// read from the attach point on whatever the policy
+void SharedMemoryConsumer::attach(bool _fromStart)
+{
+  readSeq_ = (smHandle_.rb->mode == SHM_MODE_STREAM)? (_fromStart? 0 : smHandle_.rb->wseq) : -1;
+  if(shm_reader_register(&smHandle_) >= 0 && smHandle_.rb->policy == SHM_POLICY_LOSSLESS)
   {
-    running_ = false;
-    workerThread_.join();
+    readSeq_ = _fromStart? 0 : smHandle_.rb->readers[smHandle_.reader].rseq;
+    shm_read_set(&smHandle_, readSeq_);
   }
+}
 
-  /* sm close */
-  shm_close(&smHandle_);
+// retire: ring mapping no longer read from. Consumers handing out zero copy frames keep it until they are freed
+void SharedMemoryConsumer::retire(ShMHandle *_handle)
+{
+  shm_close(_handle);
+}
+
+// remap: producer moved to a new ring (format change). The previous ring stays mapped until the next
+// remap, zero copy frames may still point into it
+bool SharedMemoryConsumer::remap()
+{
+  long long epoch = ctlHandle_.ctl->epoch;
+  char name[SHM_NAME_SIZE];
+  shm_ringname(name, sizeof(name), ID_.c_str(), epoch);
+  ShMHandle handle = shm_connect(name);
+  if(!handle.rb) return false;
+
+  shm_reader_unregister(&smHandle_);
+  retire(&retired_);
+  retired_ = smHandle_;
+  smHandle_ = handle;
+  epoch_ = epoch;
 
+  if(dataSize_ != (int) smHandle_.rb->size)
+  {
+    delete[] data_;
+    dataSize_ = smHandle_.rb->size;
+    data_ = new unsigned char[dataSize_];
+  }
+
+  attach(true);
+  opened_ = true;
   return true;
 }
 
 bool SharedMemoryConsumer::read()
 {
-  // nothing to read
-  if(smHandle_.rb->wseq <= 0) return false;
-  Message *msg = &(smHandle_.rb->buffer[(smHandle_.rb->wseq - 1) % smHandle_.rb->count]);
-  msgID_ = msg->id;
-  memcpy(data_, shm_getmessagedata(smHandle_.rb, msg), dataSize_);
-  return true;
+  for(int retry = 0; retry <= MAX_READ_RETRIES; retry++)
+  {
+    long long seq = next();
+    if(seq < 0) return false;
+    bool ret = copy(seq);
+    consume(seq);
+    if(ret) return true;
+  }
+
+  // producer kept writing over us
+  dropped_++;
+  ShMReaderStats *stats = readerStats();
+  if(stats) shm_stat_add(&stats->drops, 1);
+  return false;
 }
 
-void SharedMemoryConsumer::keepAliveThreadFunc()
+// drain: stream rings. Every record since our cursor copied into data_ back to back in one go, returns the
+// bytes copied (0: nothing new, -1: not open). Lapped readers lose what was written over and resync
+int SharedMemoryConsumer::drain()
 {
-  running_ = true;
-  unsigned long long lastKeepAlive = 0;
-  long long startTime = 0, timeoutTime = 0;
-  
-  while(running_)
+  if(!attached()) return -1;
+  if(ctlHandle_.ctl->epoch != epoch_ && !remap()) return -1;
+  if(!opened_) return -1;
+
+  RingBuffer *rb = smHandle_.rb;
+  long long capacity = rb->size;
+  long long wseq = rb->wseq;
+  if(wseq < readSeq_)
+  {
+    readSeq_ = -1;
+  }
+  if(readSeq_ < 0)
+  {
+    readSeq_ = wseq;
+  }
+
+  if(wseq == readSeq_)
+  {
+    renew(readSeq_);
+    opened_ = alive();
+    return 0;
+  }
+
+  for(int retry = 0; retry <= MAX_READ_RETRIES; retry++)
   {
-    if(opened_)
+    long long from = readSeq_;
+    if(wseq - from > capacity)
+    {
+      // written over. Newest record on
+      from = rb->buffer[0].seq;
+      dropped_++;
+      ShMReaderStats *stats = readerStats();
+      if(stats) shm_stat_add(&stats->drops, 1);
+    }
+
+    // records never straddle the end of the slot, a pad record sends us back to its start
+    const unsigned char *data = shm_getmessagedata(rb, &rb->buffer[0]);
+    long long pos = from;
+    int copied = 0;
+    while(pos < wseq)
     {
-      if(startTime == 0)
+      const ShMRecord *record = (const ShMRecord *) (data + pos % capacity);
+      if(record->pos != pos) break;
+      if(record->size < 0)
       {
-        startTime = Clock::instance().elapsed();
-        timeoutTime = startTime + (msTimeout_ * 1000000LL);
+        pos += capacity - pos % capacity;
+        continue;
       }
+      int bytes = (int) shm_recordsize(record->size);
+      if(copied + bytes > dataSize_) break;
+      memcpy(data_ + copied, record, bytes);
+      copied += bytes;
+      pos += bytes;
+    }
 
-      bool timeout = Clock::instance().elapsed() >= timeoutTime;
-      if(timeout)
-      {        
-        if(smHandle_.rb->keepAlive == lastKeepAlive)
-        {
-          opened_ = false;
-        }
-
-        startTime = 0;
-        lastKeepAlive = smHandle_.rb->keepAlive;
-      }    
+    if(!shm_stream_valid(rb, from))
+    {
+      tear();
+      readSeq_ = rb->buffer[0].seq;
+      wseq = rb->wseq;
+      continue;
     }
-    else
+
+    readSeq_ = pos;
+    renew(readSeq_);
+    ShMReaderStats *stats = readerStats();
+    if(stats)
     {
-      startTime = 0;
+      shm_stat_add(&stats->reads, 1);
+      stats->lag = rb->wseq - readSeq_;
     }
-    std::this_thread::sleep_for(1ms);    
+    msgSeq_ = from;
+    msgSize_ = copied;
+    return copied;
   }
+
+  return 0;
+}
+
+// view: pointer to next message straight into the shared memory slot (no copy). Use valid() to check the
+// producer did not write over it while in use
+const unsigned char * SharedMemoryConsumer::view(long long *_seq, int *_size)
+{
+  long long seq = next();
+  if(seq < 0) return nullptr;
+  Message *msg = &(smHandle_.rb->buffer[seq % smHandle_.rb->count]);
+  msgID_ = msg->id;
+  msgSeq_ = seq;
+  msgSize_ = (int) msg->size;
+  if(_seq) *_seq = seq;
+  if(_size) *_size = msgSize_;
+  consume(seq);
+  return shm_getmessagedata(smHandle_.rb, msg);
+}
+
+bool SharedMemoryConsumer::valid(long long _seq)
+{
+  return shm_slot_valid(smHandle_.rb, _seq);
+}
+
+// wait: block until the producer publishes past our cursor or _msTimeout expires
+bool SharedMemoryConsumer::wait(int _msTimeout)
+{
+  if(!attached()) return false;
+
+  // producer gone: nothing wakes us, look for its restart (new epoch) every few ms
+  if(!opened_)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds((_msTimeout < RESTART_POLL)? _msTimeout : RESTART_POLL));
+    return ctlHandle_.ctl->epoch != epoch_;
+  }
+
+  // producer restarted over the same mapping or remapped, next() resyncs
+  if(smHandle_.rb->wseq < readSeq_ || ctlHandle_.ctl->epoch != epoch_) return true;
+
+  // a dead producer never wakes us, block in slices so next() gets to look at the heartbeat
+  int msTimeout = (_msTimeout > HEARTBEAT_WAIT)? HEARTBEAT_WAIT : _msTimeout;
+  return shm_wait(&smHandle_, (readSeq_ >= 0)? readSeq_ : 0, msTimeout);
+}
+
+// alive: lazy producer liveness. A recent heartbeat is enough. A stale one (idle producer) needs the
+// producer process to still be there, looked at once per HEARTBEAT_STALE. Closed rings have no heartbeat
+bool SharedMemoryConsumer::alive()
+{
+  RingBuffer *rb = smHandle_.rb;
+  long long heartbeat = rb->heartbeat;
+  if(heartbeat == 0) return false;
+
+  long long now = shm_timestamp();
+  if((now - heartbeat < HEARTBEAT_STALE) || (now - lastCheck_ < HEARTBEAT_STALE)) return true;
+  lastCheck_ = now;
+  return shm_process_alive(rb->pid);
+}
+
+// next: ring sequence to read, -1 when there is nothing new. Latest policy jumps to the newest message,
+// lossless goes through them in order
+long long SharedMemoryConsumer::next()
+{
+  if(!attached()) return -1;
+
+  // producer remapped or restarted (a restarting producer bumps the epoch). Follow it in place
+  if(ctlHandle_.ctl->epoch != epoch_ && !remap())
+  {
+    return -1;
+  }
+  if(!opened_) return -1;
+
+  RingBuffer *rb = smHandle_.rb;
+  long long wseq = rb->wseq;
+
+  // producer restarted over the same mapping
+  if(wseq < readSeq_)
+  {
+    readSeq_ = -1;
+  }
+
+  // nothing to read. Keep our lease alive, is the producer still there?
+  if(wseq <= 0 || wseq == readSeq_)
+  {
+    renew((readSeq_ >= 0)? readSeq_ : wseq);
+    opened_ = alive();
+    return -1;
+  }
+
+  long long seq = readSeq_;
+  if(seq < 0 || rb->policy == SHM_POLICY_LATEST)
+  {
+    seq = wseq - 1;
+  }
+  else if(wseq - seq > rb->count)
+  {
+    // lapped (our lease expired). Resync to the oldest message the producer is not writing. A full ring
+    // (wseq - seq == count) is not lapped, copy() sees the seqlock if the producer got to our slot after all
+    seq = wseq - rb->count + 1;
+  }
+
+  if(readSeq_ >= 0 && seq > readSeq_)
+  {
+    dropped_ += seq - readSeq_;
+    ShMReaderStats *stats = readerStats();
+    if(stats) shm_stat_add(&stats->drops, seq - readSeq_);
+  }
+
+  return seq;
+}
+
+// copy: message _seq payload into data_. False when the producer wrote over the slot before or while
+// we copied it (seqlock stamps checked on both sides of the copy)
+bool SharedMemoryConsumer::copy(long long _seq)
+{
+  if(!shm_slot_valid(smHandle_.rb, _seq))
+  {
+    tear();
+    return false;
+  }
+
+  Message *msg = &(smHandle_.rb->buffer[_seq % smHandle_.rb->count]);
+  msgID_ = msg->id;
+  msgSeq_ = _seq;
+  // only the payload, not the whole slot
+  int size = (msg->size > 0 && (int) msg->size <= dataSize_)? (int) msg->size : dataSize_;
+  // read back right away, keep it in cache
+  fastcopy(data_, shm_getmessagedata(smHandle_.rb, msg), size, false);
+  msgSize_ = size;
+
+  if(!shm_slot_valid(smHandle_.rb, _seq))
+  {
+    tear();
+    return false;
+  }
+  return true;
+}
+
+// tear: count a copy the producer wrote over
+void SharedMemoryConsumer::tear()
+{
+  torn_++;
+  ShMReaderStats *stats = readerStats();
+  if(stats) shm_stat_add(&stats->torn, 1);
+}
+
+// consume: move our cursor past _seq. In lossless mode the producer can now reuse the slot
+void SharedMemoryConsumer::consume(long long _seq)
+{
+  readSeq_ = _seq + 1;
+  renew(readSeq_);
+
+  ShMReaderStats *stats = readerStats();
+  if(stats)
+  {
+    shm_stat_add(&stats->reads, 1);
+    stats->lag = smHandle_.rb->wseq - readSeq_;
+  }
+}
+
+// readerStats: our counters in the ring, null when not registered
+ShMReaderStats * SharedMemoryConsumer::readerStats()
+{
+  if(!smHandle_.rb || smHandle_.reader < 0) return nullptr;
+  return &smHandle_.rb->stats.readers[smHandle_.reader];
+}
+
+// renew: publish our cursor and renew the lease. Register again when the producer expired us
+void SharedMemoryConsumer::renew(long long _seq)
+{
+  if(smHandle_.reader >= 0 && smHandle_.rb->readers[smHandle_.reader].rseq < 0)
+  {
+    smHandle_.reader = -1;
+  }
+  if(smHandle_.reader < 0 && shm_reader_register(&smHandle_) < 0)
+  {
+    return;
+  }
+
+  shm_read_set(&smHandle_, _seq);
 }
\ No newline at end of file
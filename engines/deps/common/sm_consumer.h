@@ -6,6 +6,10 @@
 
 #define DEFAULT_SMELEM_SIZE (8 * 1024 * 1024)
 #define DEFAULT_SM_SIZE 4
+#define MAX_READ_RETRIES 2            // torn copy: read the newest message again up to n times
+#define HEARTBEAT_STALE 200000000LL   // ns without a heartbeat before the producer process is looked at
+#define HEARTBEAT_WAIT 100            // ms, longest wait() block so a dead producer is noticed
+#define RESTART_POLL 5                // ms, control segment polling for a new epoch while the producer is gone
 
 // SharedMemoryConsumer
 class SharedMemoryConsumer
@@ -17,19 +21,45 @@ public:
   virtual bool init(const char *_id, int _msTimeout);
   virtual bool deinit();
   bool read();
+  const unsigned char * view(long long *_seq, int *_size = nullptr);
+  bool valid(long long _seq);
+  bool wait(int _msTimeout);
+  int drain();
+  bool stream() { return smHandle_.rb && smHandle_.rb->mode == SHM_MODE_STREAM; }
   bool opened() { return opened_; }
+  bool attached() { return ctlHandle_.ctl != nullptr; }
+  void suspend();
+  void resume();
+  unsigned long long dropped() { return dropped_; }
+  unsigned long long torn() { return torn_; }
 
 protected:
-  void keepAliveThreadFunc();
+  void attach(bool _fromStart);
+  bool remap();
+  long long next();
+  bool copy(long long _seq);
+  void consume(long long _seq);
+  void renew(long long _seq);
+  void tear();
+  ShMReaderStats * readerStats();
+  bool alive();
+  virtual void retire(ShMHandle *_handle);
 
 protected:
   std::string ID_;
   int msTimeout_ = 5000;
-  ShMHandle smHandle_ = {};
-  unsigned char *data_ = nullptr;   // contains copy of last read data
+  ShMControlHandle ctlHandle_ = {};  // control segment (ID), current ring epoch
+  long long epoch_ = -1;
+  ShMHandle smHandle_ = {};         // current ring (ID#epoch)
+  ShMHandle retired_ = {};          // previous ring, kept mapped until the next remap
+  unsigned char *data_ = nullptr;   // contains copy of last read data (stream rings: records since the last drain)
   unsigned long long msgID_ = 0;    // uid last message read
   int dataSize_ = 0;                // and it's size
+  int msgSize_ = 0;                 // payload size of last message read
+  long long msgSeq_ = -1;           // ring sequence of last message read
+  long long readSeq_ = -1;          // next ring sequence to read (our reader cursor)
+  unsigned long long dropped_ = 0;  // messages skipped (latest policy, lapped by the producer or torn)
+  unsigned long long torn_ = 0;     // copies the producer wrote over while we were reading them
   bool opened_ = false;
-  bool running_ = false;
-  std::thread workerThread_;
+  long long lastCheck_ = 0;         // last producer process check (stale heartbeat)
 };
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include <string>
 #include "sm_producer.h"
+#include "fastcopy.h"
+#include "clock.h"
 
 using namespace std::chrono_literals;
 
@@ -13,52 +15,297 @@ SharedMemoryProducer::~SharedMemoryProducer()
 
 }
 
-bool SharedMemoryProducer::init(const char* _id, int _size, int _count)
+bool SharedMemoryProducer::init(const char* _id, int _size, int _count, int _policy)
 {
   ID_ = _id;
+  count_ = stream_? 1 : _count;
+  // offline: nothing is dropped, the producer goes at the pace of its slowest reader. Best effort rings keep
+  // their policy
+  policy_ = (Clock::instance().isVirtual() && !bestEffort_)? SHM_POLICY_LOSSLESS : _policy;
 
-  // shared memory init
-  smHandle_ = shm_init(_id, _size, _count);
-
-  // keep alive
-  workerThread_ = std::thread([&] {
-    keepAliveThreadFunc();
-  });
+  // shared memory init. Control segment first, then the ring it points to
+  ctlHandle_ = shm_control_init(_id);
+  if(!ctlHandle_.ctl || !remap(_size))
+  {
+    shm_control_close(&ctlHandle_);
+    return false;
+  }
 
   return true;
 }
 
 bool SharedMemoryProducer::deinit()
 {
-  // keep alive
-  if(workerThread_.joinable())
+  // consumers blocked on us see the ring closed right away
+  if(smHandle_.rb)
   {
-    running_ = false;
-    workerThread_.join();
+    smHandle_.rb->heartbeat = 0;
+    shm_wake(&smHandle_);
   }
 
   /* sm close */
+  std::string name = smHandle_.name;
   shm_close(&smHandle_);
+  shm_remove(name.c_str());
+  drop(&retired_);
+  for(auto &handle : held_) drop(&handle);
+  held_.clear();
+  shm_control_close(&ctlHandle_);
+
+  return true;
+}
+
+// remap: ring for the next epoch with _size slots. Consumers see the epoch in the control segment and
+// connect to it. The previous ring stays mapped until the next remap: frames may still be decoded into it
+// and zero copy readers may still be looking at it. Older ones stay until the decoder released its slots
+bool SharedMemoryProducer::remap(int _size)
+{
+  std::lock_guard<std::mutex> lock(reserveMutex_);
+
+  long long epoch = ctlHandle_.ctl->epoch + 1;
+  char name[SHM_NAME_SIZE];
+  shm_ringname(name, sizeof(name), ID_.c_str(), epoch);
+  if(pinsRequested()) pinned_ = std::min((int) ctlHandle_.ctl->pins, SHM_MAX_PINNED);
+  ShMHandle handle = shm_init(name, _size, count_, policy_, stream_? 0 : pinned_);
+  if(!handle.rb) return false;
+  if(stream_)
+  {
+    handle.rb->mode = SHM_MODE_STREAM;
+    handle.rb->buffer[0].wbegin = 0;
+  }
+  recordPos_ = -1;
+
+  if(retired_.rb && holds_[retired_.rb] > 0) held_.push_back(retired_);
+  else drop(&retired_);
+  retired_ = smHandle_;
+  smHandle_ = handle;
+  reserved_ = nullptr;
+
+  ctlHandle_.ctl->size = handle.rb->size;
+  ctlHandle_.ctl->count = handle.rb->count;
+  ctlHandle_.ctl->epoch = epoch;
+
+  // readers blocked on the previous ring, look at the epoch now
+  shm_wake(&retired_);
 
   return true;
 }
 
 bool SharedMemoryProducer::write(const unsigned char *_data, int _dataSize)
 {
+  int capacity = 0;
+  unsigned char *msgData = acquire(&capacity);
+  if(!msgData || _dataSize > capacity) return false;
+  fastcopy(msgData, _data, _dataSize);
+  return commit(_dataSize);
+}
+
+unsigned char * SharedMemoryProducer::acquire(int *_capacity)
+{
+  if(!smHandle_.rb || !waitReaders(&smHandle_)) return nullptr;
   Message *msg = &(smHandle_.rb->buffer[smHandle_.rb->wseq%smHandle_.rb->count]);
-  unsigned char *msgData = shm_getmessagedata(smHandle_.rb, msg);
-  memcpy(msgData, _data, _dataSize);
+  shm_message_begin(msg, smHandle_.rb->wseq);
+  // a consumer still holds the frame in the message slot: write a parked one instead
+  shm_slot_claim(smHandle_.rb, &msg->offset);
+  if(_capacity) *_capacity = smHandle_.rb->size;
+  return shm_getmessagedata(smHandle_.rb, msg);
+}
+
+bool SharedMemoryProducer::commit(int _dataSize)
+{
+  Message *msg = &(smHandle_.rb->buffer[smHandle_.rb->wseq%smHandle_.rb->count]);
+  return publish(msg, _dataSize);
+}
+
+unsigned char * SharedMemoryProducer::reserve(int *_capacity)
+{
+  std::lock_guard<std::mutex> lock(reserveMutex_);
+  if(!smHandle_.rb || reserved_) return nullptr;
+  shm_slot_claim(smHandle_.rb, &smHandle_.rb->spare);
+  reserved_ = (unsigned char *) smHandle_.rb + smHandle_.rb->spare;
+  holds_[smHandle_.rb]++;
+  if(_capacity) *_capacity = smHandle_.rb->size;
+  return (unsigned char *) reserved_;
+}
+
+bool SharedMemoryProducer::commit(const unsigned char *_reserved, int _dataSize)
+{
+  // wait on the readers without reserveMutex_, reserve and release go on meanwhile. A remap while we wait
+  // drops the reservation
+  ShMHandle handle;
+  {
+    std::lock_guard<std::mutex> lock(reserveMutex_);
+    if(!_reserved || (_reserved != reserved_)) return false;
+    handle = smHandle_;
+  }
+  if(!waitReaders(&handle)) return false;
+
+  std::lock_guard<std::mutex> lock(reserveMutex_);
+  if(_reserved != reserved_) return false;
+
+  // message takes the reserved slot, its previous slot becomes the spare one
+  Message *msg = &(smHandle_.rb->buffer[smHandle_.rb->wseq%smHandle_.rb->count]);
+  unsigned long offset = (unsigned long) (_reserved - (unsigned char *) smHandle_.rb);
+  shm_message_begin(msg, smHandle_.rb->wseq);
+  smHandle_.rb->spare = msg->offset;
+  msg->offset = offset;
+  reserved_ = nullptr;
+
+  return publish(msg, _dataSize);
+}
+
+// release: reserved slot no longer referenced (the decoder freed the frame, committed or not). The ring
+// it is in goes once remapped away and no slot of it is held anymore
+void SharedMemoryProducer::release(const unsigned char *_reserved)
+{
+  std::lock_guard<std::mutex> lock(reserveMutex_);
+  if(_reserved == reserved_)
+  {
+    reserved_ = nullptr;
+  }
+
+  RingBuffer *rb = ringOf(_reserved);
+  if(!rb || --holds_[rb] > 0) return;
+  for(auto it = held_.begin(); it != held_.end(); it++)
+  {
+    if(it->rb != rb) continue;
+    drop(&(*it));
+    held_.erase(it);
+    break;
+  }
+}
+
+// ringOf: mapped ring (current, previous or held) the slot is in
+RingBuffer * SharedMemoryProducer::ringOf(const unsigned char *_slot)
+{
+  auto in = [_slot](const ShMHandle &_handle) {
+    const unsigned char *base = (const unsigned char *) _handle.rb;
+    return _handle.rb && (_slot >= base) && (_slot < base + _handle.length);
+  };
+  if(in(smHandle_)) return smHandle_.rb;
+  if(in(retired_)) return retired_.rb;
+  for(auto &handle : held_)
+  {
+    if(in(handle)) return handle.rb;
+  }
+  return nullptr;
+}
+
+// drop: unmap and remove a ring we moved away from
+void SharedMemoryProducer::drop(ShMHandle *_handle)
+{
+  holds_.erase(_handle->rb);
+  std::string name = _handle->name;
+  shm_close(_handle);
+  shm_remove(name.c_str());
+}
+
+// beginRecord: stream rings. Room for a _size bytes record at the write position, the tail of the slot is
+// padded when the record does not fit before its end. Fill it and commitRecord
+unsigned char * SharedMemoryProducer::beginRecord(int _size)
+{
+  RingBuffer *rb = smHandle_.rb;
+  if(!rb || rb->mode != SHM_MODE_STREAM) return nullptr;
+
+  long long capacity = rb->size;
+  long long need = shm_recordsize(_size);
+  if(need > capacity / 2) return nullptr;
+
+  long long pos = rb->wseq;
+  long long offset = pos % capacity;
+  long long pad = (offset + need > capacity)? capacity - offset : 0;
+  if(!waitReaders(&smHandle_, pad + need)) return nullptr;
+
+  // readers still copying what we are about to write over see it in wbegin (shm_stream_valid)
+  unsigned char *data = shm_getmessagedata(rb, &rb->buffer[0]);
+  shm_message_begin(&rb->buffer[0], pos + pad + need);
+  if(pad > 0)
+  {
+    ShMRecord *padRecord = (ShMRecord *) (data + offset);
+    padRecord->size = -1;
+    padRecord->pos = pos;
+    pos += pad;
+    offset = 0;
+  }
+
+  ShMRecord *record = (ShMRecord *) (data + offset);
+  record->size = _size;
+  record->pos = pos;
+  recordPos_ = pos;
+  recordBytes_ = pad + need;
+  recordSize_ = _size;
+  return (unsigned char *) (record + 1);
+}
+
+bool SharedMemoryProducer::commitRecord()
+{
+  RingBuffer *rb = smHandle_.rb;
+  if(!rb || recordPos_ < 0) return false;
+
+  // stats. Overrun when a live reader is more than the slot behind
+  long long slowest = shm_slowest_reader(&smHandle_);
+  if(slowest >= 0 && (rb->wseq + recordBytes_ - slowest) > (long long) rb->size)
+  {
+    shm_stat_add(&rb->stats.overruns, 1);
+  }
+  shm_stat_add(&rb->stats.writes, 1);
+  shm_stat_add(&rb->stats.bytes, recordSize_);
+  rb->stats.lastWrite = shm_timestamp();
+  rb->heartbeat = rb->stats.lastWrite;
+
+  rb->buffer[0].seq = recordPos_;
+  rb->buffer[0].size = recordSize_;
+  recordPos_ = -1;
+  return shm_write_advance(&smHandle_, recordBytes_);
+}
+
+bool SharedMemoryProducer::publish(Message *_msg, int _dataSize)
+{
+  RingBuffer *rb = smHandle_.rb;
+  long long wseq = rb->wseq;
+
+  // stats. The slot held wseq - count, overrun when a live reader had not got to it
+  if(wseq >= rb->count)
+  {
+    long long slowest = shm_slowest_reader(&smHandle_);
+    if(slowest >= 0 && slowest <= wseq - rb->count)
+    {
+      shm_stat_add(&rb->stats.overruns, 1);
+    }
+  }
+  shm_stat_add(&rb->stats.writes, 1);
+  shm_stat_add(&rb->stats.bytes, _dataSize);
+  rb->stats.lastWrite = shm_timestamp();
+  rb->heartbeat = rb->stats.lastWrite;
+
   if(smMessageID_ == 0) smMessageID_++;
-  msg->id = smMessageID_++;
+  _msg->id = smMessageID_++;
+  _msg->size = _dataSize;
+  _msg->seq = wseq;
   return shm_write_increment(&smHandle_);
 }
 
-void SharedMemoryProducer::keepAliveThreadFunc()
+// waitReaders: lossless policy. Do not write over a message (stream rings: the next _bytes) the slowest
+// reader has not read yet. Readers that stop renewing their lease are expired, so a crashed consumer can not
+// block us forever
+bool SharedMemoryProducer::waitReaders(ShMHandle *_handle, long long _bytes)
 {
-  running_ = true;
-  while(running_)
+  RingBuffer *rb = _handle->rb;
+  if(rb->policy != SHM_POLICY_LOSSLESS) return true;
+
+  for(bool stalled = false; ; stalled = true)
   {
-    smHandle_.rb->keepAlive++;
-    std::this_thread::sleep_for(1s);
+    long long slowest = shm_slowest_reader(_handle);
+    bool room = (rb->mode == SHM_MODE_STREAM)? (rb->wseq + _bytes - slowest) <= (long long) rb->size : (rb->wseq - slowest) < rb->count;
+    if(slowest < 0 || room)
+    {
+      return true;
+    }
+    if(!stalled)
+    {
+      shm_stat_add(&rb->stats.stalls, 1);
+    }
+    // readers wake us as they move on. Bounded by the lease timeout, the next round expires a dead reader
+    shm_wait_readers(_handle, slowest, (int) (READER_LEASE_TIMEOUT / 1000000));
   }
-}
\ No newline at end of file
+}
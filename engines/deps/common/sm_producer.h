@@ -1,11 +1,16 @@
 #pragma once
 
 #include <string>
+#include <algorithm>
+#include <vector>
+#include <map>
 #include <thread>
+#include <mutex>
 #include "shmhelper.h"
 
 #define DEFAULT_SMELEM_SIZE (8 * 1024 * 1024)
 #define DEFAULT_SM_SIZE 4
+#define DEFAULT_SM_PINNED 0                 // spare slots standing in for slots consumers keep frames in (more on request)
 
 // SharedMemoryProducer
 class SharedMemoryProducer
@@ -14,17 +19,60 @@ public:
   SharedMemoryProducer();
   virtual ~SharedMemoryProducer();
 
-  virtual bool init(const char *_id, int _size = DEFAULT_SMELEM_SIZE, int _count = DEFAULT_SM_SIZE);
+  virtual bool init(const char *_id, int _size = DEFAULT_SMELEM_SIZE, int _count = DEFAULT_SM_SIZE, int _policy = SHM_POLICY_LATEST);
   virtual bool deinit();
   bool write(const unsigned char *_data, int _dataSize);
 
+  // in place write: acquire the next slot, fill it and commit
+  unsigned char * acquire(int *_capacity = nullptr);
+  bool commit(int _dataSize);
+
+  // spare slot handed out (i.e. to a decoder) until it is committed or released
+  unsigned char * reserve(int *_capacity = nullptr);
+  bool commit(const unsigned char *_reserved, int _dataSize);
+  void release(const unsigned char *_reserved);
+
+  // stream ring (SHM_MODE_STREAM): records of any size back to back in one slot of _size bytes. Set before init
+  void setStream(bool _stream) { stream_ = _stream; }
+  bool stream() { return stream_; }
+  unsigned char * beginRecord(int _size);
+  bool commitRecord();
+
+  // best effort ring (i.e. renditions written along the main one): never goes lossless offline. Set before init
+  void setBestEffort(bool _bestEffort) { bestEffort_ = _bestEffort; }
+
+  // slots consumers can pin (keep frames in) before the producer writes over pinned ones. Takes effect on init,
+  // consumers asking for more get them on the next remap
+  void setPinLimit(int _pinned) { pinned_ = _pinned; }
+  bool pinsRequested() { return !stream_ && ctlHandle_.ctl && (std::min((int) ctlHandle_.ctl->pins, SHM_MAX_PINNED) > pinned_); }
+
+  // new ring with a different slot size (format change). Consumers follow it
+  bool remap(int _size);
+  int capacity() { return smHandle_.rb? (int) smHandle_.rb->size : 0; }
+  long long epoch() { return ctlHandle_.ctl? ctlHandle_.ctl->epoch : -1; }
+
 protected:
-  void keepAliveThreadFunc();
+  bool publish(Message *_msg, int _dataSize);
+  bool waitReaders(ShMHandle *_handle, long long _bytes = 0);
+  RingBuffer * ringOf(const unsigned char *_slot);
+  void drop(ShMHandle *_handle);
 
 protected:
   std::string ID_;
-  ShMHandle smHandle_ = {};
+  int count_ = DEFAULT_SM_SIZE;
+  int policy_ = SHM_POLICY_LATEST;
+  int pinned_ = DEFAULT_SM_PINNED;
+  bool stream_ = false;
+  bool bestEffort_ = false;
+  long long recordPos_ = -1;                  // stream: record being written, bytes it takes (pad included)
+  long long recordBytes_ = 0;
+  int recordSize_ = 0;
+  ShMControlHandle ctlHandle_ = {};           // control segment (ID), current ring epoch
+  ShMHandle smHandle_ = {};                   // current ring (ID#epoch)
+  ShMHandle retired_ = {};                    // previous ring, kept mapped until the next remap
+  std::vector<ShMHandle> held_;               // older rings the decoder still has reserved slots of
+  std::map<RingBuffer *, int> holds_;         // reserved slots handed out and not released, per ring
   unsigned long long smMessageID_ = 0;
-  bool running_ = false;
-  std::thread workerThread_;
+  const unsigned char *reserved_ = nullptr;   // spare slot currently handed out
+  std::mutex reserveMutex_;
 };
\ No newline at end of file
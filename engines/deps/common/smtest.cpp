@@ -0,0 +1,457 @@
+/*
+ * smtest: checks of the shared memory transport that run without FFmpeg. Each check uses rings of its own
+ * g++ -std=c++14 -I./ -o smtest smtest.cpp sm_producer.cpp sm_consumer.cpp shmhelper.linux.cpp fastcopy.cpp frame_pacer.cpp -lrt -lpthread
+ * smtest [check ...]   (no check: all of them, exit code 1 when one failed)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include "sm_producer.h"
+#include "sm_consumer.h"
+#include "spsc_queue.h"
+#include "frame_pacer.h"
+#include "clock.h"
+
+using namespace std::chrono_literals;
+
+static std::atomic<int> failed { 0 };
+
+#define CHECK(_cond) do { if(!(_cond)) { printf("  failed: %s (line %d)\n", #_cond, __LINE__); failed++; } } while(0)
+
+// Peek: consumer with its internals in reach. Retired rings are kept mapped (as zero copy consumers do)
+// until release()
+class Peek : public SharedMemoryConsumer
+{
+public:
+  const unsigned char * data() { return data_; }
+  long long value() { return *(const long long *) data_; }
+  RingBuffer * ring() { return smHandle_.rb; }
+  void release()
+  {
+    for(auto &handle : kept_) shm_close(&handle);
+    kept_.clear();
+  }
+  size_t kept() { return kept_.size(); }
+
+protected:
+  void retire(ShMHandle *_handle) override
+  {
+    if(_handle->rb) kept_.push_back(*_handle);
+    *_handle = ShMHandle();
+  }
+
+protected:
+  std::vector<ShMHandle> kept_;
+};
+
+static bool put(SharedMemoryProducer *_producer, long long _value)
+{
+  return _producer->write((const unsigned char *) &_value, sizeof(_value));
+}
+
+// done: producer gone for good, its control segment too
+static void done(SharedMemoryProducer *_producer, const char *_id)
+{
+  _producer->deinit();
+  shm_remove(_id);
+}
+
+// lossless: a slow reader holds the producer back, every message arrives in order. Reserved slots
+// (decoding straight into the ring) go through the same backpressure
+static void lossless()
+{
+  const char *id = "SMTEST_LOSSLESS";
+  const long long count = 500;
+  SharedMemoryProducer p;
+  CHECK(p.init(id, 4096, 4, SHM_POLICY_LOSSLESS));
+  Peek c;
+  CHECK(c.init(id, 100));
+
+  std::thread writer([&] {
+    for(long long i = 0; i < count; i++)
+    {
+      if(i & 1)
+      {
+        CHECK(put(&p, i));
+        continue;
+      }
+      unsigned char *slot = p.reserve();
+      CHECK(slot != nullptr);
+      if(!slot) continue;
+      memcpy(slot, &i, sizeof(i));
+      CHECK(p.commit(slot, sizeof(i)));
+    }
+  });
+
+  long long expected = 0;
+  long long deadline = shm_timestamp() + 5000000000LL;
+  while(expected < count && shm_timestamp() < deadline)
+  {
+    if(!c.read())
+    {
+      c.wait(100);
+      continue;
+    }
+    CHECK(c.value() == expected);
+    expected = c.value() + 1;
+    if(expected % 50 == 0) std::this_thread::sleep_for(2ms);
+  }
+  writer.join();
+
+  CHECK(expected == count);
+  CHECK(c.dropped() == 0);
+  CHECK(c.ring()->stats.stalls > 0);
+
+  // a full ring holds the producer until we read, its oldest message intact
+  for(long long i = 0; i < 4; i++) CHECK(put(&p, count + i));
+  long long wseq = c.ring()->wseq;
+  std::thread blocked([&] { CHECK(put(&p, count + 4)); });
+  std::this_thread::sleep_for(50ms);
+  CHECK(c.ring()->wseq == wseq);
+  CHECK(c.read() && c.value() == count);
+  blocked.join();
+  CHECK(c.ring()->wseq == wseq + 1);
+  CHECK(c.dropped() == 0);
+  c.deinit();
+
+  c.release();
+  done(&p, id);
+}
+
+// torn: zero copy views of a slot the producer writes over (or is writing) stop being valid
+static void torn()
+{
+  const char *id = "SMTEST_TORN";
+  SharedMemoryProducer p;
+  CHECK(p.init(id, 4096, 4));
+  Peek c;
+  CHECK(c.init(id, 100));
+
+  CHECK(put(&p, 1));
+  long long seq = -1;
+  const unsigned char *data = c.view(&seq);
+  CHECK(data && *(const long long *) data == 1);
+  CHECK(c.valid(seq));
+
+  // the slot comes round again after count messages
+  for(long long i = 2; i <= 4; i++) CHECK(put(&p, i));
+  CHECK(c.valid(seq));
+  unsigned char *next = p.acquire();
+  CHECK(next != nullptr);
+  CHECK(!c.valid(seq));
+  long long value = 5;
+  memcpy(next, &value, sizeof(value));
+  CHECK(p.commit(sizeof(value)));
+  CHECK(!c.valid(seq));
+
+  // copies keep the newest message, intact
+  CHECK(c.read() && c.value() == 5);
+
+  c.deinit();
+  c.release();
+  done(&p, id);
+}
+
+// Held: producer with the rings the decoder still holds reserved slots of in reach
+class Held : public SharedMemoryProducer
+{
+public:
+  size_t held() { return held_.size(); }
+};
+
+// remap: pinned zero copy frames stay intact and mapped while the producer moves on to new rings, reserved
+// slots of rings the producer moved away from stay mapped until they are released
+static void remap()
+{
+  const char *id = "SMTEST_REMAP";
+  Held p;
+  p.setPinLimit(2);
+  CHECK(p.init(id, 4096, 4));
+  Peek c;
+  CHECK(c.init(id, 100));
+
+  CHECK(put(&p, 7));
+  long long seq = -1;
+  const unsigned char *data = c.view(&seq);
+  CHECK(data != nullptr);
+  RingBuffer *rb = c.ring();
+  int slot = -1;
+  long long stamp = shm_pin(rb, seq, &slot);
+  CHECK(stamp >= 0);
+
+  // producer laps the pinned slot
+  for(long long i = 0; i < 8; i++) CHECK(put(&p, 100 + i));
+  CHECK(data && *(const long long *) data == 7);
+  CHECK(shm_pin_valid(rb, slot, stamp));
+
+  // two format changes, the consumer follows both
+  unsigned char *reserved = p.reserve();
+  CHECK(reserved != nullptr);
+  CHECK(p.remap(8192));
+  CHECK(put(&p, 8));
+  CHECK(c.read() && c.value() == 8);
+  CHECK(p.remap(16384));
+  CHECK(put(&p, 9));
+  CHECK(c.read() && c.value() == 9);
+  CHECK(c.ring() != rb);
+  CHECK(c.kept() == 1);
+
+  CHECK(data && *(const long long *) data == 7);
+  CHECK(shm_pin_valid(rb, slot, stamp));
+  shm_unpin(rb, slot);
+
+  // the decoder still references the slot it got two rings ago
+  CHECK(p.held() == 1);
+  if(reserved) reserved[0] = 1;
+  p.release(reserved);
+  CHECK(p.held() == 0);
+
+  c.deinit();
+  c.release();
+  done(&p, id);
+}
+
+// restart: a consumer left behind by its producer picks up the next producer of the same ID by itself
+static void restart()
+{
+  const char *id = "SMTEST_RESTART";
+  Peek c;
+  {
+    SharedMemoryProducer p;
+    CHECK(p.init(id, 4096, 4));
+    CHECK(c.init(id, 100));
+    CHECK(put(&p, 1));
+    CHECK(c.read() && c.value() == 1);
+    p.deinit();
+  }
+  CHECK(!c.read());
+  CHECK(!c.opened());
+
+  SharedMemoryProducer p;
+  CHECK(p.init(id, 8192, 4));
+  CHECK(put(&p, 2));
+  bool ok = false;
+  long long deadline = shm_timestamp() + 1000000000LL;
+  while(!ok && shm_timestamp() < deadline)
+  {
+    ok = c.read();
+    if(!ok) c.wait(100);
+  }
+  CHECK(ok && c.value() == 2);
+  CHECK(c.opened());
+
+  c.deinit();
+  c.release();
+  done(&p, id);
+}
+
+// stream: records of a stream ring come back in order across the end of the slot (pad records), a lapped
+// reader loses what was written over and resyncs on the newest record
+static void stream()
+{
+  const char *id = "SMTEST_STREAM";
+  SharedMemoryProducer p;
+  p.setStream(true);
+  CHECK(p.init(id, 4096, 1));
+  Peek c;
+  CHECK(c.init(id, 100));
+  CHECK(c.stream());
+
+  long long next = 0;
+  auto write = [&](int _records) {
+    for(int i = 0; i < _records; i++, next++)
+    {
+      unsigned char *record = p.beginRecord(300);
+      CHECK(record != nullptr);
+      if(!record) return;
+      memcpy(record, &next, sizeof(next));
+      CHECK(p.commitRecord());
+    }
+  };
+  auto read = [&](long long *_first) {
+    int size = c.drain();
+    int records = 0;
+    for(int pos = 0; pos < size; records++)
+    {
+      const ShMRecord *record = (const ShMRecord *) (c.data() + pos);
+      long long value = *(const long long *) (record + 1);
+      if(records == 0) *_first = value;
+      CHECK(value == *_first + records);
+      pos += shm_recordsize(record->size);
+    }
+    return records;
+  };
+
+  // many wraps, read often enough
+  long long first = -1;
+  for(int round = 0; round < 20; round++)
+  {
+    write(5);
+    CHECK(read(&first) == 5);
+    CHECK(first == next - 5);
+  }
+  CHECK(c.dropped() == 0);
+
+  // lapped
+  write(40);
+  int records = read(&first);
+  CHECK(c.dropped() > 0);
+  CHECK(records > 0 && first + records == next);
+
+  c.deinit();
+  c.release();
+  done(&p, id);
+}
+
+// Counters: queue with its head and tail counters in reach, to start them just before they wrap
+class Counters : public SPSCQueue<long long>
+{
+public:
+  Counters(int _capacity) : SPSCQueue<long long>(_capacity) { }
+  void start(size_t _at) { head_ = _at; tail_ = _at; }
+};
+
+// spsc: SPSCQueue full and empty across the index wrap (and the counter wrap), then in order across threads
+// with the stages blocking on their signals
+static void spsc()
+{
+  Counters q(5);
+  CHECK(q.capacity() == 8);
+  q.start((size_t) -5);
+  long long value = 0;
+  for(long long round = 0; round < 4; round++)
+  {
+    for(long long i = 0; i < 8; i++) CHECK(q.push(round * 8 + i));
+    CHECK(!q.push(-1));
+    CHECK(q.size() == 8);
+    for(long long i = 0; i < 8; i++) CHECK(q.pop(&value) && value == round * 8 + i);
+    CHECK(!q.pop(&value));
+  }
+
+  SPSCQueue<long long> queue(4);
+  SPSCSignal pushed, popped;
+  queue.setSignals(&pushed, &popped);
+  const long long count = 200000;
+  long long sum = 0;
+  bool ordered = true;
+  std::thread consumer([&] {
+    for(long long expected = 0, round = 0; expected < count; )
+    {
+      unsigned long long sample = pushed.sample();
+      long long item;
+      if(queue.pop(&item))
+      {
+        ordered = ordered && (item == expected);
+        sum += item;
+        expected++;
+        round = 0;
+        continue;
+      }
+      spsc_backoff((int) round++, &pushed, sample);
+    }
+  });
+  for(long long i = 0, round = 0; i < count; )
+  {
+    unsigned long long sample = popped.sample();
+    if(queue.push(i))
+    {
+      i++;
+      round = 0;
+      if(i % 50000 == 0) std::this_thread::sleep_for(2ms);
+      continue;
+    }
+    spsc_backoff((int) round++, &popped, sample);
+  }
+  consumer.join();
+  CHECK(ordered);
+  CHECK(sum == count * (count - 1) / 2);
+}
+
+// pacer: frame deadlines at 30000/1001 fps land on the exact rational schedule, no drift after hours of
+// frames. Run on the virtual clock (nothing sleeps). Locked to a house clock at that rate, aligned deadlines
+// are house ticks
+static void pacer()
+{
+  Clock &clock = Clock::instance();
+  clock.setVirtual(true);
+  FramePacer pacer;
+
+  pacer.wait(1001, 30000);
+  CHECK(clock.elapsed() == 33366666LL);
+  pacer.wait(1001, 30000);
+  pacer.wait(1001, 30000);
+  CHECK(clock.elapsed() == 100100000LL);
+
+  // one hour and then some: 30000 frames take 1001 s exactly
+  for(int i = 3; i < 30000 * 4; i++) pacer.wait(1001, 30000);
+  CHECK(clock.elapsed() == 4 * 1001000000000LL);
+
+  // rate change: the new schedule starts where the last frame ended
+  for(int i = 0; i < 25; i++) pacer.wait(1, 25);
+  CHECK(clock.elapsed() == 4 * 1001000000000LL + 1000000000LL);
+  clock.setVirtual(false);
+
+  // house clock, only while nobody else on the host is its master
+  ShMClockHandle house = shm_clock_open();
+  long long anchor = shm_timestamp();
+  if(!shm_clock_claim(&house, 30000, 1001, anchor))
+  {
+    printf("  house clock has a master, alignment not checked\n");
+    shm_clock_close(&house);
+    return;
+  }
+  int rateNum = 0, rateDen = 0;
+  shm_clock_read(&house, &rateNum, &rateDen, &anchor);
+  long long phase = 1000000;
+  CHECK(FramePacer::houseAlign(anchor, phase) == anchor + phase);
+  for(long long k = 1; k < 100000; k += 997)
+  {
+    long long tick = anchor + phase + (k * 1001 / 30000) * 1000000000LL + ((k * 1001) % 30000) * 1000000000LL / 30000;
+    CHECK(FramePacer::houseAlign(tick, phase) == tick);
+    CHECK(FramePacer::houseAlign(tick - 1, phase) == tick);
+    CHECK(FramePacer::houseAlign(tick + 1, phase) > tick);
+  }
+  shm_clock_release(&house);
+  shm_clock_close(&house);
+}
+
+struct Check
+{
+  const char *name;
+  void (*run)();
+};
+
+static const Check checks[] = {
+  { "lossless", lossless },
+  { "torn", torn },
+  { "remap", remap },
+  { "restart", restart },
+  { "stream", stream },
+  { "spsc", spsc },
+  { "pacer", pacer },
+};
+
+int main(int argc, char *argv[])
+{
+  for(auto &check : checks)
+  {
+    bool selected = (argc < 2);
+    for(int i = 1; i < argc; i++)
+    {
+      if(strcmp(argv[i], check.name) == 0) selected = true;
+    }
+    if(!selected) continue;
+
+    int before = failed.load();
+    printf("%s\n", check.name);
+    check.run();
+    printf("  %s\n", (failed == before)? "ok" : "FAILED");
+  }
+
+  return (failed == 0)? 0 : 1;
+}
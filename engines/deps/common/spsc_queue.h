@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#define SPSC_WAIT_TIMEOUT 10000000LL        // ns a stage blocks at most before it looks at its abort flag again
+
+// SPSCSignal: where a stage thread blocks once spinning and yielding found nothing to do. Queues notify the stage
+// on the other end (see SPSCQueue::setSignals), the mutex is only taken when the stage actually sleeps. Sample
+// before looking at the queues, wait with the sample: a notify in between is never lost
+class SPSCSignal
+{
+public:
+  unsigned long long sample() const { return seq_.load(); }
+
+  void notify()
+  {
+    seq_.fetch_add(1);
+    if(waiters_.load() > 0)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cond_.notify_all();
+    }
+  }
+
+  // wait: until notified after _sample or _timeout ns. True when notified
+  bool wait(unsigned long long _sample, long long _timeout = SPSC_WAIT_TIMEOUT)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiters_.fetch_add(1);
+    bool ret = cond_.wait_for(lock, std::chrono::nanoseconds(_timeout), [&] { return seq_.load() != _sample; });
+    waiters_.fetch_sub(1);
+    return ret;
+  }
+
+protected:
+  std::atomic<unsigned long long> seq_ { 0 };
+  std::atomic<int> waiters_ { 0 };
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+// SPSCQueue: bounded lock free queue between one producer thread and one consumer thread. Capacity is rounded
+// up to a power of two. The producer only writes tail_, the consumer only head_, each on its own cache line
+template <typename T>
+class SPSCQueue
+{
+public:
+  SPSCQueue(int _capacity = 16) { resize(_capacity); }
+
+  // resize: empties the queue. Only while neither side uses it
+  void resize(int _capacity)
+  {
+    size_t capacity = 2;
+    while(capacity < (size_t) _capacity) capacity <<= 1;
+    items_.assign(capacity, T());
+    mask_ = capacity - 1;
+    head_ = 0;
+    tail_ = 0;
+  }
+
+  // setSignals: stage woken by a push (consumer side) and the one woken by a pop (producer side), null: none
+  void setSignals(SPSCSignal *_pushed, SPSCSignal *_popped)
+  {
+    pushed_ = _pushed;
+    popped_ = _popped;
+  }
+
+  // push: producer side, false when full
+  bool push(const T &_item)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if(tail - head_.load(std::memory_order_acquire) > mask_) return false;
+    items_[tail & mask_] = _item;
+    tail_.store(tail + 1, std::memory_order_release);
+    if(pushed_) pushed_->notify();
+    return true;
+  }
+
+  // pop: consumer side, false when empty
+  bool pop(T *_item)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if(head == tail_.load(std::memory_order_acquire)) return false;
+    *_item = items_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    if(popped_) popped_->notify();
+    return true;
+  }
+
+  // peek: consumer side, the next item without taking it
+  bool peek(T *_item) const
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if(head == tail_.load(std::memory_order_acquire)) return false;
+    *_item = items_[head & mask_];
+    return true;
+  }
+
+  int size() const { return (int) (tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire)); }
+  int capacity() const { return (int) (mask_ + 1); }
+
+protected:
+  std::vector<T> items_;
+  size_t mask_ = 0;
+  SPSCSignal *pushed_ = nullptr;
+  SPSCSignal *popped_ = nullptr;
+  alignas(64) std::atomic<size_t> head_ { 0 };   // next pop, consumer
+  alignas(64) std::atomic<size_t> tail_ { 0 };   // next push, producer
+};
+
+// spsc_backoff: waiting side of a queue (full on push, empty on pop). Spins, yields, then blocks on the stage
+// _signal sampled (_sample) before the queues were looked at
+__inline void spsc_backoff(int _round, SPSCSignal *_signal, unsigned long long _sample)
+{
+  if(_round < 16) return;
+  if(_round < 64)
+  {
+    std::this_thread::yield();
+    return;
+  }
+  _signal->wait(_sample);
+}
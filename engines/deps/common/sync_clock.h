@@ -5,6 +5,7 @@
 
 using namespace std::chrono_literals;
 
+// SyncClock: tick rate (fps) counter. Loops are paced by FramePacer
 class SyncClock
 {
 public:
@@ -34,29 +35,6 @@ public:
     }
   }
 
-  void sync(long long _frameDurationIn100ns)
-  {
-    if(startTime_ != -1)
-    {
-      // elapsed
-      long long endTime = startTime_ + (_frameDurationIn100ns * 100);  
-      long long now = Clock::instance().elapsed();
-      long long sleepPrec = 5000000LL;
-      while(endTime > now)
-      {
-        if((endTime - now) > sleepPrec)
-        {
-          std::this_thread::sleep_for(1ms);
-        }
-        now = Clock::instance().elapsed();
-      }          
-    }
-      
-    ticks();
-
-    startTime_ = Clock::instance().elapsed();
-  }
-
   void ticks()
   {
     long long elapsed = 0;
@@ -91,5 +69,4 @@ protected:
   int ticks_ = 0;
   long long lastTickTime_ = -1;
   double ticksPerSecond_ = 0.;
-  long long startTime_ = -1;
 };
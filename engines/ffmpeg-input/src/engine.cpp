@@ -6,7 +6,8 @@
 #include <iomanip>
 #include "engine.h"
 #include "notifier.h"
-#include "sync_clock.h"
+#include "frame_pacer.h"
+#include "clock.h"
 #include "SDLRenderer.h"
 #include "FFMPEG_sm_producer.h"
 #include "FFMPEG_utils.h"
@@ -306,7 +307,17 @@ FFMPEGInputEngine::~FFMPEGInputEngine()
 // abort
 bool FFMPEGInputEngine::abort()
 {
-  abort_ = true;
+  {
+    std::lock_guard<std::mutex> lock(readerMutex_);
+    abort_ = true;
+
+    // stages blocked on their signals see the flag right away
+    demuxSignal_.notify();
+    for(auto &signal : decodeSignals_) signal.notify();
+    publishSignal_.notify();
+    previewSignal_.notify();
+  }
+  readerCond_.notify_all();
   return true;
 }
 
@@ -340,7 +351,7 @@ bool FFMPEGInputEngine::putCommand(const char *_JsonCommand)
         if(p.HasMember(URL) && p[URL].IsString())
         {
           url_ = p[URL].GetString();
-          openReader_ = true;
+          setOpenReader(true);
           notifyInfo("New command received: %s %s", command.c_str(), url_.c_str());
         }
       }
@@ -429,6 +440,63 @@ bool FFMPEGInputEngine::loadConfiguration(const char *_JsonConfig)
     {
       timeoutOpen_ = std::stoi(extraParams_["timeout"]);
     }
+
+    if(extraParams_.find("sm_policy") != extraParams_.end())
+    {
+      smPolicy_ = (extraParams_["sm_policy"] == "lossless")? SHM_POLICY_LOSSLESS : SHM_POLICY_LATEST;
+    }
+
+    if(extraParams_.find("sm_crc") != extraParams_.end())
+    {
+      smIntegrity_ = std::stoi(extraParams_["sm_crc"]) != 0;
+    }
+
+    if(extraParams_.find("sm_pins") != extraParams_.end())
+    {
+      smPins_ = std::stoi(extraParams_["sm_pins"]);
+    }
+
+    if(extraParams_.find("sm_packets") != extraParams_.end())
+    {
+      smPackets_ = extraParams_["sm_packets"];
+    }
+
+    if(extraParams_.find("sm_decode") != extraParams_.end())
+    {
+      smDecode_ = std::stoi(extraParams_["sm_decode"]) != 0;
+    }
+
+    if(extraParams_.find("house_clock") != extraParams_.end())
+    {
+      housePhase_ = std::stoi(extraParams_["house_clock"]);
+    }
+
+    if(extraParams_.find("frame_queue") != extraParams_.end())
+    {
+      frameDrop_ = (extraParams_["frame_queue"] == "drop");
+    }
+
+    if(extraParams_.find("thread_count") != extraParams_.end())
+    {
+      threadCount_ = std::stoi(extraParams_["thread_count"]);
+    }
+
+    if(extraParams_.find("thread_type") != extraParams_.end())
+    {
+      std::string threadType = extraParams_["thread_type"];
+      threadType_ = ((threadType.find("frame") != std::string::npos)? FF_THREAD_FRAME : 0) |
+                    ((threadType.find("slice") != std::string::npos)? FF_THREAD_SLICE : 0);
+    }
+
+    if(extraParams_.find("playout") != extraParams_.end())
+    {
+      playout_ = std::stoi(extraParams_["playout"]);
+    }
+
+    if(extraParams_.find("loop") != extraParams_.end())
+    {
+      loop_ = std::stoi(extraParams_["loop"]) != 0;
+    }
   }
 
   return true;
@@ -497,7 +565,11 @@ bool FFMPEGInputEngine::run(const char *_JsonConfig)
 
   // frame count and clock
   int64_t frameCount = 0;
-  SyncClock clock;
+  FramePacer pacer;
+  if(housePhase_ >= 0 && !pacer.lock(housePhase_ * 1000000LL))
+  {
+    notifyWarning("House clock not available, free running");
+  }
 
   // renderer
   SDLRenderer renderer;
@@ -505,74 +577,40 @@ bool FFMPEGInputEngine::run(const char *_JsonConfig)
   renderer.init(title.c_str(), 320, 240, 12, previewWindow_);
 
   // sm protocol
-  FFMPEGSharedMemoryProducer sm;
-  sm.init(UID_.c_str());
+  sm_.setIntegrity(smIntegrity_);
+  sm_.setPinLimit(smPins_);
+  sm_.setFrameRate(frameRate_.num, frameRate_.den);
+  sm_.init(UID_.c_str(), FFMPEGSharedMemoryProducer::slotSize(width_, height_, pixelFormat_), DEFAULT_SM_SIZE, smPolicy_);
+
+  // offline: every frame of the input once, as fast as consumers take them
+  bool offline = Clock::instance().isVirtual();
 
   while(!abort_)
   {
     if(!openReader_)
     {
-      AVPacket *packet = av_packet_alloc();
-      AVFrame *frame = av_frame_alloc();
-
-      while(av_read_frame(formatCtx_, packet) >= 0 && !abort_)
+      // offline: first frame waits for its consumer
+      if(offline && !sm_.waitConsumer(timeoutOpen_ * 1000))
       {
-        if( (packet->stream_index >= 0) && (packet->stream_index < codecCtxs_.size()) )
-        {
-          AVCodecContext *codecCtx = codecCtxs_[packet->stream_index];
-          if(codecCtx)
-          {
-            // Decode video frame
-            int ret = avcodec_send_packet(codecCtx, packet);
-            if(ret < 0)
-            {
-              notifyError("Error sending packet for decoding: %s", url_.c_str());
-              break;
-            }
+        notifyWarning("No consumer after %d s, offline run starts anyway", timeoutOpen_);
+      }
 
-            while(ret >= 0)
-            {
-              ret = avcodec_receive_frame(codecCtx, frame);
-              if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-              {
-                break;
-              }
-              else if(ret < 0)
-              {
-                notifyError("Error during decoding: %s", url_.c_str());
-                break;
-              }
-
-              // frame
-              AVFrameExt frameExt = { formatCtx_->streams[packet->stream_index]->time_base,
-                                      formatCtx_->streams[packet->stream_index]->codecpar->field_order,
-                                      formatCtx_->streams[packet->stream_index]->codecpar->codec_type, 
-                                      packet->stream_index, frame, nullptr };
-              // sm producer
-              sm.write(&frameExt);
-
-              // preview
-              if(previewWindow_ && (formatCtx_->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) )
-              {
-                renderer.render(frameExt.AVFrame);
-              }
-            }
-          }
-          else
-          {
-            AVFrameExt frameExt = { formatCtx_->streams[packet->stream_index]->time_base,
-                                    formatCtx_->streams[packet->stream_index]->codecpar->field_order,
-                                    formatCtx_->streams[packet->stream_index]->codecpar->codec_type,
-                                    packet->stream_index, nullptr, packet };          
-            // sm producer
-            sm.write(&frameExt);
-          }
-        }      
-        av_packet_unref(packet);
-      }    
-      av_packet_free(&packet);
-      av_frame_free(&frame);
-      openReader_ = true;
+      // demux, decode and publish until the stream ends
+      runPipeline(&renderer);
+      setOpenReader(true);
+
+      // offline: end of input ends the run
+      if(offline)
+      {
+        notifyInfo("End of input, offline run done: %s", url_.c_str());
+        abort_ = true;
+      }
+    }
+    else if(offline)
+    {
+      // no filler frames offline, wait for the stream
+      std::unique_lock<std::mutex> lock(readerMutex_);
+      readerCond_.wait(lock, [&] { return !openReader_ || abort_; });
     }
     else
     {
@@ -591,13 +629,15 @@ bool FFMPEGInputEngine::run(const char *_JsonConfig)
       frameCount++;
 
       // internal struct
-      AVFrameExt frameExt = { videoTimeBase, fieldOrder_, AVMEDIA_TYPE_VIDEO, 0, videoFrame };
-
-      // duration
-      long long frd = frameDuration(&frameExt);
+      AVFrameExt frameExt;
+      frameExt.timeBase = videoTimeBase;
+      frameExt.fieldOrder = fieldOrder_;
+      frameExt.mediaType = AVMEDIA_TYPE_VIDEO;
+      frameExt.streamIndex = 0;
+      frameExt.AVFrame = videoFrame;
 
       // sm producer
-      sm.write(&frameExt);
+      sm_.write(&frameExt);
 
       // preview
       if(previewWindow_)
@@ -605,8 +645,11 @@ bool FFMPEGInputEngine::run(const char *_JsonConfig)
         renderer.render(frameExt.AVFrame);
       }
 
-      // sync    
-      clock.sync(frd);
+      // pace, absolute deadlines
+      AVRational period = framePeriod(&frameExt);
+      pacer.wait(period.num, period.den);
+      std::string report = pacer.report();
+      if(!report.empty()) notifyInfo("Pacer %s", report.c_str());
     }
   }
 
@@ -622,7 +665,7 @@ bool FFMPEGInputEngine::run(const char *_JsonConfig)
   av_free(audioBuffer);
 
   // shared memory
-  sm.deinit();
+  sm_.deinit();
 
   // worker thread
   if(workerThread.joinable())
@@ -633,9 +676,460 @@ bool FFMPEGInputEngine::run(const char *_JsonConfig)
   return true;
 }
 
+// passthrough: stream selected in sm_packets by index or media type ("video", "audio", "all")
+bool FFMPEGInputEngine::passthrough(int _streamIndex)
+{
+  if(smPackets_.empty()) return false;
+
+  const char *mediaType = av_get_media_type_string(formatCtx_->streams[_streamIndex]->codecpar->codec_type);
+  std::istringstream iss(smPackets_);
+  std::string token;
+  while(std::getline(iss, token, ','))
+  {
+    if( (token == "all") || (mediaType && token == mediaType) || (token == std::to_string(_streamIndex)) ) return true;
+  }
+  return false;
+}
+
+// decoded: stream with an open decoder whose frames are published (not passthrough only)
+bool FFMPEGInputEngine::decoded(int _streamIndex)
+{
+  return codecCtxs_[_streamIndex] && (smDecode_ || !passthrough(_streamIndex));
+}
+
+// runPipeline: stage threads for the open stream. This thread (SDL) shows the preview and reports stage
+// timing until the publisher is done, then every queue is emptied
+void FFMPEGInputEngine::runPipeline(SDLRenderer *_renderer)
+{
+  int streams = (int) formatCtx_->nb_streams;
+  std::vector<SPSCQueue<FFMPEGInputItem>>(streams).swap(packetQueues_);
+  std::vector<SPSCQueue<FFMPEGInputItem>>(streams).swap(frameQueues_);
+  std::vector<FFMPEGInputStage>(streams).swap(decodeStages_);
+  {
+    // abort() wakes them from another thread
+    std::lock_guard<std::mutex> lock(readerMutex_);
+    std::vector<SPSCSignal>(streams).swap(decodeSignals_);
+  }
+  for(int i = 0; i < streams; i++)
+  {
+    packetQueues_[i].resize(PACKET_QUEUE_SIZE);
+    frameQueues_[i].resize(FRAME_QUEUE_SIZE);
+    decodeStages_[i].name = "decode " + std::to_string(i);
+    // stages waiting on a queue are woken from its other end
+    packetQueues_[i].setSignals(&decodeSignals_[i], &demuxSignal_);
+    frameQueues_[i].setSignals(&publishSignal_, &decodeSignals_[i]);
+  }
+  passthroughQueue_.resize(PACKET_QUEUE_SIZE);
+  passthroughQueue_.setSignals(&publishSignal_, &demuxSignal_);
+  previewQueue_.resize(PREVIEW_QUEUE_SIZE);
+  previewQueue_.setSignals(&previewSignal_, nullptr);
+  demuxStage_.name = "demux";
+  publishStage_.name = "publish";
+  previewStage_.name = "preview";
+  demuxDone_ = false;
+  publishDone_ = false;
+
+  // playout: media clock from the file start, anchored with the first item released
+  playing_ = !Clock::instance().isVirtual() && ((playout_ > 0) || (playout_ < 0 && localFile()));
+  playoutOrigin_ = (formatCtx_->start_time != AV_NOPTS_VALUE)? av_rescale(formatCtx_->start_time, 1000000000LL, AV_TIME_BASE) : AV_NOPTS_VALUE;
+  playoutAnchor_ = -1;
+  publishNext_ = 0;
+
+  std::thread demuxThread(&FFMPEGInputEngine::demuxThreadFunc, this);
+  std::vector<std::thread> decodeThreads;
+  for(int i = 0; i < streams; i++)
+  {
+    if(decoded(i)) decodeThreads.push_back(std::thread(&FFMPEGInputEngine::decodeThreadFunc, this, i));
+  }
+  std::thread publishThread(&FFMPEGInputEngine::publishThreadFunc, this);
+
+  // preview: newest frames only, rendering never holds back the stages
+  for(int round = 0; !publishDone_; )
+  {
+    unsigned long long sample = previewSignal_.sample();
+    AVFrame *frame = nullptr;
+    if(previewQueue_.pop(&frame))
+    {
+      long long start = shm_timestamp();
+      _renderer->render(frame);
+      previewStage_.add(shm_timestamp() - start);
+      av_frame_free(&frame);
+      round = 0;
+    }
+    else
+    {
+      spsc_backoff(round++, &previewSignal_, sample);
+    }
+    reportPipeline(shm_timestamp());
+  }
+
+  demuxThread.join();
+  for(auto &thread : decodeThreads) thread.join();
+  publishThread.join();
+
+  // stages gone, whatever is left in the queues
+  FFMPEGInputItem item;
+  for(int i = 0; i < streams; i++)
+  {
+    while(packetQueues_[i].pop(&item)) freeItem(&item);
+    while(frameQueues_[i].pop(&item)) freeItem(&item);
+  }
+  while(passthroughQueue_.pop(&item)) freeItem(&item);
+  AVFrame *frame = nullptr;
+  while(previewQueue_.pop(&frame)) av_frame_free(&frame);
+}
+
+// demuxThreadFunc: packets to their decoder and, for passthrough streams, to the publisher. Ends every queue with
+// an end of stream item. Looping, the end of the file seeks back to the start: decoders flush and timestamps go
+// on from the end of the pass
+void FFMPEGInputEngine::demuxThreadFunc()
+{
+  AVPacket *packet = av_packet_alloc();
+  long long startTime = (formatCtx_->start_time != AV_NOPTS_VALUE)? av_rescale(formatCtx_->start_time, 1000000000LL, AV_TIME_BASE) : 0;
+  long long timeOffset = 0;
+  long long endTime = -1;         // media ns, end of the latest packet with its pass offset
+  while(!abort_)
+  {
+    long long start = shm_timestamp();
+    if(av_read_frame(formatCtx_, packet) < 0)
+    {
+      int64_t seekTime = (formatCtx_->start_time != AV_NOPTS_VALUE)? formatCtx_->start_time : 0;
+      if(!loop_ || endTime < 0 || av_seek_frame(formatCtx_, -1, seekTime, AVSEEK_FLAG_BACKWARD) < 0) break;
+      for(int i = 0; i < (int) packetQueues_.size(); i++)
+      {
+        FFMPEGInputItem item;
+        item.streamIndex = i;
+        item.timeOffset = timeOffset;
+        item.flush = true;
+        if(decoded(i)) pushItem(&packetQueues_[i], item, true, &demuxSignal_);
+      }
+      timeOffset = endTime - startTime;
+      endTime = -1;
+      continue;
+    }
+    // latency trail starts when the packet is read
+    long long captureTime = shm_timestamp();
+    demuxStage_.add(captureTime - start);
+
+    int index = packet->stream_index;
+    if( (index >= 0) && (index < (int) codecCtxs_.size()) )
+    {
+      if(packet->pts != AV_NOPTS_VALUE)
+      {
+        long long end = av_rescale_q(packet->pts + packet->duration, formatCtx_->streams[index]->time_base, { 1, 1000000000 }) + timeOffset;
+        if(end > endTime) endTime = end;
+      }
+
+      // streams without decoder, and the ones selected (sm_packets), go out compressed
+      if(!codecCtxs_[index] || passthrough(index))
+      {
+        FFMPEGInputItem item;
+        item.packet = av_packet_clone(packet);
+        item.streamIndex = index;
+        item.captureTime = captureTime;
+        item.timeOffset = timeOffset;
+        pushItem(&passthroughQueue_, item, true, &demuxSignal_);
+      }
+      if(decoded(index))
+      {
+        FFMPEGInputItem item;
+        item.packet = av_packet_alloc();
+        av_packet_move_ref(item.packet, packet);
+        item.streamIndex = index;
+        item.captureTime = captureTime;
+        item.timeOffset = timeOffset;
+        pushItem(&packetQueues_[index], item, true, &demuxSignal_);
+      }
+    }
+    av_packet_unref(packet);
+  }
+  av_packet_free(&packet);
+
+  // end of stream: decoders flush
+  for(int i = 0; i < (int) packetQueues_.size(); i++)
+  {
+    FFMPEGInputItem item;
+    item.streamIndex = i;
+    if(decoded(i)) pushItem(&packetQueues_[i], item, true, &demuxSignal_);
+  }
+  demuxDone_ = true;
+  publishSignal_.notify();
+}
+
+// decodeThreadFunc: one stream. Frames go to the publisher with the capture time (and loop offset) of the packet
+// that completed them. End of stream and flush items drain the decoder, after a flush it starts over
+void FFMPEGInputEngine::decodeThreadFunc(int _streamIndex)
+{
+  AVCodecContext *codecCtx = codecCtxs_[_streamIndex];
+  FFMPEGInputStage &stage = decodeStages_[_streamIndex];
+  SPSCSignal *signal = &decodeSignals_[_streamIndex];
+  // playout releases frames on time, dropping them would only lose look ahead
+  bool wait = !frameDrop_ || playing_ || Clock::instance().isVirtual();
+  AVFrame *frame = av_frame_alloc();
+  bool end = false;
+
+  for(int round = 0; !abort_ && !end; )
+  {
+    unsigned long long sample = signal->sample();
+    FFMPEGInputItem item;
+    if(!packetQueues_[_streamIndex].pop(&item))
+    {
+      spsc_backoff(round++, signal, sample);
+      continue;
+    }
+    round = 0;
+    end = (item.packet == nullptr) && !item.flush;
+
+    long long start = shm_timestamp();
+    int ret = avcodec_send_packet(codecCtx, item.packet);
+    if(ret < 0 && item.packet)
+    {
+      notifyError("Error sending packet for decoding: %s", url_.c_str());
+    }
+
+    while(ret >= 0)
+    {
+      ret = avcodec_receive_frame(codecCtx, frame);
+      if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      {
+        break;
+      }
+      else if(ret < 0)
+      {
+        notifyError("Error during decoding: %s", url_.c_str());
+        break;
+      }
+      stage.add(shm_timestamp() - start);
+
+      FFMPEGInputItem out;
+      out.frame = av_frame_alloc();
+      av_frame_move_ref(out.frame, frame);
+      out.streamIndex = _streamIndex;
+      out.captureTime = item.captureTime;
+      out.timeOffset = item.timeOffset;
+      if(!pushItem(&frameQueues_[_streamIndex], out, wait, signal)) stage.drop();
+      start = shm_timestamp();
+    }
+    if(item.flush)
+    {
+      // next loop pass
+      avcodec_flush_buffers(codecCtx);
+    }
+    freeItem(&item);
+  }
+  av_frame_free(&frame);
+
+  // publisher counts the decoders done
+  FFMPEGInputItem item;
+  item.streamIndex = _streamIndex;
+  pushItem(&frameQueues_[_streamIndex], item, true, signal);
+}
+
+// publishThreadFunc: only writer of the shared memory rings. Takes the head item due first among the streams and
+// the passthrough packets (playout: at its presentation time, else as soon as there is one, streams in turn so a
+// busy one does not hold back the others) and feeds the preview
+void FFMPEGInputEngine::publishThreadFunc()
+{
+  int decoders = 0;
+  for(int i = 0; i < (int) frameQueues_.size(); i++)
+  {
+    if(decoded(i)) decoders++;
+  }
+
+  int queues = (int) frameQueues_.size() + 1;
+  for(int round = 0; !abort_; )
+  {
+    // queue with the head due first. The last one is the passthrough queue
+    unsigned long long sample = publishSignal_.sample();
+    long long now = shm_timestamp();
+    SPSCQueue<FFMPEGInputItem> *next = nullptr;
+    long long nextDue = 0;
+    for(int n = 0; n < queues; n++)
+    {
+      int i = (publishNext_ + n) % queues;
+      SPSCQueue<FFMPEGInputItem> *queue = (i < (int) frameQueues_.size())? &frameQueues_[i] : &passthroughQueue_;
+      FFMPEGInputItem item;
+      if(!queue->peek(&item)) continue;
+      long long due = dueTime(item, now);
+      if(!next || due < nextDue)
+      {
+        next = queue;
+        nextDue = due;
+      }
+    }
+
+    if(!next)
+    {
+      // done: every decoder ended and demux has nothing more to pass through
+      if(decoders == 0 && demuxDone_ && passthroughQueue_.size() == 0) break;
+      spsc_backoff(round++, &publishSignal_, sample);
+      continue;
+    }
+    round = 0;
+
+    // playout: coarse waits while it is far, woken by items decoded meanwhile, they may be due earlier
+    if(nextDue - now > PLAYOUT_POLL)
+    {
+      publishSignal_.wait(sample, PLAYOUT_POLL);
+      continue;
+    }
+    if(nextDue > now)
+    {
+      FramePacer::sleepUntil(nextDue);
+    }
+
+    FFMPEGInputItem item;
+    next->pop(&item);
+    publishNext_ = (publishNext_ + 1) % queues;
+    if(!item.frame && !item.packet)
+    {
+      decoders--;
+      continue;
+    }
+    publishItem(&item);
+    freeItem(&item);
+  }
+  publishDone_ = true;
+  previewSignal_.notify();
+}
+
+// dueTime: shm_timestamp() an item is released at. Playout maps its presentation time on the media clock, the
+// first item anchors it (on a house tick with house_clock). Items without timestamps, and everything when not
+// playing out, are due now
+long long FFMPEGInputEngine::dueTime(const FFMPEGInputItem &_item, long long _now)
+{
+  if(!playing_ || (!_item.frame && !_item.packet)) return _now;
+
+  int64_t ts = _item.frame? _item.frame->best_effort_timestamp : ((_item.packet->dts != AV_NOPTS_VALUE)? _item.packet->dts : _item.packet->pts);
+  if(ts == AV_NOPTS_VALUE) return _now;
+  long long media = av_rescale_q(ts, formatCtx_->streams[_item.streamIndex]->time_base, { 1, 1000000000 }) + _item.timeOffset;
+
+  if(playoutAnchor_ < 0)
+  {
+    if(playoutOrigin_ == AV_NOPTS_VALUE) playoutOrigin_ = media;
+    playoutAnchor_ = (housePhase_ >= 0)? FramePacer::houseAlign(_now, housePhase_ * 1000000LL) : _now;
+  }
+
+  long long due = playoutAnchor_ + (media - playoutOrigin_);
+  if(_now - due > PLAYOUT_RESYNC)
+  {
+    // stalled (slow decode, seek): the schedule moves on from now
+    notifyWarning("Playout %lld ms behind, resynced: %s", (_now - due) / 1000000, url_.c_str());
+    playoutAnchor_ += _now - due;
+    due = _now;
+  }
+  return due;
+}
+
+// publishItem: frame or passthrough packet to the rings, timestamps moved on by the loop passes before it
+void FFMPEGInputEngine::publishItem(FFMPEGInputItem *_item)
+{
+  long long start = shm_timestamp();
+  AVStream *stream = formatCtx_->streams[_item->streamIndex];
+  if(_item->timeOffset != 0)
+  {
+    int64_t offset = av_rescale_q(_item->timeOffset, { 1, 1000000000 }, stream->time_base);
+    if(_item->frame && _item->frame->pts != AV_NOPTS_VALUE) _item->frame->pts += offset;
+    if(_item->frame && _item->frame->best_effort_timestamp != AV_NOPTS_VALUE) _item->frame->best_effort_timestamp += offset;
+    if(_item->packet && _item->packet->pts != AV_NOPTS_VALUE) _item->packet->pts += offset;
+    if(_item->packet && _item->packet->dts != AV_NOPTS_VALUE) _item->packet->dts += offset;
+  }
+
+  AVFrameExt frameExt;
+  frameExt.timeBase = stream->time_base;
+  frameExt.fieldOrder = stream->codecpar->field_order;
+  frameExt.mediaType = stream->codecpar->codec_type;
+  frameExt.streamIndex = _item->streamIndex;
+  frameExt.AVFrame = _item->frame;
+  frameExt.AVPacket = _item->frame? nullptr : _item->packet;
+  if(!_item->frame) frameExt.codecPar = stream->codecpar;
+  frameExt.times.capture = _item->captureTime;
+  // sm producer
+  sm_.write(&frameExt);
+  publishStage_.add(shm_timestamp() - start);
+
+  // preview
+  if(_item->frame && previewWindow_ && (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO))
+  {
+    AVFrame *preview = av_frame_clone(_item->frame);
+    if(preview && !previewQueue_.push(preview))
+    {
+      av_frame_free(&preview);
+      previewStage_.drop();
+    }
+  }
+}
+
+// localFile: url read through the file protocol
+bool FFMPEGInputEngine::localFile()
+{
+  const char *protocol = avio_find_protocol_name(url_.c_str());
+  return protocol && (std::string(protocol) == "file");
+}
+
+// pushItem: backpressure (_wait) until there is room or abort, else drop. The pushing stage blocks on its _signal.
+// False when the item was dropped (freed)
+bool FFMPEGInputEngine::pushItem(SPSCQueue<FFMPEGInputItem> *_queue, FFMPEGInputItem _item, bool _wait, SPSCSignal *_signal)
+{
+  for(int round = 0; ; round++)
+  {
+    unsigned long long sample = _signal->sample();
+    if(_queue->push(_item)) return true;
+    if(!_wait || abort_)
+    {
+      freeItem(&_item);
+      return false;
+    }
+    spsc_backoff(round, _signal, sample);
+  }
+}
+
+void FFMPEGInputEngine::freeItem(FFMPEGInputItem *_item)
+{
+  if(_item->packet) av_packet_free(&_item->packet);
+  if(_item->frame) av_frame_free(&_item->frame);
+}
+
+// reportPipeline: per stage timing once per PIPELINE_REPORT_INTERVAL, statistics start over
+void FFMPEGInputEngine::reportPipeline(long long _now)
+{
+  if(lastReport_ == 0) lastReport_ = _now;
+  if(_now - lastReport_ < PIPELINE_REPORT_INTERVAL) return;
+  lastReport_ = _now;
+
+  std::string report = demuxStage_.report();
+  for(auto &stage : decodeStages_)
+  {
+    if(stage.time.count() > 0 || stage.drops > 0) report += ", " + stage.report();
+  }
+  report += ", " + publishStage_.report();
+  if(previewWindow_) report += ", " + previewStage_.report();
+  notifyInfo("Pipeline %s", report.c_str());
+}
+
+// report: "decode 0 n 1500 p50 4.10 p99 9.83 max 12.20 ms drops 0", statistics start over
+std::string FFMPEGInputStage::report()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string ret = name + " " + time.summary() + " drops " + std::to_string(drops);
+  time.reset();
+  drops = 0;
+  return ret;
+}
+
+// setOpenReader: hand the stream over between the worker (opens it) and the main thread (runs it)
+void FFMPEGInputEngine::setOpenReader(bool _open)
+{
+  {
+    std::lock_guard<std::mutex> lock(readerMutex_);
+    openReader_ = _open;
+  }
+  readerCond_.notify_all();
+}
+
 void FFMPEGInputEngine::workerThreadFunc()
 {
-  openReader_ = true;
+  setOpenReader(true);
   bool notifyErr = true;
 
   while(!abort_)
@@ -689,6 +1183,13 @@ void FFMPEGInputEngine::workerThreadFunc()
             AVCodecContext *codecCtx = avcodec_alloc_context3(codec);
             avcodec_parameters_to_context(codecCtx, codecPar);
 
+            // decode straight into the shared memory slot when the decoder allows it
+            sm_.attach(codecCtx, codec);
+
+            // slice threading, frame threading only when asked for (thread_count, thread_type)
+            codecCtx->thread_count = threadCount_;
+            codecCtx->thread_type = threadType_;
+
             // Open codec
             if(avcodec_open2(codecCtx, codec, nullptr) < 0)
             {
@@ -702,16 +1203,15 @@ void FFMPEGInputEngine::workerThreadFunc()
           
           av_dict_free(&dict);
           notifyInfo("Stream opened: %s", url_.c_str());
-          openReader_ = false;       
+          setOpenReader(false);
           notifyErr = true;
         }
       }
     } 
  
-    if(!openReader_)
-    {
-      std::this_thread::sleep_for(1ms);
-    }
+    // stream open: sleep until it ends or a load command asks for another one
+    std::unique_lock<std::mutex> lock(readerMutex_);
+    readerCond_.wait(lock, [&] { return openReader_ || abort_; });
   }
 
   // close previously
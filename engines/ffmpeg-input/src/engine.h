@@ -4,7 +4,12 @@
 #include <mutex>
 #include <map>
 #include <vector>
+#include <atomic>
+#include <condition_variable>
 #include "FFMPEG_sm_element.h"
+#include "FFMPEG_sm_producer.h"
+#include "spsc_queue.h"
+#include "latency.h"
 
 extern "C" {
 #include <libavutil/imgutils.h>
@@ -14,7 +19,45 @@ extern "C" {
 #include <libavutil/time.h>
 }
 
-// FFMPEGInputEngine
+#define PACKET_QUEUE_SIZE 64                // packets demuxed ahead of each decoder
+#define FRAME_QUEUE_SIZE 8                  // decoded frames ahead of the publisher, per stream
+#define PREVIEW_QUEUE_SIZE 2                // frames waiting for the preview window, dropped when full
+#define PIPELINE_REPORT_INTERVAL 60000000000LL  // ns between stage timing reports
+#define PLAYOUT_POLL 5000000LL              // ns the publisher waits at most for new items before looking at the queues again
+#define PLAYOUT_RESYNC 500000000LL          // ns behind schedule before the playout clock moves on instead of bursting
+
+class SDLRenderer;
+
+// FFMPEGInputItem: what flows between pipeline stages. A packet, a decoded frame, or neither: end of stream
+// (flush: end of a loop pass, the decoder drains and goes on)
+struct FFMPEGInputItem
+{
+  AVPacket *packet = nullptr;
+  AVFrame *frame = nullptr;
+  int streamIndex = -1;
+  long long captureTime = 0;        // latency trail start, when the packet was read
+  long long timeOffset = 0;         // ns added to the timestamps, loop passes before this one
+  bool flush = false;
+};
+
+// FFMPEGInputStage: time a stage spends per item (queue waits left out) and items it dropped
+struct FFMPEGInputStage
+{
+  std::string name;
+  std::mutex mutex;
+  LatencyHistogram time;
+  long long drops = 0;
+
+  void add(long long _ns) { std::lock_guard<std::mutex> lock(mutex); time.add(_ns); }
+  void drop() { std::lock_guard<std::mutex> lock(mutex); drops++; }
+  std::string report();
+};
+
+// FFMPEGInputEngine: demux, one decoder per stream and publish run as stages on their own threads, connected
+// by bounded lock free queues. Packets always wait for their decoder, decoded frames wait for the publisher
+// or are dropped (frame_queue='drop'). The preview is fed last and drops, it never holds back the rest.
+// Playout (local files): the publisher releases frames and packets at their presentation time against a media
+// clock started with the stream (aligned on the house clock with house_clock), the queues are the look ahead
 class FFMPEGInputEngine
 {
 public:
@@ -27,10 +70,23 @@ public:
 protected:
   bool loadConfiguration(const char *_JsonConfig);
   void workerThreadFunc();
+  void setOpenReader(bool _open);
+  bool passthrough(int _streamIndex);
+  bool decoded(int _streamIndex);
+  void runPipeline(SDLRenderer *_renderer);
+  void demuxThreadFunc();
+  void decodeThreadFunc(int _streamIndex);
+  void publishThreadFunc();
+  bool pushItem(SPSCQueue<FFMPEGInputItem> *_queue, FFMPEGInputItem _item, bool _wait, SPSCSignal *_signal);
+  static void freeItem(FFMPEGInputItem *_item);
+  void reportPipeline(long long _now);
+  void publishItem(FFMPEGInputItem *_item);
+  long long dueTime(const FFMPEGInputItem &_item, long long _now);
+  bool localFile();
 
 protected:
   std::string UID_;                                              // uid
-  bool abort_ = false;                                           // abort flag
+  std::atomic<bool> abort_ { false };                            // abort flag, read by every stage thread
   int width_ = 1920;                                             // default width
   int height_ = 1080;                                            // default height
   AVRational frameRate_ = { 25, 1 };                             // default framerate
@@ -41,7 +97,40 @@ protected:
   std::map<std::string, std::string> extraParams_;               // extra params (timeout='5')
   int maxBufferSize_ = 1;                                        // max buffer size
   int timeoutOpen_ = 5;                                          // in seconds
+  int smPolicy_ = SHM_POLICY_LATEST;                             // sm ring policy (sm_policy='lossless')
+  bool smIntegrity_ = false;                                     // debug: payload crc32c (sm_crc='1')
+  int smPins_ = DEFAULT_SM_PINNED;                               // slots consumers can keep frames in (sm_pins='n')
+  std::string smPackets_;                                        // streams also published as packets (sm_packets='video,audio|0,1|all')
+  bool smDecode_ = true;                                         // decode the packet streams too (sm_decode='0')
+  int housePhase_ = -1;                                          // frames end ms after the house clock ticks (house_clock='ms'), -1: free running
+  bool frameDrop_ = false;                                       // decoded frames dropped when the publisher is behind (frame_queue='drop')
+  int threadCount_ = 0;                                          // decoder threads, 0: auto (thread_count='n')
+  int threadType_ = FF_THREAD_SLICE;                             // decoder threading (thread_type='slice|frame|frame,slice'). Frame threading adds a frame of latency per thread, opt in
+  int playout_ = -1;                                             // release at presentation time (playout='0|1'), -1: local files
+  bool loop_ = false;                                            // seek back to the start at the end (loop='1')
   bool openReader_ = true;                                       // open reader flag
+  std::mutex readerMutex_;                                       // openReader_ (and abort_) changes, decodeSignals_
+  std::condition_variable readerCond_;
   AVFormatContext *formatCtx_ = nullptr;                         // reader open vars
   std::vector<AVCodecContext *> codecCtxs_;                       // reader decode vars
+  FFMPEGSharedMemoryProducer sm_;                                // sm protocol
+  std::vector<SPSCQueue<FFMPEGInputItem>> packetQueues_;         // demux -> decoder, per stream
+  std::vector<SPSCQueue<FFMPEGInputItem>> frameQueues_;          // decoder -> publish, per stream
+  SPSCQueue<FFMPEGInputItem> passthroughQueue_;                  // demux -> publish, compressed packets
+  SPSCQueue<AVFrame *> previewQueue_;                            // publish -> preview (this thread)
+  SPSCSignal demuxSignal_;                                       // stage wake ups: demux (room in its queues)
+  std::vector<SPSCSignal> decodeSignals_;                        // decoders (packet in, room for frames)
+  SPSCSignal publishSignal_;                                     // publisher (item in, demux done)
+  SPSCSignal previewSignal_;                                     // preview (frame in, publisher done)
+  std::atomic<bool> demuxDone_ { false };                        // no more packets from demux
+  std::atomic<bool> publishDone_ { false };                      // every stage done, the stream is over
+  FFMPEGInputStage demuxStage_;                                  // per stage timing
+  std::vector<FFMPEGInputStage> decodeStages_;
+  FFMPEGInputStage publishStage_;
+  FFMPEGInputStage previewStage_;
+  long long lastReport_ = 0;
+  bool playing_ = false;                                         // playout of the open stream
+  long long playoutOrigin_ = 0;                                  // media ns at the playout anchor
+  long long playoutAnchor_ = -1;                                 // shm_timestamp() of the origin, -1: on the first item
+  int publishNext_ = 0;                                          // round robin start among equally due queues
 }; 
@@ -3,7 +3,8 @@
 #include <chrono>
 #include "engine.h"
 #include "notifier.h"
-#include "sync_clock.h"
+#include "frame_pacer.h"
+#include "clock.h"
 #include "SDLRenderer.h"
 #include "FFMPEG_utils.h"
 
@@ -13,6 +14,7 @@ const char APP_VERSION_STR[] = "0.0.1";
 
 const char UID[] = "uid";
 const char SRCUID[] = "src_uid";
+const char BACKUPSRCUID[] = "backup_src_uid";
 const char NAME[] = "name";
 const char AUTOSTART[] = "autostart";
 const char PREVIEW[] = "preview";
@@ -66,6 +68,15 @@ std::string getJsonSchema()
   writer.Bool(true);
   writer.EndObject(); // } // srcuid
 
+  // backup srcuid
+  writer.Key(BACKUPSRCUID);
+  writer.StartObject(); // {
+  writer.Key("title");
+  writer.String("BACKUP SOURCE UID");
+  writer.Key("type");
+  writer.String("string");
+  writer.EndObject(); // } // backup srcuid
+
   // name
   writer.Key(NAME);
   writer.StartObject(); // {
@@ -316,6 +327,11 @@ bool FFMPEGOutputEngine::loadConfiguration(const char *_JsonConfig)
     srcUID_ = d[SRCUID].GetString();
   }
 
+  if(d.HasMember(BACKUPSRCUID) && d[BACKUPSRCUID].IsString())
+  {
+    backupSrcUID_ = d[BACKUPSRCUID].GetString();
+  }
+
   if(d.HasMember(WIDTH) && d[WIDTH].IsInt())
   {
     width_ = d[WIDTH].GetInt();
@@ -369,6 +385,16 @@ bool FFMPEGOutputEngine::loadConfiguration(const char *_JsonConfig)
     {
       timeoutOpen_ = std::stoi(extraParams_["timeout"]);
     }
+
+    if(extraParams_.find("backup_stall") != extraParams_.end())
+    {
+      backupStall_ = std::stoi(extraParams_["backup_stall"]);
+    }
+
+    if(extraParams_.find("house_clock") != extraParams_.end())
+    {
+      housePhase_ = std::stoi(extraParams_["house_clock"]);
+    }
   }
 
   return true;
@@ -432,35 +458,52 @@ bool FFMPEGOutputEngine::run(const char *_JsonConfig)
 
   // frame count and clock
   int64_t frameCount = 0;
-  SyncClock clock;
+  FramePacer pacer;
+  if(housePhase_ >= 0 && !pacer.lock(housePhase_ * 1000000LL))
+  {
+    notifyWarning("House clock not available, free running");
+  }
 
   // renderer
   SDLRenderer renderer;
   renderer.init(UID_.c_str());
 
+  // offline: every source frame, no filler and no backup (stalls are just the pipeline working)
+  bool offline = Clock::instance().isVirtual();
+
+  // backup source, switched to while the source stalls
+  if(!backupSrcUID_.empty() && !offline)
+  {
+    smc_.setBackup(backupSrcUID_.c_str(), backupStall_);
+  }
+
   while(!abort_)
   {
-    // consumer
-    bool initOk = smc_.init(srcUID_.c_str(), timeoutOpen_ * 1000);
-    if(initOk)
+    // consumer. Stays attached when the source restarts and follows it in place
+    if(!smc_.attached())
+    {
+      smc_.init(srcUID_.c_str(), timeoutOpen_ * 1000);
+    }
+    if(smc_.attached())
     {
-      while(smc_.opened())
+      AVFrameExt *frame = smc_.read();
+      if(frame)
       {
-        AVFrameExt *frame = smc_.read();
-        if(!frame)
-        {
-          break;
-        }
-
         // preview
         if(previewWindow_ && (frame->mediaType == AVMEDIA_TYPE_VIDEO))
         {
           renderer.render(frame->AVFrame);
         }
 
-        free_AVFrameExt(&frame);      
+        free_AVFrameExt(&frame);
+        continue;
       }
-      smc_.deinit();
+    }
+    if(offline)
+    {
+      // no filler offline, wait for the source
+      if(!smc_.attached()) std::this_thread::sleep_for(1ms);
+      continue;
     }
 
     // draw video
@@ -476,10 +519,12 @@ bool FFMPEGOutputEngine::run(const char *_JsonConfig)
 
     frameCount++;
 
-    AVFrameExt frameExt = { videoTimeBase, fieldOrder_, AVMEDIA_TYPE_VIDEO, 0, videoFrame };
-
-    // duration
-    long long frd = frameDuration(&frameExt);
+    AVFrameExt frameExt;
+    frameExt.timeBase = videoTimeBase;
+    frameExt.fieldOrder = fieldOrder_;
+    frameExt.mediaType = AVMEDIA_TYPE_VIDEO;
+    frameExt.streamIndex = 0;
+    frameExt.AVFrame = videoFrame;
 
     // preview
     if(previewWindow_)
@@ -487,8 +532,11 @@ bool FFMPEGOutputEngine::run(const char *_JsonConfig)
       renderer.render(frameExt.AVFrame);
     }
 
-    // sync    
-    clock.sync(frd);
+    // pace, absolute deadlines
+    AVRational period = framePeriod(&frameExt);
+    pacer.wait(period.num, period.den);
+    std::string report = pacer.report();
+    if(!report.empty()) notifyInfo("Pacer %s", report.c_str());
   }
 
   renderer.cleanUp();
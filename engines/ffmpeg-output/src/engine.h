@@ -23,6 +23,7 @@ protected:
 protected:
   std::string UID_;
   std::string srcUID_;                                           // source
+  std::string backupSrcUID_;                                     // backup source, used while the source stalls
   bool abort_ = false;                                           // abort flag
   int width_ = 1920;                                             // default width
   int height_ = 1080;                                            // default height
@@ -33,4 +34,6 @@ protected:
   FFMPEGSharedMemoryConsumer smc_;                               // shared memory surfaces
   std::map<std::string, std::string> extraParams_;               // extra params (timeout='5')
   int timeoutOpen_ = 5;                                          // in seconds
+  int backupStall_ = 0;                                          // ms without frames before switching to backup (0: two frames)
+  int housePhase_ = -1;                                          // frames end ms after the house clock ticks (house_clock='ms'), -1: free running
 };
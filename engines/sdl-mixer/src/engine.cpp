@@ -9,7 +9,8 @@
 #include <algorithm>
 #include "engine.h"
 #include "notifier.h"
-#include "sync_clock.h"
+#include "frame_pacer.h"
+#include "clock.h"
 #include "SDLRenderer.h"
 #include "FFMPEG_sm_producer.h"
 #include "FFMPEG_sm_consumer.h"
@@ -22,6 +23,7 @@ const char APP_VERSION_STR[] = "0.0.1";
 const char UID[] = "id";
 const char NAME_[] = "name";
 const char SCHEMA[] = "schema";
+const char HOUSE_CLOCK[] = "house_clock";
 
 // getJsonSchema
 std::string getJsonSchema()
@@ -79,6 +81,17 @@ std::string getJsonSchema()
   writer.String("string");
   writer.EndObject(); // } // schems
 
+  // house clock phase
+  writer.Key(HOUSE_CLOCK);
+  writer.StartObject(); // {
+  writer.Key("title");
+  writer.String("House clock phase (ms, -1 free running)");
+  writer.Key("type");
+  writer.String("number");
+  writer.Key("default");
+  writer.Int(-1);
+  writer.EndObject(); // } // house_clock
+
   writer.EndObject(); // } // properties
 
   writer.EndObject(); // }
@@ -285,7 +298,7 @@ SMultiviewerCongif* parseScene(const char* _JsonConfig)
 
       if(it->HasMember(UID))
       {
-        mvv->UID = (*it)[UID].GetInt();
+        mvv->UID = (*it)[UID].IsString()? (*it)[UID].GetString() : "";
       }
 
       if(it->HasMember(NAME))
@@ -579,6 +592,11 @@ bool SDLMixerEngine::loadConfiguration(const char* _JsonConfig)
     nextConfiguration_.push_back(d[SCHEMA].GetString());
   }
 
+  if(d.HasMember(HOUSE_CLOCK) && d[HOUSE_CLOCK].IsInt())
+  {
+    housePhase_ = d[HOUSE_CLOCK].GetInt();
+  }
+
   return true;
 }
 
@@ -634,7 +652,12 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
 
   // 
   int64_t frameCount = 0;
-  SyncClock clock;
+  FramePacer pacer;
+  bool offline = Clock::instance().isVirtual();
+  if(housePhase_ >= 0 && !pacer.lock(housePhase_ * 1000000LL))
+  {
+    notifyWarning("House clock not available, free running");
+  }
 
   UID_ = "MIXER";
 
@@ -671,6 +694,8 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
 
       if(nextConfig)
       {
+        sm.setFrameRate(nextConfig->timeBase.den, nextConfig->timeBase.num);
+
         // FFMPEG
         if(videoFrame)
         {
@@ -698,16 +723,18 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
         SDL_PixelFormatEnum sdlPixForm = FFMPEGPixelFormat2SDLPixelFormat((AVPixelFormat)nextConfig->format);      
         surface = SDL_CreateRGBSurfaceWithFormatFrom(videoFrame->data[0], videoFrame->width, videoFrame->height, bpp, videoFrame->linesize[0], sdlPixForm);
 
-        // threads
-        std::vector<std::mutex> list(std::max(producerThread.size(), nextConfig->viewer.size()));
-        frameBufferMutex_.swap(list);
+        // threads. Running ones keep their buffer, new views get a new one
         for(size_t i = producerThread.size(); i < nextConfig->viewer.size(); i++)
         {
-          configureProducer_.push_back(false);
-          frameBuffer_.push_back(std::list<AVFrameExt *>());        
-          producerThread.push_back(std::thread([&, i] {
-            workerThreadFunc((int) i);
-          }));       
+          {
+            std::lock_guard<std::mutex> lock(sourcesMutex_);
+            sources_.push_back(SMixerSource());
+          }
+          buffers_.push_back(std::unique_ptr<SMixerBuffer>(new SMixerBuffer()));
+          SMixerBuffer *buffer = buffers_.back().get();
+          producerThread.push_back(std::thread([this, i, buffer] {
+            workerThreadFunc((int) i, buffer);
+          }));
         }
 
         // already configured
@@ -719,10 +746,26 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
         currentConfiguration_ = nextConfiguration;
         nextConfiguration.clear();
 
+        // view sources, views past the new layout go idle
+        {
+          std::lock_guard<std::mutex> lock(sourcesMutex_);
+          for(size_t i = 0; i < sources_.size(); i++)
+          {
+            SMixerSource source;
+            if(i < config->viewer.size())
+            {
+              source.UID = config->viewer[i]->UID;
+              source.width = config->viewer[i]->w;
+              source.height = config->viewer[i]->h;
+            }
+            sources_[i] = source;
+          }
+        }
+
         // 
-        for(size_t i = 0; i < producerThread.size(); i++)
+        for(size_t i = 0; i < buffers_.size(); i++)
         {
-          configureProducer_[i] = true;
+          buffers_[i]->configure = true;
         }
       }
     }
@@ -751,12 +794,30 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
       int x = config->viewer[i]->x;
       int y = config->viewer[i]->y;
 
-      AVFrameExt *frameExtInput = pop(i);
+      // offline: every tile waits for the next frame of its source, frame exact
+      long long wait = 0;
+      if(offline)
+      {
+        std::lock_guard<std::mutex> lock(sourcesMutex_);
+        wait = sources_[i].UID.empty()? 0 : OFFLINE_TILE_WAIT;
+      }
+
+      AVFrameExt *frameExtInput = pop(buffers_[i].get(), wait);
       bool validInput = !!frameExtInput;
+      if(frameExtInput && !frameValid(frameExtInput))
+      {
+        // producer wrote over the slot before we got to it
+        free_AVFrameExt(&frameExtInput);
+      }
       if(frameExtInput)
       {         
-        // convert and scale
-        AVFrame *frame = frameConvert(frameExtInput->AVFrame, w, h, (AVPixelFormat) frameExtInput->AVFrame->format);
+        // convert and scale. Renditions already come at the tile size
+        AVFrame *input = frameExtInput->AVFrame;
+        bool scale = (input->width != w) || (input->height != h);
+        AVFrame *frame = scale? frameConvert(input, w, h, (AVPixelFormat) input->format) : input;
+
+        // slot overwritten while converting. Drop the tile
+        validInput = frameValid(frameExtInput);
 
         // 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff // transparent verde
         // 0x0000ff00, 0x00ff0000, 0xff000000, 0x000000ff // transparent amarillo
@@ -769,15 +830,21 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
         SDL_Surface *inputSurface = SDL_CreateRGBSurfaceWithFormatFrom(frame->data[0], frame->width, frame->height, bpp, frame->linesize[0], sdlPixForm);
 
         // Blit surface2 onto surface1 at the specified position
-        SDL_Rect srcRect = { 0, 0, inputSurface->w, inputSurface->h };
-        SDL_Rect destRect = { x, y, inputSurface->w, inputSurface->h };
-        SDL_BlitSurface(inputSurface, &srcRect, surface, &destRect);
+        if(validInput)
+        {
+          SDL_Rect srcRect = { 0, 0, inputSurface->w, inputSurface->h };
+          SDL_Rect destRect = { x, y, inputSurface->w, inputSurface->h };
+          SDL_BlitSurface(inputSurface, &srcRect, surface, &destRect);
+        }
 
         // release
         SDL_FreeSurface(inputSurface);
 
         // release converted frame
-        frameFree(frame);
+        if(scale)
+        {
+          frameFree(frame);
+        }
 
         // release frame from input
         free_AVFrameExt(&frameExtInput);
@@ -804,16 +871,38 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
     videoFrame->duration = av_rescale_q(1, config->timeBase, config->timeBase);
     frameCount++;
 
-    AVFrameExt frameExt = { config->timeBase, config->fieldOrder, AVMEDIA_TYPE_VIDEO, 0, videoFrame };
+    AVFrameExt frameExt;
+    frameExt.timeBase = config->timeBase;
+    frameExt.fieldOrder = config->fieldOrder;
+    frameExt.mediaType = AVMEDIA_TYPE_VIDEO;
+    frameExt.streamIndex = 0;
+    frameExt.AVFrame = videoFrame;
 
     // render
     renderer.render(frameExt.AVFrame);
 
-    // sync
-    long long frd = frameDuration(&frameExt);
-    clock.sync(frd);
+    // pace, absolute deadlines
+    AVRational period = framePeriod(&frameExt);
+    pacer.wait(period.num, period.den);
+    std::string report = pacer.report();
+    if(!report.empty()) notifyInfo("Pacer %s", report.c_str());
   }
 
+  // producer threads stop on abort_, then their buffers go
+  for(size_t i = 0; i < producerThread.size(); i++)
+  {
+    if(producerThread[i].joinable()) producerThread[i].join();
+  }
+  for(size_t i = 0; i < buffers_.size(); i++)
+  {
+    for(auto it = buffers_[i]->frames.begin(); it != buffers_[i]->frames.end(); it++)
+    {
+      AVFrameExt *frame = *it;
+      free_AVFrameExt(&frame);
+    }
+  }
+  buffers_.clear();
+
   if(config)
   {
     free_config(config);
@@ -833,82 +922,109 @@ bool SDLMixerEngine::run(const char *_JsonConfig)
   return true;
 }
 
-void SDLMixerEngine::workerThreadFunc(int _index)
+void SDLMixerEngine::workerThreadFunc(int _index, SMixerBuffer *_buffer)
 {
   FFMPEGSharedMemoryConsumer smc;
+  SMixerSource source;
 
   while(!abort_)
   {
-    if(configureProducer_[_index])
+    if(_buffer->configure)
     {
+      // frames still buffered belong to the previous source
+      {
+        std::lock_guard<std::mutex> lock(_buffer->mutex);
+        for(auto it = _buffer->frames.begin(); it != _buffer->frames.end(); it++)
+        {
+          AVFrameExt *frame = *it;
+          free_AVFrameExt(&frame);
+        }
+        _buffer->frames.clear();
+      }
+
       // deinit previous one
       smc.deinit();
 
-      // open 
-      smc.init(_index % 2? "CEF_INPUT" : "FFMPEG_INPUT", 5000);
+      // view source
+      {
+        std::lock_guard<std::mutex> lock(sourcesMutex_);
+        source = sources_[_index];
+      }
 
       // configured
-      configureProducer_[_index] = false;
+      _buffer->configure = false;
     }
 
-    if(smc.opened())
+    if(smc.attached())
     {
+      // read blocks until the producer publishes or times out
       AVFrameExt *frame = smc.read();
       if(frame)
       {
         // push frame
-        push(_index, frame);
-      }
-      else
-      {
-        std::this_thread::sleep_for(1ms);
+        push(_buffer, frame);
       }
     }
-    else
+    else if(source.UID.empty())
     {
-      std::this_thread::sleep_for(1ms);
+      // view without source
+      std::this_thread::sleep_for(100ms);
+    }
+    else if(FFMPEGSharedMemoryConsumer::waitSource(source.UID.c_str(), 100))
+    {
+      // source published, open. Tile sized rendition, scaled once by the producer for every mixer showing it
+      smc.setRendition(source.width, source.height);
+      if(!smc.init(source.UID.c_str(), 5000))
+      {
+        std::this_thread::sleep_for(100ms);
+      }
+      // buffered frames pin their slot, no copy and no producer writing over them
+      smc.setZeroCopy(true);
+      smc.setPinned(true);
     }
   }
 }
 
-bool SDLMixerEngine::push(int _index, AVFrameExt *_frame)
+bool SDLMixerEngine::push(SMixerBuffer *_buffer, AVFrameExt *_frame)
 {
-  std::lock_guard<std::mutex> lock(frameBufferMutex_[_index]);
-  frameBuffer_[_index].push_back(_frame);
-  if(frameBuffer_[_index].size() > maxBufferSize_)
   {
-    AVFrameExt *frame = *frameBuffer_[_index].begin();
+  std::unique_lock<std::mutex> lock(_buffer->mutex);
+  // offline: nothing dropped, wait for the mixer to take a frame (woken by pop)
+  while(Clock::instance().isVirtual() && !abort_ && !_buffer->configure && _buffer->frames.size() >= maxBufferSize_)
+  {
+    _buffer->cond.wait_for(lock, 100ms);
+  }
+  _buffer->frames.push_back(_frame);
+  if(_buffer->frames.size() > maxBufferSize_)
+  {
+    AVFrameExt *frame = *_buffer->frames.begin();
     free_AVFrameExt(&frame);
-    frameBuffer_[_index].pop_front();
+    _buffer->frames.pop_front();
   }
+  }
+  _buffer->cond.notify_one();
   return true;
 }
 
-AVFrameExt * SDLMixerEngine::pop(int _index, long long timeout)
+AVFrameExt * SDLMixerEngine::pop(SMixerBuffer *_buffer, long long timeout)
 {
-  long long elapsed = Clock::instance().elapsed() + timeout;
-  long long remaining = timeout;
   AVFrameExt *frame = nullptr;
-  do
+  std::unique_lock<std::mutex> lock(_buffer->mutex);
+
+  // timeout in ns. Woken by push, no polling
+  if(timeout > 0)
   {
-    {
-    std::lock_guard<std::mutex> lock(frameBufferMutex_[_index]);
-    if(frameBuffer_[_index].size() > 0)
-    {
-      frame = *frameBuffer_[_index].begin();
-      frameBuffer_[_index].pop_front();
-    }
-    }
-    if(!frame && (remaining > 0))
-    {
-      remaining = elapsed - Clock::instance().elapsed();
-      if(remaining > 0)
-      {
-        std::this_thread::sleep_for(1ms);
-      }
-    }
+    _buffer->cond.wait_for(lock, std::chrono::nanoseconds(timeout), [&] {
+      return _buffer->frames.size() > 0;
+    });
+  }
+
+  if(_buffer->frames.size() > 0)
+  {
+    frame = *_buffer->frames.begin();
+    _buffer->frames.pop_front();
+    _buffer->cond.notify_one();
   }
-  while(!frame && remaining > 0);
 
   return frame;
 }
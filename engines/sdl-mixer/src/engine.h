@@ -2,9 +2,32 @@
 
 #include <list>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <condition_variable>
 #include <libavutil\rational.h>
 #include "FFMPEG_sm_element.h"
 
+#define OFFLINE_TILE_WAIT 1000000000LL    // ns a tile waits for its source frame offline before it is drawn without
+
+// SMixerSource: what a producer thread reads. The view source and the tile size it is drawn at
+struct SMixerSource
+{
+  std::string UID;
+  int width = 0;
+  int height = 0;
+};
+
+// SMixerBuffer: frames a producer thread buffered for the mixer. Allocated once per view and never moved, so
+// views added by a reconfiguration do not touch the ones producer threads are using
+struct SMixerBuffer
+{
+  std::list<AVFrameExt *> frames;
+  std::mutex mutex;
+  std::condition_variable cond;               // frame pushed (or popped, offline)
+  std::atomic<bool> configure { false };      // view source changed, the producer thread reopens
+};
+
 // SDLMixerEngine
 class SDLMixerEngine
 {
@@ -16,9 +39,9 @@ public:
   bool run(const char *_JsonConfig);
 
 protected:
-  bool push(int _index, AVFrameExt *_frame);
-  AVFrameExt * pop(int _index, long long timeout = 0);
-  void workerThreadFunc(int _index);
+  bool push(SMixerBuffer *_buffer, AVFrameExt *_frame);
+  AVFrameExt * pop(SMixerBuffer *_buffer, long long timeout = 0);
+  void workerThreadFunc(int _index, SMixerBuffer *_buffer);
   bool loadConfiguration(const char* _JsonConfig);
 
 protected:
@@ -27,8 +50,9 @@ protected:
   std::vector<std::string> nextConfiguration_;
   std::mutex nextConfigurationMutex_;
   std::string currentConfiguration_;
-  std::vector<bool> configureProducer_;
-  std::vector<std::list<AVFrameExt *>> frameBuffer_;  // frame buffer per producer
-  std::vector<std::mutex> frameBufferMutex_;          // mutex per producer
+  std::vector<SMixerSource> sources_;                 // view source per producer thread
+  std::mutex sourcesMutex_;
+  std::vector<std::unique_ptr<SMixerBuffer>> buffers_; // frame buffer per producer thread, grown by the main thread only
   int maxBufferSize_ = 2;                             // max buffer size
+  int housePhase_ = -1;                               // frames end ms after the house clock ticks (house_clock), -1: free running
 };
@@ -7,7 +7,8 @@
 #include <iomanip> 
 #include "engine.h"
 #include "notifier.h"
-#include "sync_clock.h"
+#include "frame_pacer.h"
+#include "clock.h"
 #include "SDLRenderer.h"
 #include "FFMPEG_sm_producer.h"
 #include "SDL_utils.h"
@@ -250,7 +251,7 @@ bool SDLRendererEngine::run(const char *_JsonConfig)
   }
 
   int64_t frameCount = 0;
-  SyncClock clock;
+  FramePacer pacer;
 
   UID_ = "CLOCK";
 
@@ -258,14 +259,19 @@ bool SDLRendererEngine::run(const char *_JsonConfig)
   SDLRenderer renderer;
   renderer.init(UID_.c_str(), CLOCK_WIDTH, CLOCK_HEIGHT);
 
-  // sm protocol
+  // sm protocol. Slots sized for the clock frame
   FFMPEGSharedMemoryProducer sm;
-  sm.init(UID_.c_str());
+  sm.setFrameRate(videoTimeBase.den, videoTimeBase.num);
+  sm.init(UID_.c_str(), FFMPEGSharedMemoryProducer::slotSize(CLOCK_WIDTH, CLOCK_HEIGHT, pixFmt));
+
+  // offline: the clock shows virtual time from the start of the run
+  bool offline = Clock::instance().isVirtual();
+  std::time_t startTime = std::time(0);
 
   while(!abort_)
   {
     // Get current time
-    std::time_t timer = std::time(0);
+    std::time_t timer = offline? startTime + (std::time_t) (Clock::instance().elapsed() / 1000000000LL) : std::time(0);
     std::tm bt{};
     localtime_s(&bt, &timer);
     int hour = bt.tm_hour;
@@ -279,7 +285,12 @@ bool SDLRendererEngine::run(const char *_JsonConfig)
     videoFrame->duration = av_rescale_q(1, videoTimeBase, videoTimeBase);
     frameCount++;
 
-    AVFrameExt frameExt = { videoTimeBase, fieldOrder, AVMEDIA_TYPE_VIDEO, 0, videoFrame };
+    AVFrameExt frameExt;
+    frameExt.timeBase = videoTimeBase;
+    frameExt.fieldOrder = fieldOrder;
+    frameExt.mediaType = AVMEDIA_TYPE_VIDEO;
+    frameExt.streamIndex = 0;
+    frameExt.AVFrame = videoFrame;
 
     // shared memory
     sm.write(&frameExt);
@@ -287,9 +298,11 @@ bool SDLRendererEngine::run(const char *_JsonConfig)
     // render
     renderer.render(frameExt.AVFrame);
 
-    // sync
-    long long frd = frameDuration(&frameExt);
-    clock.sync(frd);
+    // pace, absolute deadlines
+    AVRational period = framePeriod(&frameExt);
+    pacer.wait(period.num, period.den);
+    std::string report = pacer.report();
+    if(!report.empty()) notifyInfo("Pacer %s", report.c_str());
   }
 
   renderer.cleanUp();